@@ -0,0 +1,3160 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * acceptor - the background thread of a socketserver port
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * The thread creates the IP socket and accepts connections.  When a
+ * connection is accepted it is written to the socketpair to pass the fd
+ * to a worker using SCM_RIGHTS.  The thread also reads the messages that
+ * workers send back on the socketpair, and watches connections that
+ * workers have parked while they are idle.
+ *
+ * Everything runs from one event loop, built on epoll on Linux and on
+ * poll() elsewhere, with a heap of timers for the deadlines.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "socketserver.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#define ACCEPTOR_MAXEVENTS SOCKETSERVER_POLLER_MAXEVENTS
+/* Connections accepted per wakeup, so worker messages are not starved */
+#define ACCEPTOR_ACCEPT_BATCH 64
+
+#define POLLER_IN SOCKETSERVER_POLLER_IN
+#define POLLER_OUT SOCKETSERVER_POLLER_OUT
+
+#ifdef SOCKETSERVER_DEBUG
+static char debug_msgbuf[512];
+#endif
+
+static void debug(const char * msg) {
+#ifdef SOCKETSERVER_DEBUG
+	strcpy(debug_msgbuf, msg);
+	fprintf(stderr, "%s\n", msg);
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * fds owned by the acceptor --
+ *
+ *      Listening sockets, connections held by the master and the master's
+ *      end of the socketpair must not live on in forked workers: a worker
+ *      holding a copy of a parked connection would keep it open after the
+ *      master closes it.  They are recorded here and closed in the child
+ *      by a fork handler.  The lock is held over creating and closing such
+ *      fds, so a fork never sees one half recorded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static pthread_mutex_t ownedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ownedOnce = PTHREAD_ONCE_INIT;
+static unsigned char *ownedBits = NULL;
+static int ownedSize = 0;
+
+static void owned_prepare(void)
+{
+	pthread_mutex_lock(&ownedMutex);
+}
+
+static void owned_parent(void)
+{
+	pthread_mutex_unlock(&ownedMutex);
+}
+
+static void owned_child(void)
+{
+	int fd;
+
+	for (fd = 0; fd < ownedSize; fd++) {
+		if (ownedBits[fd / 8] & (1 << (fd % 8))) {
+			close(fd);
+		}
+	}
+	memset(ownedBits, 0, ownedSize / 8);
+	pthread_mutex_unlock(&ownedMutex);
+}
+
+static void owned_init(void)
+{
+	pthread_atfork(owned_prepare, owned_parent, owned_child);
+}
+
+/* Called with ownedMutex held. */
+static void owned_set(int fd)
+{
+	if (fd >= ownedSize) {
+		int size = ownedSize ? ownedSize : 1024;
+		while (size <= fd) {
+			size *= 2;
+		}
+		ownedBits = (unsigned char *)realloc(ownedBits, size / 8);
+		memset(ownedBits + ownedSize / 8, 0, (size - ownedSize) / 8);
+		ownedSize = size;
+	}
+	ownedBits[fd / 8] |= 1 << (fd % 8);
+}
+
+/*
+ * Record an fd created by the master that workers must not inherit.
+ */
+void socketserver_ownFd(int fd)
+{
+	pthread_once(&ownedOnce, owned_init);
+	pthread_mutex_lock(&ownedMutex);
+	owned_set(fd);
+	pthread_mutex_unlock(&ownedMutex);
+}
+
+/*
+ * Close an fd recorded with socketserver_ownFd.
+ */
+void socketserver_closeOwnedFd(int fd)
+{
+	pthread_mutex_lock(&ownedMutex);
+	close(fd);
+	if (fd < ownedSize) {
+		ownedBits[fd / 8] &= ~(1 << (fd % 8));
+	}
+	pthread_mutex_unlock(&ownedMutex);
+}
+
+static int owned_accept(int listenFd, struct sockaddr_storage *addr)
+{
+	socklen_t len = sizeof(struct sockaddr_storage);
+	int fd;
+
+	pthread_mutex_lock(&ownedMutex);
+	fd = accept(listenFd, (struct sockaddr *)addr, addr != NULL ? &len : NULL);
+	if (fd != -1) {
+		owned_set(fd);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	return fd;
+}
+
+/*
+ * Create a socketpair whose ends workers must not inherit.
+ *
+ * Returns: 0 for success.
+ */
+int socketserver_ownedSocketpair(int type, int sv[2])
+{
+	int result;
+
+	pthread_once(&ownedOnce, owned_init);
+	pthread_mutex_lock(&ownedMutex);
+	result = socketpair(PF_UNIX, type, 0, sv);
+	if (result == 0) {
+		owned_set(sv[0]);
+		owned_set(sv[1]);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	return result;
+}
+
+static int owned_recvConn(int sock, socketserver_msg *msg, void *pre, size_t preSize, int *fdPtr)
+{
+	int result;
+
+	pthread_mutex_lock(&ownedMutex);
+	result = socketserver_recvConn(sock, msg, pre, preSize, fdPtr);
+	if (*fdPtr != -1) {
+		owned_set(*fdPtr);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * poller --
+ *
+ *      A minimal readiness interface over epoll, or poll() where epoll
+ *      is not available.  Each fd is registered with a pointer that is
+ *      handed back when it is ready.  The TLS threads use it too,
+ *      through the socketserver_poller functions.
+ *
+ *----------------------------------------------------------------------
+ */
+
+typedef struct socketserver_poller {
+#ifdef __linux__
+	int epollFd;
+	struct epoll_event events[ACCEPTOR_MAXEVENTS];
+#else
+	struct pollfd *pfds;
+	void **ptrs;
+	int count;
+	int size;
+#endif
+} acceptor_poller;
+
+#ifdef __linux__
+
+static int poller_init(acceptor_poller *p)
+{
+	pthread_mutex_lock(&ownedMutex);
+	p->epollFd = epoll_create(ACCEPTOR_MAXEVENTS);
+	if (p->epollFd != -1) {
+		owned_set(p->epollFd);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	return p->epollFd == -1 ? -1 : 0;
+}
+
+static void poller_free(acceptor_poller *p)
+{
+	socketserver_closeOwnedFd(p->epollFd);
+}
+
+static int poller_ctl(acceptor_poller *p, int op, int fd, int events, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & POLLER_IN) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLLER_OUT) ? EPOLLOUT : 0);
+	ev.data.ptr = ptr;
+	return epoll_ctl(p->epollFd, op, fd, &ev);
+}
+
+static int poller_add(acceptor_poller *p, int fd, int events, void *ptr)
+{
+	return poller_ctl(p, EPOLL_CTL_ADD, fd, events, ptr);
+}
+
+static int poller_mod(acceptor_poller *p, int fd, int events, void *ptr)
+{
+	return poller_ctl(p, EPOLL_CTL_MOD, fd, events, ptr);
+}
+
+static void poller_del(acceptor_poller *p, int fd)
+{
+	epoll_ctl(p->epollFd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Returns: the number of ready fds, with their pointers in ptrs and
+ * POLLER_* masks in events.
+ */
+static int poller_wait(acceptor_poller *p, int timeout, void **ptrs, int *events)
+{
+	int i, n = epoll_wait(p->epollFd, p->events, ACCEPTOR_MAXEVENTS, timeout);
+
+	for (i = 0; i < n; i++) {
+		int ev = p->events[i].events;
+		ptrs[i] = p->events[i].data.ptr;
+		events[i] = ((ev & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) ? POLLER_IN : 0)
+			| ((ev & (EPOLLOUT|EPOLLERR)) ? POLLER_OUT : 0);
+	}
+	return n < 0 ? 0 : n;
+}
+
+#else /* poll() */
+
+static int poller_init(acceptor_poller *p)
+{
+	memset(p, 0, sizeof(acceptor_poller));
+	return 0;
+}
+
+static void poller_free(acceptor_poller *p)
+{
+	free(p->pfds);
+	free(p->ptrs);
+}
+
+static int poller_find(acceptor_poller *p, int fd)
+{
+	int i;
+
+	for (i = 0; i < p->count; i++) {
+		if (p->pfds[i].fd == fd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int poller_mod(acceptor_poller *p, int fd, int events, void *ptr)
+{
+	int i = poller_find(p, fd);
+
+	if (i == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	p->pfds[i].events = ((events & POLLER_IN) ? POLLIN : 0) | ((events & POLLER_OUT) ? POLLOUT : 0);
+	p->ptrs[i] = ptr;
+	return 0;
+}
+
+static int poller_add(acceptor_poller *p, int fd, int events, void *ptr)
+{
+	if (p->count == p->size) {
+		p->size = p->size ? p->size * 2 : 64;
+		p->pfds = (struct pollfd *)realloc(p->pfds, p->size * sizeof(struct pollfd));
+		p->ptrs = (void **)realloc(p->ptrs, p->size * sizeof(void *));
+	}
+	p->pfds[p->count].fd = fd;
+	p->count++;
+	return poller_mod(p, fd, events, ptr);
+}
+
+static void poller_del(acceptor_poller *p, int fd)
+{
+	int i = poller_find(p, fd);
+
+	if (i != -1) {
+		p->count--;
+		p->pfds[i] = p->pfds[p->count];
+		p->ptrs[i] = p->ptrs[p->count];
+	}
+}
+
+static int poller_wait(acceptor_poller *p, int timeout, void **ptrs, int *events)
+{
+	int i, n = 0;
+
+	if (poll(p->pfds, p->count, timeout) <= 0) {
+		return 0;
+	}
+	for (i = 0; i < p->count && n < ACCEPTOR_MAXEVENTS; i++) {
+		int ev = p->pfds[i].revents;
+		if (ev == 0) {
+			continue;
+		}
+		ptrs[n] = p->ptrs[i];
+		events[n] = ((ev & (POLLIN|POLLHUP|POLLERR)) ? POLLER_IN : 0)
+			| ((ev & (POLLOUT|POLLERR)) ? POLLER_OUT : 0);
+		n++;
+	}
+	return n;
+}
+
+#endif
+
+socketserver_poller *socketserver_pollerNew(void)
+{
+	acceptor_poller *p = (acceptor_poller *)malloc(sizeof(acceptor_poller));
+
+	if (p != NULL && poller_init(p) < 0) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void socketserver_pollerFree(socketserver_poller *p)
+{
+	poller_free(p);
+	free(p);
+}
+
+int socketserver_pollerAdd(socketserver_poller *p, int fd, int events, void *ptr)
+{
+	return poller_add(p, fd, events, ptr);
+}
+
+int socketserver_pollerMod(socketserver_poller *p, int fd, int events, void *ptr)
+{
+	return poller_mod(p, fd, events, ptr);
+}
+
+void socketserver_pollerDel(socketserver_poller *p, int fd)
+{
+	poller_del(p, fd);
+}
+
+int socketserver_pollerWait(socketserver_poller *p, int timeout, void **ptrs, int *events)
+{
+	return poller_wait(p, timeout, ptrs, events);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * timers --
+ *
+ *      A binary min-heap of deadlines in monotonic milliseconds.  Each
+ *      timer knows its heap index so it can be cancelled in O(log n).
+ *
+ *----------------------------------------------------------------------
+ */
+
+struct socketserver_acceptor;
+
+typedef struct acceptor_timer {
+	unsigned long long when;
+	int index; /* position in the heap, -1 when not armed */
+	void (*fire)(struct socketserver_acceptor *acc, void *owner);
+	void *owner;
+} acceptor_timer;
+
+unsigned long long socketserver_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * acceptor state --
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define ACCEPTOR_CONN_PARKED 1 /* idle, watched for the next request */
+#define ACCEPTOR_CONN_DISPATCHED 2 /* copy of a connection a worker is serving */
+#define ACCEPTOR_CONN_QUEUED 3 /* waiting in the acceptor for a free worker */
+#define ACCEPTOR_CONN_CLOSING 4 /* refused, reading until the client closes */
+#define ACCEPTOR_CONN_OVERFLOW 5 /* waiting for room in the socketpair */
+#define ACCEPTOR_CONN_PREREAD 6 /* new, waiting for the first bytes */
+#define ACCEPTOR_CONN_PROXY 7 /* new, reading the PROXY protocol header */
+#define ACCEPTOR_CONN_HELD 8 /* waiting for its client to be under -sourcemax */
+#define ACCEPTOR_CONN_LIMITED 9 /* waiting for the workers to be under -maxinflight */
+
+/* ms between checks of the backlog while over the high watermark */
+#define ACCEPTOR_WATER_POLL 50
+
+/* ms accepting is suspended after the first failure, doubled per failure */
+#define ACCEPTOR_BACKOFF_MIN 10
+#define ACCEPTOR_BACKOFF_MAX 1000
+
+/* ms to wait for each message while taking a port over */
+#define ACCEPTOR_TAKEOVER_WAIT 5000
+
+/* ms between retries of a socketpair send that failed for lack of memory */
+#define ACCEPTOR_OVERFLOW_RETRY 10
+
+/* longest PROXY protocol header read, v1 headers are at most 107 bytes */
+#define ACCEPTOR_PROXY_MAX 536
+#define ACCEPTOR_PROXY_V1_MAX 107
+
+/* ms to wait for a refused client to close before closing on it */
+#define ACCEPTOR_LINGER 2000
+
+/* ms between sweeps of the per-source table, and its largest size */
+#define ACCEPTOR_SOURCE_SWEEP 1000
+#define ACCEPTOR_SOURCE_MAX (1 << 20)
+
+/* A connection held by the acceptor */
+typedef struct acceptor_conn {
+	int fd;
+	int state; /* ACCEPTOR_CONN_* */
+	unsigned int id; /* id sent to the worker for a dispatched connection */
+	int pool; /* worker pool of a queued, overflowing or held connection */
+	int peek; /* PREREAD only looks at the first bytes, for -route */
+	int proxyLen; /* PROXY header bytes read so far */
+	socketserver_msg arrival; /* how a waiting connection arrived, acceptedAt is when it became ready */
+	unsigned char *pre; /* arrival.preLen bytes read ahead, or -preread bytes while reading */
+	acceptor_timer timer;
+	int dead; /* closed, freed at the end of the event batch */
+	struct acceptor_conn *idNext; /* chain in the id table */
+	struct acceptor_conn *qPrev; /* neighbours in the queue, overflow, held or limited list */
+	struct acceptor_conn *qNext;
+	struct acceptor_conn *allPrev; /* neighbours in the list of all connections */
+	struct acceptor_conn *allNext;
+	struct acceptor_conn *nextPtr;
+} acceptor_conn;
+
+/*
+ * A worker pool, the port's own workers or those of a -route pool, and
+ * the connections waiting for it.
+ */
+typedef struct acceptor_pool {
+	int in; /* master end of the pool's socketpair */
+	int credits; /* connections the workers have asked for, minus those sent */
+	acceptor_conn *qHead; /* oldest queued connection */
+	acceptor_conn *qTail; /* newest queued connection */
+	int qLength;
+	unsigned long long qLastEmpty; /* when the queue was last empty */
+	acceptor_conn *oHead; /* oldest connection waiting for room in the socketpair */
+	acceptor_conn *oTail;
+	int oLength;
+	acceptor_timer overflowTimer; /* retry after ENOBUFS, which poll does not report */
+} acceptor_pool;
+
+/*
+ * A client address under -sourcemax or -sourcerate, in an open-addressing
+ * table.  family 0 marks an empty slot.
+ */
+typedef struct acceptor_source {
+	socketserver_peer addr; /* port is not used */
+	int active; /* connections sent to the workers and not reported done */
+	int tokens; /* thousandths of a new connection the client may open now */
+	unsigned long long refilled; /* when tokens was brought up to date */
+	acceptor_conn *hHead; /* oldest connection waiting for a slot */
+	acceptor_conn *hTail;
+} acceptor_source;
+
+typedef struct socketserver_acceptor {
+	socketserver_port *port;
+	socketserver_config config; /* copy of port->config */
+	unsigned int configEpoch;
+	int listenFd;
+	acceptor_pool *pools; /* the port's workers first, then the -route pools */
+	int poolCount;
+	acceptor_poller poller;
+	acceptor_timer **timers;
+	int timerCount;
+	int timerSize;
+	acceptor_conn *graveyard; /* conns closed during this event batch */
+	socketserver_stats *stats;
+	acceptor_conn **ids; /* dispatched connections by id */
+	unsigned int idMask; /* number of id chains - 1 */
+	unsigned int idCount;
+	unsigned int nextId;
+	int listening; /* the listener is in the poller */
+	int overWater; /* stopped accepting at the high watermark */
+	acceptor_conn *all; /* every connection not yet released */
+	int stopping; /* draining after "stop" */
+	int done; /* leave the event loop */
+	acceptor_timer stopTimer; /* end of the drain */
+	int controlFd; /* listening control socket, or -1 */
+	int reserveFd; /* spare fd given up to accept when out of fds, or -1 */
+	int backoff; /* ms of the last suspension after an accept error, 0 after a success */
+	int backingOff; /* accepting is suspended until backoffTimer fires */
+	acceptor_timer backoffTimer;
+	acceptor_source *sources; /* per client address limits, or NULL */
+	unsigned int sourceMask; /* number of slots - 1 */
+	unsigned int sourceCount;
+	acceptor_timer sourceTimer; /* sweeps entries that have nothing left to limit */
+	int rateTokens; /* thousandths of a connection -acceptrate allows now */
+	unsigned long long rateRefilled;
+	acceptor_timer rateTimer; /* wakes the thread when -acceptrate allows a connection again */
+	int limited; /* over -acceptrate or -maxinflight */
+	socketserver_acl *acl; /* -allow and -deny, or NULL */
+	socketserver_acl *proxyAcl; /* -proxyfrom, or NULL */
+	acceptor_conn *lHead; /* oldest connection waiting to be under -maxinflight */
+	acceptor_conn *lTail;
+	int lLength;
+	unsigned short localPort; /* port the listener is bound to */
+	int tlsFd; /* handshakes finished by the TLS threads are reported here, or -1 */
+} socketserver_acceptor;
+
+/* Poller pointers for the fds that are not connections */
+static int listenTag;
+static int wakeTag;
+static int controlTag;
+static int tlsTag;
+
+static void timer_swap(socketserver_acceptor *acc, int i, int j)
+{
+	acceptor_timer *t = acc->timers[i];
+
+	acc->timers[i] = acc->timers[j];
+	acc->timers[j] = t;
+	acc->timers[i]->index = i;
+	acc->timers[j]->index = j;
+}
+
+static void timer_siftUp(socketserver_acceptor *acc, int i)
+{
+	while (i > 0 && acc->timers[(i - 1) / 2]->when > acc->timers[i]->when) {
+		timer_swap(acc, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timer_siftDown(socketserver_acceptor *acc, int i)
+{
+	for (;;) {
+		int smallest = i;
+		int l = 2 * i + 1, r = 2 * i + 2;
+		if (l < acc->timerCount && acc->timers[l]->when < acc->timers[smallest]->when) {
+			smallest = l;
+		}
+		if (r < acc->timerCount && acc->timers[r]->when < acc->timers[smallest]->when) {
+			smallest = r;
+		}
+		if (smallest == i) {
+			return;
+		}
+		timer_swap(acc, i, smallest);
+		i = smallest;
+	}
+}
+
+static void timer_cancel(socketserver_acceptor *acc, acceptor_timer *t)
+{
+	int i = t->index;
+
+	if (i < 0) {
+		return;
+	}
+	acc->timerCount--;
+	if (i != acc->timerCount) {
+		acc->timers[i] = acc->timers[acc->timerCount];
+		acc->timers[i]->index = i;
+		timer_siftDown(acc, i);
+		timer_siftUp(acc, i);
+	}
+	t->index = -1;
+}
+
+static void timer_set(socketserver_acceptor *acc, acceptor_timer *t, unsigned long long when)
+{
+	timer_cancel(acc, t);
+	if (acc->timerCount == acc->timerSize) {
+		acc->timerSize = acc->timerSize ? acc->timerSize * 2 : 64;
+		acc->timers = (acceptor_timer **)realloc(acc->timers, acc->timerSize * sizeof(acceptor_timer *));
+	}
+	t->when = when;
+	t->index = acc->timerCount++;
+	acc->timers[t->index] = t;
+	timer_siftUp(acc, t->index);
+}
+
+/*
+ * Returns: ms until the next timer, or -1 when there is none.
+ */
+static int timer_timeout(socketserver_acceptor *acc)
+{
+	unsigned long long now;
+
+	if (acc->timerCount == 0) {
+		return -1;
+	}
+	now = socketserver_now();
+	return acc->timers[0]->when <= now ? 0 : (int)(acc->timers[0]->when - now);
+}
+
+static void timer_run(socketserver_acceptor *acc)
+{
+	unsigned long long now = socketserver_now();
+
+	while (acc->timerCount > 0 && acc->timers[0]->when <= now) {
+		acceptor_timer *t = acc->timers[0];
+		timer_cancel(acc, t);
+		t->fire(acc, t->owner);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * connections --
+ *
+ *----------------------------------------------------------------------
+ */
+
+static acceptor_conn * conn_new(socketserver_acceptor *acc, int fd)
+{
+	acceptor_conn *conn = (acceptor_conn *)malloc(sizeof(acceptor_conn));
+
+	memset(conn, 0, sizeof(acceptor_conn));
+	conn->fd = fd;
+	conn->timer.index = -1;
+	conn->timer.owner = conn;
+	conn->allNext = acc->all;
+	if (acc->all != NULL) {
+		acc->all->allPrev = conn;
+	}
+	acc->all = conn;
+	return conn;
+}
+
+/*
+ * The id table.  Ids are handed out in sequence, so the low bits spread
+ * them over the chains evenly.
+ */
+static void ids_add(socketserver_acceptor *acc, acceptor_conn *conn)
+{
+	acceptor_conn **chain;
+
+	if (acc->idCount >= acc->idMask + 1 || acc->ids == NULL) {
+		unsigned int size = acc->ids == NULL ? 1024 : (acc->idMask + 1) * 2;
+		acceptor_conn **ids = (acceptor_conn **)calloc(size, sizeof(acceptor_conn *));
+		unsigned int i;
+
+		for (i = 0; acc->ids != NULL && i <= acc->idMask; i++) {
+			while (acc->ids[i] != NULL) {
+				acceptor_conn *c = acc->ids[i];
+				acc->ids[i] = c->idNext;
+				c->idNext = ids[c->id & (size - 1)];
+				ids[c->id & (size - 1)] = c;
+			}
+		}
+		free(acc->ids);
+		acc->ids = ids;
+		acc->idMask = size - 1;
+	}
+	chain = &acc->ids[conn->id & acc->idMask];
+	conn->idNext = *chain;
+	*chain = conn;
+	acc->idCount++;
+}
+
+static acceptor_conn * ids_find(socketserver_acceptor *acc, unsigned int id)
+{
+	acceptor_conn *conn;
+
+	if (acc->ids == NULL) {
+		return NULL;
+	}
+	for (conn = acc->ids[id & acc->idMask]; conn != NULL; conn = conn->idNext) {
+		if (conn->id == id) {
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+static void ids_remove(socketserver_acceptor *acc, acceptor_conn *conn)
+{
+	acceptor_conn **chain = &acc->ids[conn->id & acc->idMask];
+
+	while (*chain != NULL) {
+		if (*chain == conn) {
+			*chain = conn->idNext;
+			acc->idCount--;
+			return;
+		}
+		chain = &(*chain)->idNext;
+	}
+}
+
+/*
+ * A token bucket holding thousandths of a connection, rate connections a
+ * second coming in up to burst of them, or rate if burst is 0.  Add what
+ * was earned since refilled.
+ */
+static void bucket_refill(int *tokens, unsigned long long *refilled, int rate, int burst, unsigned long long now)
+{
+	long long full = (long long)(burst > 0 ? burst : rate) * 1000;
+	long long n;
+
+	if (now <= *refilled) {
+		return;
+	}
+	/* rate per second is rate thousandths per ms. */
+	n = *tokens + (long long)(now - *refilled) * rate;
+	*tokens = n > full ? full : n;
+	*refilled = now;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * the source table --
+ *
+ *      Client addresses under -sourcemax or -sourcerate, in an
+ *      open-addressing table with linear probing, at most half full.
+ *      Lookups never move entries; only adding one may grow the table,
+ *      and only the sweep removes them, with backward shifting so no
+ *      tombstones are left.  An entry lives while the client has
+ *      connections with the workers or waiting for a slot, or a token
+ *      bucket that is not full again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int source_hash(const socketserver_peer *peer)
+{
+	unsigned int h = 2166136261u ^ peer->family;
+	int i, len = peer->family == AF_INET ? 4 : 16;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ peer->addr[i]) * 16777619u;
+	}
+	return h;
+}
+
+static int source_same(const acceptor_source *source, const socketserver_peer *peer)
+{
+	return source->addr.family == peer->family
+		&& memcmp(source->addr.addr, peer->addr, peer->family == AF_INET ? 4 : 16) == 0;
+}
+
+static int source_grow(socketserver_acceptor *acc)
+{
+	unsigned int size = acc->sources == NULL ? 1024 : (acc->sourceMask + 1) * 2;
+	acceptor_source *sources;
+	unsigned int i, j;
+
+	if (size > ACCEPTOR_SOURCE_MAX || (sources = (acceptor_source *)calloc(size, sizeof(acceptor_source))) == NULL) {
+		return -1;
+	}
+	for (i = 0; acc->sources != NULL && i <= acc->sourceMask; i++) {
+		if (acc->sources[i].addr.family != 0) {
+			for (j = source_hash(&acc->sources[i].addr) & (size - 1); sources[j].addr.family != 0; j = (j + 1) & (size - 1)) {
+			}
+			sources[j] = acc->sources[i];
+		}
+	}
+	free(acc->sources);
+	acc->sources = sources;
+	acc->sourceMask = size - 1;
+	return 0;
+}
+
+static void source_sweep(socketserver_acceptor *acc, void *owner);
+
+/*
+ * The entry of a client address, added with a full bucket if create is
+ * set.  Returns: NULL when the address is not known, or the table is
+ * full; such a client is not limited.
+ */
+static acceptor_source * source_find(socketserver_acceptor *acc, const socketserver_peer *peer, int create)
+{
+	acceptor_source *source;
+	unsigned int i;
+
+	if (peer->family != AF_INET && peer->family != AF_INET6) {
+		return NULL;
+	}
+	if (acc->sources != NULL) {
+		for (i = source_hash(peer) & acc->sourceMask; acc->sources[i].addr.family != 0; i = (i + 1) & acc->sourceMask) {
+			if (source_same(&acc->sources[i], peer)) {
+				return &acc->sources[i];
+			}
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if (acc->sources == NULL || (acc->sourceCount + 1) * 2 > acc->sourceMask + 1) {
+		if (source_grow(acc) < 0 && (acc->sources == NULL || acc->sourceCount + 1 > acc->sourceMask)) {
+			return NULL;
+		}
+	}
+	for (i = source_hash(peer) & acc->sourceMask; acc->sources[i].addr.family != 0; i = (i + 1) & acc->sourceMask) {
+	}
+	source = &acc->sources[i];
+	memset(source, 0, sizeof(acceptor_source));
+	source->addr.family = peer->family;
+	memcpy(source->addr.addr, peer->addr, 16);
+	source->tokens = (acc->config.sourceBurst > 0 ? acc->config.sourceBurst : acc->config.sourceRate) * 1000;
+	source->refilled = socketserver_now();
+	acc->sourceCount++;
+	SOCKETSERVER_STAT_ADD(acc->stats, sources, 1);
+	if (acc->sourceTimer.index < 0) {
+		acc->sourceTimer.fire = source_sweep;
+		acc->sourceTimer.owner = acc;
+		timer_set(acc, &acc->sourceTimer, socketserver_now() + ACCEPTOR_SOURCE_SWEEP);
+	}
+	return source;
+}
+
+/*
+ * Remove slot i, moving back the entries after it that would no longer
+ * be found.
+ */
+static void source_delete(socketserver_acceptor *acc, unsigned int i)
+{
+	unsigned int j = i, k;
+
+	for (;;) {
+		j = (j + 1) & acc->sourceMask;
+		if (acc->sources[j].addr.family == 0) {
+			break;
+		}
+		k = source_hash(&acc->sources[j].addr) & acc->sourceMask;
+		/* The entry at j may move to i unless its home slot is in (i, j]. */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			acc->sources[i] = acc->sources[j];
+			i = j;
+		}
+	}
+	acc->sources[i].addr.family = 0;
+	acc->sourceCount--;
+	SOCKETSERVER_STAT_ADD(acc->stats, sources, -1);
+}
+
+/*
+ * Add the tokens earned since the last refill, up to the burst.
+ */
+static void source_refill(socketserver_acceptor *acc, acceptor_source *source, unsigned long long now)
+{
+	bucket_refill(&source->tokens, &source->refilled, acc->config.sourceRate, acc->config.sourceBurst, now);
+}
+
+/*
+ * Take a token for a new connection from the client's bucket.
+ *
+ * Returns: 0 if the client is over -sourcerate.
+ */
+static int source_take(socketserver_acceptor *acc, const socketserver_peer *peer)
+{
+	acceptor_source *source = source_find(acc, peer, 1);
+
+	if (source == NULL) {
+		return 1;
+	}
+	source_refill(acc, source, socketserver_now());
+	if (source->tokens < 1000) {
+		return 0;
+	}
+	source->tokens -= 1000;
+	return 1;
+}
+
+static void source_sweep(socketserver_acceptor *acc, void *owner)
+{
+	unsigned long long now = socketserver_now();
+	unsigned int i = 0;
+
+	while (acc->sources != NULL && i <= acc->sourceMask) {
+		acceptor_source *source = &acc->sources[i];
+
+		if (source->addr.family != 0 && source->active == 0 && source->hHead == NULL) {
+			source_refill(acc, source, now);
+			if (acc->config.sourceRate == 0
+					|| source->tokens >= (acc->config.sourceBurst > 0 ? acc->config.sourceBurst : acc->config.sourceRate) * 1000) {
+				/* Look at slot i again, another entry may have moved there. */
+				source_delete(acc, i);
+				continue;
+			}
+		}
+		i++;
+	}
+	if (acc->sourceCount > 0) {
+		timer_set(acc, &acc->sourceTimer, now + ACCEPTOR_SOURCE_SWEEP);
+	}
+}
+
+static void source_done(socketserver_acceptor *acc, const socketserver_peer *peer);
+
+/*
+ * Forget a connection.  Its fd is closed unless it was handed off.
+ */
+static void conn_release(socketserver_acceptor *acc, acceptor_conn *conn, int closeFd)
+{
+	timer_cancel(acc, &conn->timer);
+	if (conn->state == ACCEPTOR_CONN_PARKED || conn->state == ACCEPTOR_CONN_CLOSING
+			|| conn->state == ACCEPTOR_CONN_PREREAD || conn->state == ACCEPTOR_CONN_PROXY) {
+		poller_del(&acc->poller, conn->fd);
+	} else if (conn->state == ACCEPTOR_CONN_DISPATCHED) {
+		ids_remove(acc, conn);
+	} else if (conn->state == ACCEPTOR_CONN_QUEUED) {
+		acceptor_pool *pool = &acc->pools[conn->pool];
+		if (conn->qPrev != NULL) {
+			conn->qPrev->qNext = conn->qNext;
+		} else {
+			pool->qHead = conn->qNext;
+		}
+		if (conn->qNext != NULL) {
+			conn->qNext->qPrev = conn->qPrev;
+		} else {
+			pool->qTail = conn->qPrev;
+		}
+		if (--pool->qLength == 0) {
+			pool->qLastEmpty = socketserver_now();
+		}
+		SOCKETSERVER_STAT_ADD(acc->stats, pending, -1);
+	} else if (conn->state == ACCEPTOR_CONN_OVERFLOW) {
+		acceptor_pool *pool = &acc->pools[conn->pool];
+		if (conn->qPrev != NULL) {
+			conn->qPrev->qNext = conn->qNext;
+		} else {
+			pool->oHead = conn->qNext;
+		}
+		if (conn->qNext != NULL) {
+			conn->qNext->qPrev = conn->qPrev;
+		} else {
+			pool->oTail = conn->qPrev;
+		}
+		pool->oLength--;
+	} else if (conn->state == ACCEPTOR_CONN_HELD) {
+		acceptor_source *source = source_find(acc, &conn->arrival.peer, 0);
+		if (conn->qPrev != NULL) {
+			conn->qPrev->qNext = conn->qNext;
+		} else if (source != NULL) {
+			source->hHead = conn->qNext;
+		}
+		if (conn->qNext != NULL) {
+			conn->qNext->qPrev = conn->qPrev;
+		} else if (source != NULL) {
+			source->hTail = conn->qPrev;
+		}
+	} else if (conn->state == ACCEPTOR_CONN_LIMITED) {
+		if (conn->qPrev != NULL) {
+			conn->qPrev->qNext = conn->qNext;
+		} else {
+			acc->lHead = conn->qNext;
+		}
+		if (conn->qNext != NULL) {
+			conn->qNext->qPrev = conn->qPrev;
+		} else {
+			acc->lTail = conn->qPrev;
+		}
+		acc->lLength--;
+	}
+	/* A dispatched connection's slot is free once the record goes, any
+	 * other's only if the connection is not being passed on. */
+	if ((conn->arrival.flags & SOCKETSERVER_MSGF_CHARGED)
+			&& (closeFd || conn->state == ACCEPTOR_CONN_DISPATCHED)) {
+		source_done(acc, &conn->arrival.peer);
+	}
+	if (closeFd && conn->fd != -1) {
+		socketserver_closeOwnedFd(conn->fd);
+	}
+	if (conn->allPrev != NULL) {
+		conn->allPrev->allNext = conn->allNext;
+	} else {
+		acc->all = conn->allNext;
+	}
+	if (conn->allNext != NULL) {
+		conn->allNext->allPrev = conn->allPrev;
+	}
+	conn->fd = -1;
+	conn->dead = 1;
+	conn->nextPtr = acc->graveyard;
+	acc->graveyard = conn;
+}
+
+/*
+ * Start the description of a connection that became ready at readyAt.
+ */
+static void arrival_init(socketserver_msg *arrival, unsigned long long readyAt)
+{
+	memset(arrival, 0, sizeof(socketserver_msg));
+	arrival->acceptedAt = readyAt;
+}
+
+static void arrival_peer(socketserver_msg *arrival, const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET) {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		arrival->peer.family = AF_INET;
+		arrival->peer.port = ntohs(in->sin_port);
+		memcpy(arrival->peer.addr, &in->sin_addr, 4);
+	} else if (addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		arrival->peer.family = AF_INET6;
+		arrival->peer.port = ntohs(in6->sin6_port);
+		memcpy(arrival->peer.addr, &in6->sin6_addr, 16);
+	}
+}
+
+/*
+ * Keep the description of a waiting connection, with a copy of the bytes
+ * read ahead.
+ */
+static void conn_setArrival(acceptor_conn *conn, const socketserver_msg *arrival, const unsigned char *pre)
+{
+	conn->arrival = *arrival;
+	if (pre != NULL && arrival->preLen > 0) {
+		conn->pre = (unsigned char *)malloc(arrival->preLen);
+		memcpy(conn->pre, pre, arrival->preLen);
+	} else {
+		conn->arrival.preLen = 0;
+	}
+}
+
+/*
+ * The worker has held the connection past the deadline.  Shutting the
+ * socket down makes the handler's next read or write fail, so it finishes
+ * and the worker is free again.
+ */
+static void deadline_expired(socketserver_acceptor *acc, void *owner)
+{
+	acceptor_conn *conn = (acceptor_conn *)owner;
+
+	debug("Connection deadline expired");
+	SOCKETSERVER_STAT_ADD(acc->stats, deadlineExpired, 1);
+	shutdown(conn->fd, SHUT_RDWR);
+	conn_release(acc, conn, 1);
+}
+
+/*
+ * A connection only counted for -maxinflight or -sourcemax was not
+ * reported closed in -donetimeout ms: the report was lost, the worker
+ * died, or the client is just slow.  Either way it stops taking a slot,
+ * and its client's count goes down.
+ */
+static void done_expired(socketserver_acceptor *acc, void *owner)
+{
+	debug("No report from the worker");
+	SOCKETSERVER_STAT_ADD(acc->stats, doneTimeouts, 1);
+	conn_release(acc, (acceptor_conn *)owner, 1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * refusing connections --
+ *
+ *      A refused connection gets the -shed-response bytes.  Closing a
+ *      socket with unread input makes the kernel send a reset, which can
+ *      destroy the response before the client reads it, so the write
+ *      side is shut down and the input drained until the client closes
+ *      or ACCEPTOR_LINGER ms pass.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void linger_expired(socketserver_acceptor *acc, void *owner)
+{
+	conn_release(acc, (acceptor_conn *)owner, 1);
+}
+
+static void linger_ready(socketserver_acceptor *acc, acceptor_conn *conn)
+{
+	char buf[4096];
+	ssize_t n;
+
+	while ((n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		/* discard */
+	}
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		conn_release(acc, conn, 1);
+	}
+}
+
+static void acceptor_refuse(socketserver_acceptor *acc, int fd)
+{
+	acceptor_conn *conn;
+
+	if (acc->config.shedResponseLen == 0) {
+		socketserver_closeOwnedFd(fd);
+		return;
+	}
+	if (send(fd, acc->config.shedResponse, acc->config.shedResponseLen, MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+			|| shutdown(fd, SHUT_WR) < 0) {
+		socketserver_closeOwnedFd(fd);
+		return;
+	}
+	conn = conn_new(acc, fd);
+	conn->state = ACCEPTOR_CONN_CLOSING;
+	if (poller_add(&acc->poller, fd, POLLER_IN, conn) == -1) {
+		conn->state = 0;
+		conn_release(acc, conn, 1);
+		return;
+	}
+	conn->timer.fire = linger_expired;
+	timer_set(acc, &conn->timer, socketserver_now() + ACCEPTOR_LINGER);
+}
+
+/*
+ * Write a connection to the socketpair.  With a -deadline the master keeps
+ * its copy until the worker reports the connection closed, otherwise the
+ * copy is closed now.  With -maxinflight, or for a connection counted
+ * against -sourcemax, the connection gets an id all the same, so the
+ * worker reports it closed, but only its record is kept, for at most
+ * -donetimeout ms.
+ *
+ * Returns: 0 when sent, 1 when the socketpair has no room and fd is
+ * untouched, -1 when fd was closed after an error.
+ */
+static int acceptor_send(socketserver_acceptor *acc, acceptor_pool *pool, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre)
+{
+	socketserver_msg msg = *arrival;
+	int charged = arrival->flags & SOCKETSERVER_MSGF_CHARGED;
+
+	msg.type = SOCKETSERVER_MSG_CONN;
+	msg.flags &= ~SOCKETSERVER_MSGF_CHARGED;
+	msg.id = 0;
+	msg.localPort = acc->localPort;
+	/* While stopping nothing waits for a slot, and stop does not wait for
+	 * the worker's report. */
+	if (acc->config.deadline > 0 || ((charged || acc->config.maxInflight > 0) && !acc->stopping)) {
+		if (++acc->nextId == 0) {
+			acc->nextId = 1;
+		}
+		msg.id = acc->nextId;
+	}
+	if (socketserver_sendConn(pool->in, &msg, pre, fd, MSG_DONTWAIT)) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ENOMEM || errno == EINTR) {
+			return 1;
+		}
+		debug("Send fd failed");
+		SOCKETSERVER_STAT_ADD(acc->stats, sendErrors, 1);
+		socketserver_closeOwnedFd(fd);
+		if (charged) {
+			source_done(acc, &arrival->peer);
+		}
+		return -1;
+	}
+	debug("Sent fd.");
+	SOCKETSERVER_STAT_ADD(acc->stats, dispatched, 1);
+	if (pool != acc->pools) {
+		SOCKETSERVER_STAT_ADD(acc->stats, routed, 1);
+	}
+	if (msg.id != 0) {
+		acceptor_conn *conn = conn_new(acc, fd);
+		conn->state = ACCEPTOR_CONN_DISPATCHED;
+		conn->id = msg.id;
+		conn->arrival.flags = charged;
+		conn->arrival.peer = arrival->peer;
+		ids_add(acc, conn);
+		if (acc->config.deadline > 0) {
+			conn->timer.fire = deadline_expired;
+			timer_set(acc, &conn->timer, socketserver_now() + acc->config.deadline);
+		} else {
+			socketserver_closeOwnedFd(fd);
+			conn->fd = -1;
+			conn->timer.fire = done_expired;
+			timer_set(acc, &conn->timer, socketserver_now() + acc->config.doneTimeout);
+		}
+	} else {
+		socketserver_closeOwnedFd(fd);
+		if (charged) {
+			source_done(acc, &arrival->peer);
+		}
+	}
+	return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * overflow --
+ *
+ *      When a burst fills the socketpair faster than the workers read it,
+ *      connections wait here in order, up to -overflow of them, and are
+ *      written when the socketpair is writable again.  EAGAIN is waited
+ *      for with the poller; ENOBUFS and ENOMEM are retried on a timer as
+ *      poll would report the socket writable at once.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void overflow_wait(socketserver_acceptor *acc, acceptor_pool *pool, int err)
+{
+	if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) {
+		poller_mod(&acc->poller, pool->in, POLLER_IN | POLLER_OUT, pool);
+	} else if (pool->overflowTimer.index < 0) {
+		timer_set(acc, &pool->overflowTimer, socketserver_now() + ACCEPTOR_OVERFLOW_RETRY);
+	}
+}
+
+static void overflow_add(socketserver_acceptor *acc, acceptor_pool *pool, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre)
+{
+	acceptor_conn *conn;
+
+	if (pool->oLength >= acc->config.overflow) {
+		debug("Overflow full");
+		SOCKETSERVER_STAT_ADD(acc->stats, overflowDropped, 1);
+		if (arrival->flags & SOCKETSERVER_MSGF_CHARGED) {
+			source_done(acc, &arrival->peer);
+		}
+		acceptor_refuse(acc, fd);
+		return;
+	}
+	conn = conn_new(acc, fd);
+	conn->state = ACCEPTOR_CONN_OVERFLOW;
+	conn->pool = pool - acc->pools;
+	conn_setArrival(conn, arrival, pre);
+	conn->qPrev = pool->oTail;
+	if (pool->oTail != NULL) {
+		pool->oTail->qNext = conn;
+	} else {
+		pool->oHead = conn;
+	}
+	pool->oTail = conn;
+	pool->oLength++;
+	SOCKETSERVER_STAT_ADD(acc->stats, overflowed, 1);
+}
+
+/*
+ * Write waiting connections until the socketpair is full again.
+ */
+static void overflow_pump(socketserver_acceptor *acc, acceptor_pool *pool)
+{
+	while (pool->oHead != NULL) {
+		acceptor_conn *conn = pool->oHead;
+
+		if (acceptor_send(acc, pool, conn->fd, &conn->arrival, conn->pre) == 1) {
+			overflow_wait(acc, pool, errno);
+			return;
+		}
+		conn_release(acc, conn, 0);
+	}
+	timer_cancel(acc, &pool->overflowTimer);
+	poller_mod(&acc->poller, pool->in, POLLER_IN, pool);
+}
+
+static void overflow_retry(socketserver_acceptor *acc, void *owner)
+{
+	overflow_pump(acc, (acceptor_pool *)owner);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * per-client limits --
+ *
+ *      With -sourcemax N a client address may have N connections with
+ *      the workers; more wait in the master for one of them to close,
+ *      up to -sourcewait ms, or are refused at once.  A connection
+ *      counts from its dispatch until the worker closes it or parks it.
+ *      A parked connection whose next request arrives is dispatched even
+ *      if its client is at the limit, and counts again.  -sourcerate
+ *      refuses a client's new connections beyond that many a second,
+ *      allowing bursts of -sourceburst.  The client is the PROXY or TLS
+ *      peer when there is one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void held_expired(socketserver_acceptor *acc, void *owner)
+{
+	acceptor_conn *conn = (acceptor_conn *)owner;
+	int fd = conn->fd;
+
+	debug("Held connection refused");
+	SOCKETSERVER_STAT_ADD(acc->stats, sourceRefused, 1);
+	conn_release(acc, conn, 0);
+	acceptor_refuse(acc, fd);
+}
+
+/*
+ * Count a connection about to be dispatched to pool against its client's
+ * -sourcemax.
+ *
+ * Returns: 1 when it counts, 0 when it goes uncounted, -1 when it was held
+ * or refused instead.
+ */
+static int source_admit(socketserver_acceptor *acc, acceptor_pool *pool, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre)
+{
+	acceptor_source *source = source_find(acc, &arrival->peer, 1);
+	acceptor_conn *conn;
+
+	if (source == NULL) {
+		return 0;
+	}
+	if (source->active < acc->config.sourceMax || (arrival->flags & SOCKETSERVER_MSGF_PARKED)) {
+		source->active++;
+		return 1;
+	}
+	if (acc->config.sourceWait == 0) {
+		debug("Client over -sourcemax");
+		SOCKETSERVER_STAT_ADD(acc->stats, sourceRefused, 1);
+		acceptor_refuse(acc, fd);
+		return -1;
+	}
+	conn = conn_new(acc, fd);
+	conn->state = ACCEPTOR_CONN_HELD;
+	conn->pool = pool - acc->pools;
+	conn_setArrival(conn, arrival, pre);
+	conn->timer.fire = held_expired;
+	conn->qPrev = source->hTail;
+	if (source->hTail != NULL) {
+		source->hTail->qNext = conn;
+	} else {
+		source->hHead = conn;
+	}
+	source->hTail = conn;
+	SOCKETSERVER_STAT_ADD(acc->stats, sourceHeld, 1);
+	timer_set(acc, &conn->timer, socketserver_now() + acc->config.sourceWait);
+	return -1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * port limits --
+ *
+ *      -maxinflight N caps the connections the workers have at once,
+ *      from dispatch until the worker closes or parks them.  -acceptrate
+ *      caps the connections accepted a second, allowing bursts of
+ *      -acceptburst.  Over either limit the listener is left alone, so
+ *      new clients wait in the kernel's listen backlog, or with
+ *      -overlimit shed they are accepted and refused at once.  A
+ *      connection the master has accepted already, such as one sending
+ *      its first bytes or a parked one with a new request, waits in the
+ *      master for the workers to be under -maxinflight.
+ *
+ *----------------------------------------------------------------------
+ */
+
+/*
+ * Connections the workers have, or that are on their way to them.  With
+ * -maxinflight each dispatched connection is in the id table.
+ */
+static int acceptor_inFlight(socketserver_acceptor *acc)
+{
+	int n = acc->idCount;
+	int i;
+
+	for (i = 0; i < acc->poolCount; i++) {
+		n += acc->pools[i].oLength;
+	}
+	return n;
+}
+
+static void limit_hold(socketserver_acceptor *acc, acceptor_pool *pool, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre)
+{
+	acceptor_conn *conn = conn_new(acc, fd);
+
+	conn->state = ACCEPTOR_CONN_LIMITED;
+	conn->pool = pool - acc->pools;
+	conn_setArrival(conn, arrival, pre);
+	conn->qPrev = acc->lTail;
+	if (acc->lTail != NULL) {
+		acc->lTail->qNext = conn;
+	} else {
+		acc->lHead = conn;
+	}
+	acc->lTail = conn;
+	acc->lLength++;
+}
+
+static void acceptor_dispatch(socketserver_acceptor *acc, acceptor_pool *pool, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre);
+
+/*
+ * Dispatch waiting connections, oldest first, while the workers are under
+ * -maxinflight, or all of them when stopping or the limit is off.
+ */
+static void limit_pump(socketserver_acceptor *acc)
+{
+	while (acc->lHead != NULL && (acc->stopping || acc->config.maxInflight == 0
+			|| acceptor_inFlight(acc) < acc->config.maxInflight)) {
+		acceptor_conn *conn = acc->lHead;
+		int fd = conn->fd;
+		socketserver_msg arrival = conn->arrival;
+
+		conn_release(acc, conn, 0);
+		acceptor_dispatch(acc, &acc->pools[conn->pool], fd, &arrival, conn->pre);
+	}
+}
+
+static void limit_expired(socketserver_acceptor *acc, void *owner)
+{
+	/* acceptor_flowControl looks at the bucket again. */
+}
+
+/*
+ * Returns: 1 when the port is over -maxinflight or -acceptrate now.
+ */
+static int limit_over(socketserver_acceptor *acc)
+{
+	if (acc->config.maxInflight > 0 && acceptor_inFlight(acc) >= acc->config.maxInflight) {
+		return 1;
+	}
+	if (acc->config.acceptRate > 0) {
+		unsigned long long now = socketserver_now();
+
+		bucket_refill(&acc->rateTokens, &acc->rateRefilled, acc->config.acceptRate, acc->config.acceptBurst, now);
+		if (acc->rateTokens < 1000) {
+			if (acc->rateTimer.index < 0) {
+				timer_set(acc, &acc->rateTimer,
+						now + (1000 - acc->rateTokens + acc->config.acceptRate - 1) / acc->config.acceptRate);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pass a connection to the workers, behind any that are waiting for room
+ * in the socketpair.
+ */
+static void acceptor_dispatch(socketserver_acceptor *acc, acceptor_pool *pool, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre)
+{
+	socketserver_msg charged;
+
+	if (acc->config.maxInflight > 0 && !acc->stopping && acceptor_inFlight(acc) >= acc->config.maxInflight) {
+		limit_hold(acc, pool, fd, arrival, pre);
+		return;
+	}
+	if (acc->config.sourceMax > 0 && !acc->stopping && !(arrival->flags & SOCKETSERVER_MSGF_CHARGED)) {
+		int admit = source_admit(acc, pool, fd, arrival, pre);
+
+		if (admit < 0) {
+			return;
+		}
+		if (admit > 0) {
+			charged = *arrival;
+			charged.flags |= SOCKETSERVER_MSGF_CHARGED;
+			arrival = &charged;
+		}
+	}
+	pool->credits--;
+	if (pool->oHead != NULL) {
+		overflow_add(acc, pool, fd, arrival, pre);
+	} else if (acceptor_send(acc, pool, fd, arrival, pre) == 1) {
+		int err = errno;
+		overflow_add(acc, pool, fd, arrival, pre);
+		if (pool->oHead != NULL) {
+			overflow_wait(acc, pool, err);
+		}
+	}
+}
+
+/*
+ * Dispatch the client's held connections, oldest first, while it has
+ * free slots, or all of them once there is no limit.  Dispatching only
+ * looks up entries that exist, so the table does not move meanwhile.
+ */
+static void source_release(socketserver_acceptor *acc, acceptor_source *source)
+{
+	while (source->hHead != NULL && (acc->stopping || acc->config.sourceMax == 0
+			|| source->active < acc->config.sourceMax)) {
+		acceptor_conn *conn = source->hHead;
+		int fd = conn->fd;
+		socketserver_msg arrival = conn->arrival;
+
+		conn_release(acc, conn, 0);
+		acceptor_dispatch(acc, &acc->pools[conn->pool], fd, &arrival, conn->pre);
+	}
+}
+
+/*
+ * A connection of the client at peer was closed or parked by its worker,
+ * or never reached one.
+ */
+static void source_done(socketserver_acceptor *acc, const socketserver_peer *peer)
+{
+	acceptor_source *source = source_find(acc, peer, 0);
+
+	if (source != NULL) {
+		source->active--;
+		/* "stop" releases them all at once. */
+		if (!acc->stopping) {
+			source_release(acc, source);
+		}
+	}
+}
+
+/*
+ * Release what the limits allow now, after "stop" or a change of
+ * -sourcemax.
+ */
+static void source_flush(socketserver_acceptor *acc)
+{
+	unsigned int i;
+
+	for (i = 0; acc->sources != NULL && i <= acc->sourceMask; i++) {
+		if (acc->sources[i].addr.family != 0) {
+			source_release(acc, &acc->sources[i]);
+		}
+	}
+}
+
+/*
+ * Connections waiting for a worker of any pool, in the master's queues or
+ * the socketpairs.
+ */
+static long acceptor_backlog(socketserver_acceptor *acc)
+{
+	long backlog = acc->lLength;
+	int i;
+
+	for (i = 0; i < acc->poolCount; i++) {
+		backlog += acc->pools[i].qLength + acc->pools[i].oLength;
+		if (acc->stats == NULL && acc->pools[i].credits < 0) {
+			backlog -= acc->pools[i].credits;
+		}
+	}
+	if (acc->stats != NULL && acc->stats->dispatched > acc->stats->received) {
+		backlog += acc->stats->dispatched - acc->stats->received;
+	}
+	return backlog;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * the dispatch queue --
+ *
+ *      With -queuetarget the acceptor only sends a connection when a
+ *      worker has asked for one, and the others wait here rather than in
+ *      the socketpair.  The queue is run as in CoDel with adaptive LIFO:
+ *      while it has been empty within the last -queueinterval ms it is
+ *      FIFO and a connection may wait -queueinterval ms.  Once it has
+ *      stayed non-empty longer than that, the service is overloaded; the
+ *      newest connections are served first, since their clients are
+ *      still waiting, and new connections may only wait -queuetarget ms
+ *      before they are dropped.  A standing queue therefore drains
+ *      instead of making every request wait its full length.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void queue_expired(socketserver_acceptor *acc, void *owner)
+{
+	acceptor_conn *conn = (acceptor_conn *)owner;
+
+	int fd = conn->fd;
+
+	debug("Queued connection dropped");
+	SOCKETSERVER_STAT_ADD(acc->stats, queueDropped, 1);
+	conn_release(acc, conn, 0);
+	acceptor_refuse(acc, fd);
+}
+
+static int queue_congested(socketserver_acceptor *acc, acceptor_pool *pool, unsigned long long now)
+{
+	return pool->qLength > 0 && now - pool->qLastEmpty > (unsigned long long)acc->config.queueInterval;
+}
+
+/*
+ * Send queued connections while the pool's workers have credit.
+ */
+static void queue_pump(socketserver_acceptor *acc, acceptor_pool *pool)
+{
+	while (pool->qLength > 0 && pool->credits > 0) {
+		acceptor_conn *conn = queue_congested(acc, pool, socketserver_now()) ? pool->qTail : pool->qHead;
+		int fd = conn->fd;
+		socketserver_msg arrival = conn->arrival;
+
+		conn_release(acc, conn, 0);
+		acceptor_dispatch(acc, pool, fd, &arrival, conn->pre);
+	}
+}
+
+/*
+ * Dispatch a connection that is ready for a worker of pool, or queue it.
+ */
+static void acceptor_submit(socketserver_acceptor *acc, int poolIndex, int fd,
+		const socketserver_msg *arrival, const unsigned char *pre)
+{
+	acceptor_pool *pool = &acc->pools[poolIndex];
+	acceptor_conn *conn;
+	int wait;
+
+	if (acc->config.shedThreshold > 0 && acceptor_backlog(acc) >= acc->config.shedThreshold) {
+		debug("Connection shed");
+		SOCKETSERVER_STAT_ADD(acc->stats, shed, 1);
+		acceptor_refuse(acc, fd);
+		return;
+	}
+	if (acc->config.queueTarget == 0 || (pool->qLength == 0 && pool->credits > 0)) {
+		acceptor_dispatch(acc, pool, fd, arrival, pre);
+		return;
+	}
+
+	if (pool->qLength == 0) {
+		pool->qLastEmpty = arrival->acceptedAt;
+	}
+	wait = queue_congested(acc, pool, arrival->acceptedAt) ? acc->config.queueTarget : acc->config.queueInterval;
+	conn = conn_new(acc, fd);
+	conn->state = ACCEPTOR_CONN_QUEUED;
+	conn->pool = poolIndex;
+	conn_setArrival(conn, arrival, pre);
+	conn->timer.fire = queue_expired;
+	conn->qPrev = pool->qTail;
+	if (pool->qTail != NULL) {
+		pool->qTail->qNext = conn;
+	} else {
+		pool->qHead = conn;
+	}
+	pool->qTail = conn;
+	pool->qLength++;
+	SOCKETSERVER_STAT_ADD(acc->stats, pending, 1);
+	timer_set(acc, &conn->timer, arrival->acceptedAt + wait);
+}
+
+/*
+ * Send everything that is queued, when -queuetarget is turned off.
+ */
+static void queue_flush(socketserver_acceptor *acc)
+{
+	int i;
+
+	for (i = 0; i < acc->poolCount; i++) {
+		acceptor_pool *pool = &acc->pools[i];
+
+		while (pool->qHead != NULL) {
+			acceptor_conn *conn = pool->qHead;
+			int fd = conn->fd;
+			socketserver_msg arrival = conn->arrival;
+
+			conn_release(acc, conn, 0);
+			acceptor_dispatch(acc, pool, fd, &arrival, conn->pre);
+		}
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * routing --
+ *
+ *      With -route one port serves several worker pools, each reading
+ *      its own socketpair.  A new connection waits as with -preread
+ *      until its first bytes arrive, and the first rule whose prefix they
+ *      start with picks the pool.  The bytes are looked at with MSG_PEEK
+ *      and left for the worker, unless -preread read them.  Connections
+ *      no rule matches go to the port's own workers.  Only what the
+ *      client sent in its first write is looked at.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int acceptor_route(socketserver_acceptor *acc, const unsigned char *buf, ssize_t len)
+{
+	socketserver_port *port = acc->port;
+	int i;
+
+	for (i = 0; i < port->routeCount; i++) {
+		if (len >= port->routes[i].len && memcmp(buf, port->routes[i].prefix, port->routes[i].len) == 0) {
+			return port->routes[i].pool;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The pool of a connection whose first bytes are still in the socket.
+ */
+static int acceptor_routeFd(socketserver_acceptor *acc, int fd)
+{
+	unsigned char buf[SOCKETSERVER_MAX_PREFIX];
+	ssize_t n;
+
+	if (acc->port->routeCount == 0) {
+		return 0;
+	}
+	n = recv(fd, buf, acc->port->routePeek, MSG_PEEK | MSG_DONTWAIT);
+	return acceptor_route(acc, buf, n < 0 ? 0 : n);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * parked connections --
+ *
+ *      A worker that is done with a request on a keep-alive connection
+ *      can send the connection back instead of waiting for the next
+ *      request.  The acceptor watches it and dispatches it to a worker
+ *      again when the next request arrives.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void park_timeout(socketserver_acceptor *acc, void *owner)
+{
+	acceptor_conn *conn = (acceptor_conn *)owner;
+
+	debug("Parked connection idle timeout");
+	SOCKETSERVER_STAT_ADD(acc->stats, parkTimeouts, 1);
+	SOCKETSERVER_STAT_ADD(acc->stats, idle, -1);
+	conn_release(acc, conn, 1);
+}
+
+/*
+ * Watch a connection parked by a worker.  msg is the PARK message, whose
+ * peer is the client named by a PROXY header if there was one.
+ */
+static void acceptor_park(socketserver_acceptor *acc, int fd, const socketserver_msg *msg)
+{
+	acceptor_conn *conn;
+
+	/* The workers are going away, an idle client can reconnect. */
+	if (acc->stopping) {
+		socketserver_closeOwnedFd(fd);
+		return;
+	}
+	conn = conn_new(acc, fd);
+
+	conn->state = ACCEPTOR_CONN_PARKED;
+	if (msg->flags & SOCKETSERVER_MSGF_PEER) {
+		conn->arrival.peer = msg->peer;
+		conn->arrival.flags = SOCKETSERVER_MSGF_PEER;
+	} else if (acc->config.sourceMax > 0) {
+		/* Its next request counts against the client's -sourcemax. */
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		if (getpeername(fd, (struct sockaddr *)&addr, &len) == 0) {
+			arrival_peer(&conn->arrival, &addr);
+		}
+	}
+	if (poller_add(&acc->poller, fd, POLLER_IN, conn) == -1) {
+		conn->state = 0;
+		conn_release(acc, conn, 1);
+		return;
+	}
+	SOCKETSERVER_STAT_ADD(acc->stats, parked, 1);
+	SOCKETSERVER_STAT_ADD(acc->stats, idle, 1);
+	conn->timer.fire = park_timeout;
+	if (acc->config.parkTimeout > 0) {
+		timer_set(acc, &conn->timer, socketserver_now() + acc->config.parkTimeout);
+	}
+}
+
+static void park_ready(socketserver_acceptor *acc, acceptor_conn *conn)
+{
+	socketserver_msg arrival;
+	unsigned char buf[SOCKETSERVER_MAX_PREFIX];
+	int fd;
+	/* The request may belong to another pool than the last one. */
+	ssize_t n = recv(conn->fd, buf, acc->port->routePeek, MSG_PEEK | MSG_DONTWAIT);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	SOCKETSERVER_STAT_ADD(acc->stats, idle, -1);
+	if (n <= 0) {
+		/* The client closed the idle connection, no need to wake a worker. */
+		conn_release(acc, conn, 1);
+		return;
+	}
+	fd = conn->fd;
+	/* The request is as old as the data that woke us. */
+	arrival_init(&arrival, socketserver_now());
+	arrival.flags = SOCKETSERVER_MSGF_PARKED | conn->arrival.flags;
+	arrival.peer = conn->arrival.peer;
+	conn_release(acc, conn, 0);
+	acceptor_submit(acc, acceptor_route(acc, buf, n), fd, &arrival, NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * reading ahead --
+ *
+ *      With -preread N a new connection is watched until its first bytes
+ *      arrive, and up to N of them are read and sent along with the fd.
+ *      A worker is only woken for a client that has sent something, and
+ *      starts parsing without a read of its own.  A client that sends
+ *      nothing for -prereadtimeout ms is closed.  With -route and no
+ *      -preread the bytes are only peeked at, to pick the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void preread_expired(socketserver_acceptor *acc, void *owner)
+{
+	debug("Preread timed out");
+	SOCKETSERVER_STAT_ADD(acc->stats, prereadTimeouts, 1);
+	conn_release(acc, (acceptor_conn *)owner, 1);
+}
+
+static void acceptor_preread(socketserver_acceptor *acc, int fd, const socketserver_msg *arrival)
+{
+	acceptor_conn *conn;
+	int peek = acc->config.preread == 0 || !acc->port->seqpacket;
+	int size = peek ? acc->port->routePeek : acc->config.preread;
+	unsigned char *pre = (unsigned char *)malloc(size);
+
+	if (pre == NULL) {
+		acceptor_submit(acc, 0, fd, arrival, NULL);
+		return;
+	}
+	conn = conn_new(acc, fd);
+	conn->state = ACCEPTOR_CONN_PREREAD;
+	conn->peek = peek;
+	conn->arrival = *arrival;
+	/* While reading, preLen is the room in pre. */
+	conn->arrival.preLen = size;
+	conn->pre = pre;
+	if (poller_add(&acc->poller, fd, POLLER_IN, conn) == -1) {
+		conn->state = 0;
+		conn_release(acc, conn, 1);
+		return;
+	}
+	conn->timer.fire = preread_expired;
+	if (acc->config.prereadTimeout > 0) {
+		timer_set(acc, &conn->timer, socketserver_now() + acc->config.prereadTimeout);
+	}
+}
+
+static void preread_ready(socketserver_acceptor *acc, acceptor_conn *conn)
+{
+	socketserver_msg arrival;
+	ssize_t n = recv(conn->fd, conn->pre, conn->arrival.preLen, MSG_DONTWAIT | (conn->peek ? MSG_PEEK : 0));
+	int fd;
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		/* The client left without a request. */
+		conn_release(acc, conn, 1);
+		return;
+	}
+	fd = conn->fd;
+	arrival = conn->arrival;
+	arrival.preLen = conn->peek ? 0 : n;
+	/* Like a parked connection, the request is as old as its first bytes. */
+	arrival.acceptedAt = socketserver_now();
+	conn_release(acc, conn, 0);
+	/* conn->pre lasts until the graveyard is emptied. */
+	acceptor_submit(acc, acceptor_route(acc, conn->pre, n), fd, &arrival, conn->pre);
+}
+
+/*
+ * Pass on a new connection, once any PROXY header has been read.
+ */
+static void acceptor_admit(socketserver_acceptor *acc, int fd, const socketserver_msg *arrival)
+{
+	if ((acc->config.preread > 0 && acc->port->seqpacket) || acc->port->routeCount > 0) {
+		acceptor_preread(acc, fd, arrival);
+	} else {
+		acceptor_submit(acc, 0, fd, arrival, NULL);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TLS --
+ *
+ *      With -tlscert, a new connection goes to the TLS threads of tls.c
+ *      once any PROXY header has been read.  They do the handshake and
+ *      report the connection on tlsFd as a plaintext fd, which goes on
+ *      as if it had just been accepted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+/*
+ * Go on with a new connection once its client is known, which is after
+ * any PROXY header.
+ */
+static void acceptor_handshake(socketserver_acceptor *acc, int fd, const socketserver_msg *arrival)
+{
+	/* Before any work is spent on the client. */
+	if (acc->acl != NULL && !socketserver_aclCheck(acc->acl, &arrival->peer)) {
+		debug("Client not allowed");
+		SOCKETSERVER_STAT_ADD(acc->stats, denied, 1);
+		socketserver_closeOwnedFd(fd);
+		return;
+	}
+	if (acc->config.sourceRate > 0 && !source_take(acc, &arrival->peer)) {
+		debug("Client over -sourcerate");
+		SOCKETSERVER_STAT_ADD(acc->stats, sourceRefused, 1);
+		acceptor_refuse(acc, fd);
+		return;
+	}
+#ifdef SOCKETSERVER_TLS
+	if (acc->port->tls != NULL) {
+		if (socketserver_tlsAccept(acc->port->tls, fd, arrival, acc->config.prereadTimeout) < 0) {
+			SOCKETSERVER_STAT_ADD(acc->stats, tlsErrors, 1);
+			socketserver_closeOwnedFd(fd);
+		}
+		return;
+	}
+#endif
+	acceptor_admit(acc, fd, arrival);
+}
+
+static void acceptor_tlsReady(socketserver_acceptor *acc)
+{
+#ifdef SOCKETSERVER_TLS
+	socketserver_msg arrival;
+	int fd;
+
+	while (socketserver_tlsReady(acc->port->tls, &fd, &arrival)) {
+		acceptor_admit(acc, fd, &arrival);
+	}
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * the PROXY protocol --
+ *
+ *      Behind a load balancer that speaks the PROXY protocol, -proxy
+ *      makes every new connection start with a v1 or v2 header naming
+ *      the real client.  The acceptor reads exactly the header, never
+ *      the request after it: it peeks, and only takes what can belong to
+ *      the header until its end is known.  The client's address replaces
+ *      the balancer's in the handoff message, and the connection goes on
+ *      as if it had just been accepted.  A connection without a valid
+ *      header is closed.  LOCAL and UNKNOWN headers keep the address of
+ *      the connection itself.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const unsigned char proxySigV2[12] = { '\r', '\n', '\r', '\n', 0, '\r', '\n', 'Q', 'U', 'I', 'T', '\n' };
+
+/*
+ * Returns: the length of the header at the start of buf, 0 when more
+ * bytes are needed to tell, or -1 when it is not a PROXY header.
+ */
+static int proxy_length(const unsigned char *buf, int len)
+{
+	int i;
+
+	if (len > 0 && buf[0] == '\r') {
+		if (memcmp(buf, proxySigV2, len < 12 ? len : 12) != 0) {
+			return -1;
+		}
+		if (len < 16) {
+			return 0;
+		}
+		if ((buf[12] & 0xf0) != 0x20) {
+			return -1;
+		}
+		i = 16 + ((buf[14] << 8) | buf[15]);
+		return i > ACCEPTOR_PROXY_MAX ? -1 : i;
+	}
+	if (memcmp(buf, "PROXY ", len < 6 ? len : 6) != 0) {
+		return -1;
+	}
+	/* The line, CRLF included, is at most ACCEPTOR_PROXY_V1_MAX bytes. */
+	for (i = 1; i < len && i < ACCEPTOR_PROXY_V1_MAX; i++) {
+		if (buf[i - 1] == '\r' && buf[i] == '\n') {
+			return i + 1;
+		}
+	}
+	return len >= ACCEPTOR_PROXY_V1_MAX ? -1 : 0;
+}
+
+/*
+ * Set the peer of arrival from a complete header.
+ *
+ * Returns: 0, or -1 when the header is malformed.
+ */
+static int proxy_decode(const unsigned char *buf, int len, socketserver_msg *arrival)
+{
+	socketserver_peer peer;
+
+	memset(&peer, 0, sizeof(peer));
+	if (buf[0] == '\r') {
+		const unsigned char *addr = buf + 16;
+		int addrLen = len - 16;
+
+		/* LOCAL is the balancer's own health check. */
+		if ((buf[12] & 0x0f) == 0) {
+			return 0;
+		}
+		if ((buf[12] & 0x0f) != 1) {
+			return -1;
+		}
+		switch (buf[13] >> 4) {
+			case 1:
+				if (addrLen < 12) {
+					return -1;
+				}
+				peer.family = AF_INET;
+				memcpy(peer.addr, addr, 4);
+				peer.port = (addr[8] << 8) | addr[9];
+				break;
+			case 2:
+				if (addrLen < 36) {
+					return -1;
+				}
+				peer.family = AF_INET6;
+				memcpy(peer.addr, addr, 16);
+				peer.port = (addr[32] << 8) | addr[33];
+				break;
+			default:
+				/* AF_UNSPEC or AF_UNIX, nothing to report */
+				return 0;
+		}
+	} else {
+		char line[ACCEPTOR_PROXY_V1_MAX + 1];
+		char proto[8], src[48], dst[48];
+		unsigned int srcPort, dstPort;
+
+		if (len > ACCEPTOR_PROXY_V1_MAX) {
+			return -1;
+		}
+		memcpy(line, buf, len);
+		line[len] = 0;
+		if (sscanf(line, "PROXY %7s", proto) != 1) {
+			return -1;
+		}
+		if (strcmp(proto, "UNKNOWN") == 0) {
+			return 0;
+		}
+		if (sscanf(line, "PROXY %7s %47s %47s %u %u", proto, src, dst, &srcPort, &dstPort) != 5
+				|| srcPort > 65535 || dstPort > 65535) {
+			return -1;
+		}
+		if (strcmp(proto, "TCP4") == 0 && inet_pton(AF_INET, src, peer.addr) == 1) {
+			peer.family = AF_INET;
+		} else if (strcmp(proto, "TCP6") == 0 && inet_pton(AF_INET6, src, peer.addr) == 1) {
+			peer.family = AF_INET6;
+		} else {
+			return -1;
+		}
+		peer.port = srcPort;
+	}
+	arrival->peer = peer;
+	arrival->flags |= SOCKETSERVER_MSGF_PEER;
+	return 0;
+}
+
+static void proxy_expired(socketserver_acceptor *acc, void *owner)
+{
+	debug("PROXY header timed out");
+	SOCKETSERVER_STAT_ADD(acc->stats, prereadTimeouts, 1);
+	conn_release(acc, (acceptor_conn *)owner, 1);
+}
+
+static void acceptor_proxy(socketserver_acceptor *acc, int fd, const socketserver_msg *arrival)
+{
+	acceptor_conn *conn;
+	unsigned char *buf = (unsigned char *)malloc(ACCEPTOR_PROXY_MAX);
+
+	if (buf == NULL) {
+		socketserver_closeOwnedFd(fd);
+		return;
+	}
+	conn = conn_new(acc, fd);
+	conn->state = ACCEPTOR_CONN_PROXY;
+	conn->arrival = *arrival;
+	conn->pre = buf;
+	if (poller_add(&acc->poller, fd, POLLER_IN, conn) == -1) {
+		conn->state = 0;
+		conn_release(acc, conn, 1);
+		return;
+	}
+	conn->timer.fire = proxy_expired;
+	if (acc->config.prereadTimeout > 0) {
+		timer_set(acc, &conn->timer, socketserver_now() + acc->config.prereadTimeout);
+	}
+}
+
+static void proxy_ready(socketserver_acceptor *acc, acceptor_conn *conn)
+{
+	socketserver_msg arrival;
+	unsigned char *buf = conn->pre;
+	ssize_t n = recv(conn->fd, buf + conn->proxyLen, ACCEPTOR_PROXY_MAX - conn->proxyLen, MSG_PEEK | MSG_DONTWAIT);
+	int len, take, fd;
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		conn_release(acc, conn, 1);
+		return;
+	}
+	len = proxy_length(buf, conn->proxyLen + n);
+	if (len < 0 || (len == 0 && conn->proxyLen + n >= ACCEPTOR_PROXY_MAX)) {
+		debug("Bad PROXY header");
+		SOCKETSERVER_STAT_ADD(acc->stats, proxyErrors, 1);
+		conn_release(acc, conn, 1);
+		return;
+	}
+	/* Until the end of the header is known, everything here is header. */
+	take = (len > 0 && len <= conn->proxyLen + n) ? len - conn->proxyLen : n;
+	if (recv(conn->fd, buf + conn->proxyLen, take, MSG_DONTWAIT) != take) {
+		conn_release(acc, conn, 1);
+		return;
+	}
+	conn->proxyLen += take;
+	if (conn->proxyLen != len) {
+		return;
+	}
+	arrival = conn->arrival;
+	if (proxy_decode(buf, len, &arrival) < 0) {
+		debug("Bad PROXY header");
+		SOCKETSERVER_STAT_ADD(acc->stats, proxyErrors, 1);
+		conn_release(acc, conn, 1);
+		return;
+	}
+	fd = conn->fd;
+	conn_release(acc, conn, 0);
+	acceptor_handshake(acc, fd, &arrival);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * event handlers --
+ *
+ *----------------------------------------------------------------------
+ */
+
+/*
+ * Keep an fd open to give up when the process runs out of them.
+ */
+static void reserve_open(socketserver_acceptor *acc)
+{
+	pthread_mutex_lock(&ownedMutex);
+	acc->reserveFd = open("/dev/null", O_RDONLY);
+	if (acc->reserveFd != -1) {
+		owned_set(acc->reserveFd);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+}
+
+static void backoff_expired(socketserver_acceptor *acc, void *owner)
+{
+	acc->backingOff = 0;
+}
+
+/*
+ * Stop accepting for a while after an error that the next accept would
+ * repeat at once, so the thread does not spin on a full backlog.
+ */
+static void acceptor_backoff(socketserver_acceptor *acc)
+{
+	acc->backoff = acc->backoff == 0 ? ACCEPTOR_BACKOFF_MIN : acc->backoff * 2;
+	if (acc->backoff > ACCEPTOR_BACKOFF_MAX) {
+		acc->backoff = ACCEPTOR_BACKOFF_MAX;
+	}
+	acc->backingOff = 1;
+	acc->backoffTimer.fire = backoff_expired;
+	timer_set(acc, &acc->backoffTimer, socketserver_now() + acc->backoff);
+	SOCKETSERVER_STAT_ADD(acc->stats, acceptBackoffs, 1);
+}
+
+/*
+ * Handle a failed accept.
+ *
+ * Returns: 1 if accepting may go on at once.
+ */
+static int acceptor_acceptError(socketserver_acceptor *acc, int err)
+{
+	int fd;
+
+	switch (err) {
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return 0;
+		case EINTR:
+			return 1;
+		case ECONNABORTED:
+		case EPROTO:
+		case EPERM:
+			/* That connection is gone, the next one may be fine. */
+			SOCKETSERVER_STAT_ADD(acc->stats, acceptAborted, 1);
+			return 1;
+		case EMFILE:
+		case ENFILE:
+			SOCKETSERVER_STAT_ADD(acc->stats, fdExhausted, 1);
+			debug("accept failed, out of file descriptors");
+			/* Give up the spare fd to take the oldest connection off the
+			 * backlog and close it, rather than leave the client waiting
+			 * for a connection that is never served. */
+			if (acc->reserveFd != -1) {
+				socketserver_closeOwnedFd(acc->reserveFd);
+				acc->reserveFd = -1;
+				if ((fd = owned_accept(acc->listenFd, NULL)) != -1) {
+					socketserver_closeOwnedFd(fd);
+				}
+				reserve_open(acc);
+			}
+			acceptor_backoff(acc);
+			return 0;
+		default:
+			SOCKETSERVER_STAT_ADD(acc->stats, acceptErrors, 1);
+			debug("accept failed");
+			acceptor_backoff(acc);
+			return 0;
+	}
+}
+
+static void acceptor_accept(socketserver_acceptor *acc)
+{
+	struct sockaddr_storage addr;
+	socketserver_msg arrival;
+	int i;
+
+	for (i = 0; i < ACCEPTOR_ACCEPT_BATCH && !acc->overWater && !acc->backingOff; i++) {
+		int client_sock, shed = 0;
+
+		if (limit_over(acc)) {
+			if (acc->config.overLimit == SOCKETSERVER_OVERLIMIT_BACKLOG) {
+				/* acceptor_flowControl stops listening. */
+				return;
+			}
+			shed = 1;
+		}
+		client_sock = owned_accept(acc->listenFd, &addr);
+		if (client_sock < 0) {
+			if (!acceptor_acceptError(acc, errno)) {
+				return;
+			}
+			continue;
+		}
+		acc->backoff = 0;
+		debug("Connection accepted");
+		SOCKETSERVER_STAT_ADD(acc->stats, accepted, 1);
+		if (shed) {
+			debug("Connection over the port limits");
+			SOCKETSERVER_STAT_ADD(acc->stats, limitShed, 1);
+			acceptor_refuse(acc, client_sock);
+			continue;
+		}
+		if (acc->config.acceptRate > 0) {
+			acc->rateTokens -= 1000;
+		}
+		arrival_init(&arrival, socketserver_now());
+		arrival_peer(&arrival, &addr);
+		if (acc->config.proxy) {
+			/* Only the balancers may say who the client is. */
+			if (acc->proxyAcl != NULL && !socketserver_aclCheck(acc->proxyAcl, &arrival.peer)) {
+				debug("Not from a -proxyfrom balancer");
+				SOCKETSERVER_STAT_ADD(acc->stats, denied, 1);
+				socketserver_closeOwnedFd(client_sock);
+				continue;
+			}
+			acceptor_proxy(acc, client_sock, &arrival);
+		} else {
+			acceptor_handshake(acc, client_sock, &arrival);
+		}
+		if (acc->config.highWater > 0 && acceptor_backlog(acc) >= acc->config.highWater) {
+			acc->overWater = 1;
+		}
+	}
+}
+
+/*
+ * Start or stop accepting.  Connections that are not accepted wait in the
+ * kernel's listen backlog, where SYN cookies and client retries deal with
+ * them.
+ */
+static void acceptor_flowControl(socketserver_acceptor *acc)
+{
+	int listen;
+
+	if (acc->config.highWater > 0) {
+		long backlog = acceptor_backlog(acc);
+		if (backlog >= acc->config.highWater) {
+			acc->overWater = 1;
+		} else if (backlog <= acc->config.lowWater) {
+			acc->overWater = 0;
+		}
+	} else {
+		acc->overWater = 0;
+	}
+	if (acc->config.overLimit == SOCKETSERVER_OVERLIMIT_BACKLOG && limit_over(acc)) {
+		if (!acc->limited && acc->listening) {
+			SOCKETSERVER_STAT_ADD(acc->stats, limitPauses, 1);
+		}
+		acc->limited = 1;
+	} else {
+		acc->limited = 0;
+	}
+
+	if (acc->listenFd == -1) {
+		return;
+	}
+	listen = !acc->config.paused && !acc->overWater && !acc->backingOff && !acc->limited;
+	if (acc->stats != NULL) {
+		acc->stats->paused = !listen;
+	}
+	if (listen == acc->listening) {
+		return;
+	}
+	if (listen) {
+		poller_add(&acc->poller, acc->listenFd, POLLER_IN, &listenTag);
+	} else {
+		poller_del(&acc->poller, acc->listenFd);
+	}
+	acc->listening = listen;
+	debug(listen ? "Accepting" : "Not accepting");
+}
+
+/*
+ * Wake the acceptor thread, after its settings were changed.
+ */
+void socketserver_wakeAcceptor(socketserver_port *data)
+{
+	/* Forked workers have no acceptor thread and their copy of the fd is closed. */
+	if (data->wakeFd != -1 && data->masterPid == getpid() && write(data->wakeFd, "", 1) < 0) {
+		/* the pipe is full, so the thread is waking up anyway */
+	}
+}
+
+static void acceptor_drainWake(socketserver_acceptor *acc)
+{
+	char buf[64];
+
+	while (read(acc->port->wakeRead, buf, sizeof(buf)) > 0) {
+		/* discard */
+	}
+}
+
+/*
+ * Messages from the workers of a pool.
+ */
+static void acceptor_handoff(socketserver_acceptor *acc, acceptor_pool *pool)
+{
+	socketserver_msg msg;
+	int fd;
+
+	while (owned_recvConn(pool->in, &msg, NULL, 0, &fd) > 0) {
+		switch (msg.type) {
+			case SOCKETSERVER_MSG_PARK:
+				if (fd != -1) {
+					acceptor_park(acc, fd, &msg);
+					fd = -1;
+				}
+				break;
+			case SOCKETSERVER_MSG_READY:
+				pool->credits++;
+				break;
+			case SOCKETSERVER_MSG_DONE: {
+				acceptor_conn *conn = ids_find(acc, msg.id);
+				if (conn != NULL) {
+					conn_release(acc, conn, 1);
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		if (fd != -1) {
+			socketserver_closeOwnedFd(fd);
+		}
+	}
+	limit_pump(acc);
+	queue_pump(acc, pool);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * stopping --
+ *
+ *      "stop" closes the listener, closes the parked connections and
+ *      sends everything queued in the master to the workers.  The thread
+ *      then waits until the workers have taken every connection from the
+ *      socketpair and closed those the master holds copies of, or until
+ *      the stop timeout, and exits.  Closing the master's end of the
+ *      socketpair tells the workers the port has stopped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void stop_expired(socketserver_acceptor *acc, void *owner)
+{
+	debug("Stop timeout, closing remaining connections");
+	acc->done = 1;
+}
+
+static void acceptor_beginStop(socketserver_acceptor *acc, int timeout)
+{
+	acceptor_conn *conn, *next;
+
+	acc->stopping = 1;
+	if (acc->listening) {
+		poller_del(&acc->poller, acc->listenFd);
+		acc->listening = 0;
+	}
+	if (acc->listenFd != -1) {
+		socketserver_closeOwnedFd(acc->listenFd);
+		acc->listenFd = -1;
+	}
+	if (acc->controlFd != -1) {
+		poller_del(&acc->poller, acc->controlFd);
+		socketserver_closeOwnedFd(acc->controlFd);
+		acc->controlFd = -1;
+	}
+
+	for (conn = acc->all; conn != NULL; conn = next) {
+		next = conn->allNext;
+		if (conn->state == ACCEPTOR_CONN_PARKED) {
+			SOCKETSERVER_STAT_ADD(acc->stats, idle, -1);
+			conn_release(acc, conn, 1);
+		} else if (conn->state == ACCEPTOR_CONN_PREREAD) {
+			/* New clients are served even if their request is not here yet. */
+			socketserver_msg arrival = conn->arrival;
+			int fd = conn->fd;
+			arrival.preLen = 0;
+			conn_release(acc, conn, 0);
+			acceptor_submit(acc, acceptor_routeFd(acc, fd), fd, &arrival, NULL);
+		} else if (conn->state == ACCEPTOR_CONN_DISPATCHED && conn->fd == -1) {
+			/* Only kept to count the client's connections. */
+			conn_release(acc, conn, 1);
+		}
+	}
+	source_flush(acc);
+	limit_pump(acc);
+	queue_flush(acc);
+
+	acc->stopTimer.index = -1;
+	acc->stopTimer.fire = stop_expired;
+	acc->stopTimer.owner = acc;
+	if (timeout > 0) {
+		timer_set(acc, &acc->stopTimer, socketserver_now() + timeout);
+	}
+}
+
+/*
+ * Returns: 1 when every connection has been taken by a worker and the
+ * master holds none, nor relays any.
+ */
+static int acceptor_drained(socketserver_acceptor *acc)
+{
+	if (acc->all != NULL) {
+		return 0;
+	}
+#ifdef SOCKETSERVER_TLS
+	if (acc->port->tls != NULL && socketserver_tlsBusy(acc->port->tls)) {
+		return 0;
+	}
+#endif
+	return acc->stats == NULL || acc->stats->received >= acc->stats->dispatched;
+}
+
+static void acceptor_shutdown(socketserver_acceptor *acc)
+{
+	int i;
+
+	/* Nothing is dispatched from here on. */
+	free(acc->sources);
+	acc->sources = NULL;
+	while (acc->all != NULL) {
+		acceptor_conn *conn = acc->all;
+		if (conn->state == ACCEPTOR_CONN_PARKED) {
+			SOCKETSERVER_STAT_ADD(acc->stats, idle, -1);
+		}
+		conn_release(acc, conn, 1);
+	}
+	while (acc->graveyard != NULL) {
+		acceptor_conn *conn = acc->graveyard;
+		acc->graveyard = conn->nextPtr;
+		free(conn->pre);
+		free(conn);
+	}
+	if (acc->listenFd != -1) {
+		socketserver_closeOwnedFd(acc->listenFd);
+	}
+	if (acc->controlFd != -1) {
+		socketserver_closeOwnedFd(acc->controlFd);
+	}
+	if (acc->reserveFd != -1) {
+		socketserver_closeOwnedFd(acc->reserveFd);
+	}
+	for (i = 0; i < acc->poolCount; i++) {
+		socketserver_closeOwnedFd(acc->pools[i].in);
+	}
+	free(acc->pools);
+#ifdef SOCKETSERVER_TLS
+	if (acc->port->tls != NULL) {
+		/* Closes what the TLS threads still hold, relays included. */
+		socketserver_tlsFree(acc->port->tls);
+		acc->port->tls = NULL;
+	}
+#endif
+	poller_free(&acc->poller);
+	free(acc->timers);
+	free(acc->ids);
+	socketserver_aclFree(acc->acl);
+	socketserver_aclFree(acc->proxyAcl);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * upgrades --
+ *
+ *      A master started with "server -control path" listens on a unix
+ *      socket.  A new master started with "server -takeover path"
+ *      connects to it, and the old master sends it the listening socket,
+ *      the connections queued in the master and the parked connections,
+ *      and then stops as with "stop": its workers finish what they have
+ *      while the new master accepts.  No connection is reset and the
+ *      port is never closed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int control_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int control_socket(void)
+{
+	int fd;
+
+	/* Handed over connections carry the bytes read ahead, which needs
+	 * message boundaries.  Where SOCK_SEQPACKET is missing the socketpair
+	 * is SOCK_STREAM too and nothing is read ahead. */
+	pthread_mutex_lock(&ownedMutex);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd == -1) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	}
+	if (fd != -1) {
+		owned_set(fd);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	return fd;
+}
+
+/*
+ * Wait for the next message on a control connection.
+ *
+ * Returns: 1 for a message, 0 at end of file or timeout, -1 for error.
+ */
+static int control_recv(int fd, socketserver_msg *msg, unsigned char *pre, int *fdPtr)
+{
+	struct pollfd pfd;
+	int result;
+
+	*fdPtr = -1;
+	for (;;) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, ACCEPTOR_TAKEOVER_WAIT) <= 0) {
+			return 0;
+		}
+		result = owned_recvConn(fd, msg, pre, pre != NULL ? SOCKETSERVER_MAX_PREREAD : 0, fdPtr);
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			return result;
+		}
+	}
+}
+
+static int control_listen(socketserver_acceptor *acc, const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (control_addr(path, &addr) < 0 || (acc->controlFd = control_socket()) == -1) {
+		return -1;
+	}
+	/* A previous master's socket at the path is replaced.  Nobody can
+	 * connect before listen, so restricting it in between is safe. */
+	unlink(path);
+	if (bind(acc->controlFd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| chmod(path, 0600) < 0 || listen(acc->controlFd, 4) < 0) {
+		socketserver_closeOwnedFd(acc->controlFd);
+		acc->controlFd = -1;
+		return -1;
+	}
+	fcntl(acc->controlFd, F_SETFL, fcntl(acc->controlFd, F_GETFL) | O_NONBLOCK);
+	poller_add(&acc->poller, acc->controlFd, POLLER_IN, &controlTag);
+	return 0;
+}
+
+/*
+ * Take the port over from the master listening at path.
+ *
+ * Returns: 0 with acc->listenFd set, or -1.
+ */
+static int acceptor_takeover(socketserver_acceptor *acc, const char *path)
+{
+	struct sockaddr_un addr;
+	socketserver_msg msg;
+	unsigned char pre[SOCKETSERVER_MAX_PREREAD];
+	int fd, ctl, result;
+
+	if (control_addr(path, &addr) < 0 || (ctl = control_socket()) == -1) {
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.type = SOCKETSERVER_MSG_TAKEOVER;
+	if (connect(ctl, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| socketserver_sendMsg(ctl, &msg, -1, 0)) {
+		debug("Could not reach the old master");
+		socketserver_closeOwnedFd(ctl);
+		return -1;
+	}
+
+	while ((result = control_recv(ctl, &msg, pre, &fd)) > 0 && msg.type != SOCKETSERVER_MSG_END) {
+		switch (msg.type) {
+			case SOCKETSERVER_MSG_LISTENER:
+				if (fd != -1 && acc->listenFd == -1) {
+					acc->listenFd = fd;
+					fd = -1;
+				}
+				break;
+			case SOCKETSERVER_MSG_QUEUED:
+				if (fd != -1) {
+					int pool = msg.preLen > 0 ? acceptor_route(acc, pre, msg.preLen) : acceptor_routeFd(acc, fd);
+					acceptor_submit(acc, pool, fd, &msg, pre);
+					fd = -1;
+				}
+				break;
+			case SOCKETSERVER_MSG_PARKED:
+				if (fd != -1) {
+					acceptor_park(acc, fd, &msg);
+					fd = -1;
+				}
+				break;
+			default:
+				break;
+		}
+		if (fd != -1) {
+			socketserver_closeOwnedFd(fd);
+		}
+	}
+	socketserver_closeOwnedFd(ctl);
+	if (acc->listenFd == -1) {
+		return -1;
+	}
+	debug("Took the port over");
+	fcntl(acc->listenFd, F_SETFL, fcntl(acc->listenFd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * Hand the port to a new master that connected to the control socket,
+ * then stop.
+ */
+static void acceptor_handover(socketserver_acceptor *acc)
+{
+	socketserver_msg msg;
+	acceptor_conn *conn, *next;
+	int ctl, fd, timeout, i;
+
+	pthread_mutex_lock(&ownedMutex);
+	ctl = accept(acc->controlFd, NULL, NULL);
+	if (ctl != -1) {
+		owned_set(ctl);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	if (ctl == -1) {
+		return;
+	}
+	fcntl(ctl, F_SETFL, fcntl(ctl, F_GETFL) & ~O_NONBLOCK);
+	if (control_recv(ctl, &msg, NULL, &fd) <= 0 || msg.type != SOCKETSERVER_MSG_TAKEOVER || acc->listenFd == -1) {
+		if (fd != -1) {
+			socketserver_closeOwnedFd(fd);
+		}
+		socketserver_closeOwnedFd(ctl);
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = SOCKETSERVER_MSG_LISTENER;
+	if (socketserver_sendMsg(ctl, &msg, acc->listenFd, 0)) {
+		socketserver_closeOwnedFd(ctl);
+		return;
+	}
+	debug("Handing the port over");
+
+	/* The new master owns the listener from here on. */
+	if (acc->listening) {
+		poller_del(&acc->poller, acc->listenFd);
+		acc->listening = 0;
+	}
+	socketserver_closeOwnedFd(acc->listenFd);
+	acc->listenFd = -1;
+
+	/* Connections held for their client's limit or -maxinflight wait in
+	 * the new master again.  They go first, as sending the others frees
+	 * slots. */
+	for (conn = acc->all; conn != NULL; conn = next) {
+		next = conn->allNext;
+		if (conn->state == ACCEPTOR_CONN_HELD || conn->state == ACCEPTOR_CONN_LIMITED) {
+			msg = conn->arrival;
+			msg.type = SOCKETSERVER_MSG_QUEUED;
+			if (socketserver_sendConn(ctl, &msg, conn->pre, conn->fd, 0) == 0) {
+				conn_release(acc, conn, 1);
+			}
+		}
+	}
+	/* Waiting connections oldest first, so the new master keeps the order.
+	 * It routes them again. */
+	for (i = 0; i < acc->poolCount; i++) {
+		acceptor_pool *pool = &acc->pools[i];
+
+		while (pool->oHead != NULL || pool->qHead != NULL) {
+			conn = pool->oHead != NULL ? pool->oHead : pool->qHead;
+			msg = conn->arrival;
+			msg.type = SOCKETSERVER_MSG_QUEUED;
+			msg.flags &= ~SOCKETSERVER_MSGF_CHARGED;
+			if (socketserver_sendConn(ctl, &msg, conn->pre, conn->fd, 0)) {
+				/* It stays queued and goes to our own workers. */
+				break;
+			}
+			conn_release(acc, conn, 1);
+		}
+	}
+	for (conn = acc->all; conn != NULL; conn = next) {
+		next = conn->allNext;
+		/* A connection still waiting for its first bytes is parked there. */
+		if (conn->state == ACCEPTOR_CONN_PARKED || conn->state == ACCEPTOR_CONN_PREREAD) {
+			memset(&msg, 0, sizeof(msg));
+			msg.type = SOCKETSERVER_MSG_PARKED;
+			msg.flags = conn->arrival.flags & SOCKETSERVER_MSGF_PEER;
+			msg.peer = conn->arrival.peer;
+			if (socketserver_sendMsg(ctl, &msg, conn->fd, 0) == 0) {
+				if (conn->state == ACCEPTOR_CONN_PARKED) {
+					SOCKETSERVER_STAT_ADD(acc->stats, idle, -1);
+				}
+				conn_release(acc, conn, 1);
+			}
+		}
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.type = SOCKETSERVER_MSG_END;
+	socketserver_sendMsg(ctl, &msg, -1, 0);
+	socketserver_closeOwnedFd(ctl);
+
+	socketserver_lock();
+	timeout = acc->port->stopTimeout = SOCKETSERVER_DEFAULT_STOPTIMEOUT;
+	acc->port->stopRequested = 1;
+	socketserver_unlock();
+	acceptor_beginStop(acc, timeout);
+}
+
+static int acceptor_listen(socketserver_acceptor *acc)
+{
+	struct sockaddr_in server;
+	int on = 1;
+
+	// create tcp socket
+	pthread_mutex_lock(&ownedMutex);
+	acc->listenFd = socket(AF_INET , SOCK_STREAM , 0);
+	if (acc->listenFd != -1) {
+		owned_set(acc->listenFd);
+	}
+	pthread_mutex_unlock(&ownedMutex);
+	if (acc->listenFd == -1) {
+		debug("Could not create socket");
+		return -1;
+	}
+	debug("Socket created");
+
+	if (setsockopt(acc->listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int)) < 0) {
+		debug("SO_REUSEADDR failed");
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = INADDR_ANY;
+	server.sin_port = htons(acc->port->targs.port);
+	if (bind(acc->listenFd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		debug("bind failed");
+		return -1;
+	}
+	debug("bind done");
+
+	listen(acc->listenFd, SOMAXCONN);
+	fcntl(acc->listenFd, F_SETFL, fcntl(acc->listenFd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * The port the listener is bound to, which differs from the port number
+ * of an inherited listener.
+ */
+static unsigned short acceptor_localPort(socketserver_acceptor *acc)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(acc->listenFd, (struct sockaddr *)&addr, &len) == 0) {
+		if (addr.ss_family == AF_INET) {
+			return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+		}
+		if (addr.ss_family == AF_INET6) {
+			return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+		}
+	}
+	return acc->port->targs.port;
+}
+
+/*
+ * Set up the port's own worker pool and its -route pools.
+ *
+ * Returns: 0, or -1 when out of memory.
+ */
+static int acceptor_pools(socketserver_acceptor *acc)
+{
+	socketserver_port *p;
+	int i;
+
+	acc->poolCount = 1;
+	for (p = acc->port->pools; p != NULL; p = p->nextPtr) {
+		acc->poolCount++;
+	}
+	acc->pools = (acceptor_pool *)calloc(acc->poolCount, sizeof(acceptor_pool));
+	if (acc->pools == NULL) {
+		return -1;
+	}
+	acc->pools[0].in = acc->port->targs.in;
+	for (i = 1, p = acc->port->pools; p != NULL; i++, p = p->nextPtr) {
+		acc->pools[i].in = p->targs.in;
+	}
+	for (i = 0; i < acc->poolCount; i++) {
+		acc->pools[i].qLastEmpty = socketserver_now();
+		acc->pools[i].overflowTimer.index = -1;
+		acc->pools[i].overflowTimer.fire = overflow_retry;
+		acc->pools[i].overflowTimer.owner = &acc->pools[i];
+	}
+	return 0;
+}
+
+/*
+ * The pool whose socketpair a poller pointer stands for, or NULL.
+ */
+static acceptor_pool * acceptor_findPool(socketserver_acceptor *acc, void *ptr)
+{
+	int i;
+
+	for (i = 0; i < acc->poolCount; i++) {
+		if (ptr == &acc->pools[i]) {
+			return &acc->pools[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Thread entry point.
+ *
+ * Arguments - the port structure, with the socketpair write side and TCP
+ * port number.
+ */
+static void * socketserver_thread(void *args)
+{
+	socketserver_acceptor acceptor;
+	socketserver_acceptor *acc = &acceptor;
+	void *ptrs[ACCEPTOR_MAXEVENTS];
+	int events[ACCEPTOR_MAXEVENTS];
+	int i;
+
+	memset(acc, 0, sizeof(socketserver_acceptor));
+	acc->port = (socketserver_port *)args;
+	acc->stats = acc->port->stats;
+	acc->listenFd = -1;
+	acc->controlFd = -1;
+	acc->tlsFd = -1;
+	acc->backoffTimer.index = -1;
+	acc->sourceTimer.index = -1;
+	acc->rateTimer.index = -1;
+	acc->rateTimer.fire = limit_expired;
+	acc->rateTimer.owner = acc;
+	if (acceptor_pools(acc) < 0) {
+		kill(getpid(), 15);
+		return (void *)1;
+	}
+	reserve_open(acc);
+	socketserver_lock();
+	acc->config = acc->port->config;
+	acc->configEpoch = acc->port->configEpoch;
+	acc->acl = acc->port->acl;
+	acc->port->acl = NULL;
+	acc->port->aclChanged = 0;
+	acc->proxyAcl = acc->port->proxyAcl;
+	acc->port->proxyAcl = NULL;
+	acc->port->proxyAclChanged = 0;
+	socketserver_unlock();
+
+	if (poller_init(&acc->poller) < 0) {
+		kill(getpid(), 15);
+		return (void *)1;
+	}
+#ifdef SOCKETSERVER_TLS
+	if (acc->port->tls != NULL) {
+		if ((acc->tlsFd = socketserver_tlsStart(acc->port->tls, acc->stats)) < 0) {
+			kill(getpid(), 15);
+			return (void *)1;
+		}
+		poller_add(&acc->poller, acc->tlsFd, POLLER_IN, &tlsTag);
+	}
+#endif
+	if (acc->port->inheritedFd != -1) {
+		/* A supervisor created the socket, so it is already listening. */
+		acc->listenFd = acc->port->inheritedFd;
+		fcntl(acc->listenFd, F_SETFL, fcntl(acc->listenFd, F_GETFL) | O_NONBLOCK);
+	} else if ((acc->port->takeoverPath[0] == 0 || acceptor_takeover(acc, acc->port->takeoverPath) < 0)
+			&& acceptor_listen(acc) < 0) {
+		// Send a TERM signal to self, to exit the master process
+		kill(getpid(), 15);
+		return (void *)1;
+	}
+	acc->localPort = acceptor_localPort(acc);
+	for (i = 0; i < acc->poolCount; i++) {
+		poller_add(&acc->poller, acc->pools[i].in, POLLER_IN, &acc->pools[i]);
+	}
+	poller_add(&acc->poller, acc->port->wakeRead, POLLER_IN, &wakeTag);
+	if (acc->port->controlPath[0] != 0 && control_listen(acc, acc->port->controlPath) < 0) {
+		debug("Could not create the control socket");
+	}
+
+	debug("Waiting for incoming connections...");
+
+	while (!acc->done) {
+		acceptor_pool *pool;
+		int n, timeout;
+		int stop = 0, stopTimeout = 0, changed = 0;
+
+		socketserver_lock();
+		if (acc->configEpoch != acc->port->configEpoch) {
+			acc->config = acc->port->config;
+			acc->configEpoch = acc->port->configEpoch;
+			changed = 1;
+		}
+		if (acc->port->aclChanged) {
+			socketserver_aclFree(acc->acl);
+			acc->acl = acc->port->acl;
+			acc->port->acl = NULL;
+			acc->port->aclChanged = 0;
+		}
+		if (acc->port->proxyAclChanged) {
+			socketserver_aclFree(acc->proxyAcl);
+			acc->proxyAcl = acc->port->proxyAcl;
+			acc->port->proxyAcl = NULL;
+			acc->port->proxyAclChanged = 0;
+		}
+		if (acc->port->stopRequested && !acc->stopping) {
+			stop = 1;
+			stopTimeout = acc->port->stopTimeout;
+		}
+		socketserver_unlock();
+
+		if (stop) {
+			acceptor_beginStop(acc, stopTimeout);
+			if (stopTimeout == 0) {
+				break;
+			}
+		}
+		if (acc->stopping && acceptor_drained(acc)) {
+			break;
+		}
+		if (acc->config.queueTarget == 0) {
+			queue_flush(acc);
+		}
+		if (changed) {
+			source_flush(acc);
+			limit_pump(acc);
+		}
+		acceptor_flowControl(acc);
+
+		timeout = timer_timeout(acc);
+		/* Workers do not report every connection they take, so look again. */
+		if ((acc->overWater || acc->stopping) && (timeout == -1 || timeout > ACCEPTOR_WATER_POLL)) {
+			timeout = ACCEPTOR_WATER_POLL;
+		}
+		n = poller_wait(&acc->poller, timeout, ptrs, events);
+		for (i = 0; i < n; i++) {
+			if (ptrs[i] == &listenTag) {
+				acceptor_accept(acc);
+			} else if ((pool = acceptor_findPool(acc, ptrs[i])) != NULL) {
+				if (events[i] & POLLER_OUT) {
+					overflow_pump(acc, pool);
+				}
+				if (events[i] & POLLER_IN) {
+					acceptor_handoff(acc, pool);
+				}
+			} else if (ptrs[i] == &wakeTag) {
+				acceptor_drainWake(acc);
+			} else if (ptrs[i] == &tlsTag) {
+				acceptor_tlsReady(acc);
+			} else if (ptrs[i] == &controlTag) {
+				if (!acc->stopping) {
+					acceptor_handover(acc);
+				}
+			} else {
+				acceptor_conn *conn = (acceptor_conn *)ptrs[i];
+				if (conn->dead) {
+					continue;
+				}
+				if (conn->state == ACCEPTOR_CONN_PARKED) {
+					park_ready(acc, conn);
+				} else if (conn->state == ACCEPTOR_CONN_CLOSING) {
+					linger_ready(acc, conn);
+				} else if (conn->state == ACCEPTOR_CONN_PREREAD) {
+					preread_ready(acc, conn);
+				} else if (conn->state == ACCEPTOR_CONN_PROXY) {
+					proxy_ready(acc, conn);
+				}
+			}
+		}
+		timer_run(acc);
+		/* Expired records may have freed -maxinflight slots. */
+		limit_pump(acc);
+
+		while (acc->graveyard != NULL) {
+			acceptor_conn *conn = acc->graveyard;
+			acc->graveyard = conn->nextPtr;
+			free(conn->pre);
+			free(conn);
+		}
+	}
+
+	debug("Acceptor stopped");
+	acceptor_shutdown(acc);
+	socketserver_acceptorDone(acc->port);
+	return (void *)0;
+}
+
+/*
+ * Start the acceptor thread of a port.
+ *
+ * Returns: 0 for success.
+ */
+int socketserver_startAcceptor(socketserver_port *data)
+{
+	pthread_once(&ownedOnce, owned_init);
+	if (pthread_create(&data->acceptorThread, NULL, socketserver_thread, data) != 0) {
+		return -1;
+	}
+	data->haveThread = 1;
+	return 0;
+}
+
+/*
+ * Ask the acceptor thread to stop, draining for up to timeout ms.  A
+ * timeout of 0 stops at once.
+ */
+void socketserver_stopAcceptor(socketserver_port *data, int timeout)
+{
+	socketserver_lock();
+	if (!data->stopRequested) {
+		data->stopRequested = 1;
+		data->stopTimeout = timeout;
+	}
+	socketserver_unlock();
+	socketserver_wakeAcceptor(data);
+}
+
+/*
+ * Wait for the acceptor thread to exit and release what the port used to
+ * talk to it.  The worker end of the socketpair is shared by every worker,
+ * and shutting it down cuts them all off: they read EOF once they have
+ * taken what is still queued, which runs their -stopcommand, and a DONE or
+ * READY sent afterwards fails at once, as nothing is left to read it.  It
+ * is not closed here because this process may serve the port too, and its
+ * channel owns the fd.
+ */
+void socketserver_joinAcceptor(socketserver_port *data)
+{
+	socketserver_port *pool;
+
+	if (!data->haveThread) {
+		return;
+	}
+	pthread_join(data->acceptorThread, NULL);
+	data->haveThread = 0;
+	socketserver_closeOwnedFd(data->wakeRead);
+	socketserver_closeOwnedFd(data->wakeFd);
+	data->wakeRead = data->wakeFd = -1;
+	shutdown(data->out, SHUT_RDWR);
+	for (pool = data->pools; pool != NULL; pool = pool->nextPtr) {
+		shutdown(pool->out, SHUT_RDWR);
+		/* The pools share the port's counters. */
+		pool->stats = NULL;
+	}
+	if (data->stats != NULL) {
+		munmap(data->stats, sizeof(socketserver_stats));
+		data->stats = NULL;
+	}
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,270 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * acl - client address filtering for "server -allow", "-deny" and
+ * "-proxyfrom"
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * Both lists are compiled into one binary trie per address family, a bit
+ * of the address per level, with the action of each listed prefix on the
+ * node where the prefix ends.  A lookup walks the client's address and
+ * keeps the last action it passes, so the longest matching prefix
+ * decides.  An address no prefix matches is allowed, unless there is an
+ * -allow list.  IPv4-mapped IPv6 addresses are looked up as IPv4.
+ *
+ * The trie is built in the Tcl thread and handed to the acceptor thread,
+ * which is the only one to look at it from then on.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "socketserver.h"
+
+#define ACL_NONE 0
+#define ACL_ALLOW 1
+#define ACL_DENY 2
+
+/* Roots of the tries, the first two nodes */
+#define ACL_ROOT4 0
+#define ACL_ROOT6 1
+
+typedef struct acl_node {
+	unsigned int child[2]; /* node for the next bit being 0 or 1, 0 for none */
+	unsigned char action; /* ACL_* of the prefix ending here */
+} acl_node;
+
+struct socketserver_acl {
+	acl_node *nodes;
+	unsigned int count;
+	unsigned int size;
+	int otherwise; /* ACL_* of addresses no prefix matches */
+};
+
+static const unsigned char mappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/*
+ * Returns: the index of a new empty node, or 0 when out of memory.
+ */
+static unsigned int acl_newNode(socketserver_acl *acl)
+{
+	if (acl->count == acl->size) {
+		unsigned int size = acl->size * 2;
+		acl_node *nodes = (acl_node *)realloc(acl->nodes, size * sizeof(acl_node));
+
+		if (nodes == NULL) {
+			return 0;
+		}
+		acl->nodes = nodes;
+		acl->size = size;
+	}
+	memset(&acl->nodes[acl->count], 0, sizeof(acl_node));
+	return acl->count++;
+}
+
+/*
+ * Mark the prefix of len bits of addr.  A prefix in both lists is denied.
+ *
+ * Returns: 0, or -1 when out of memory.
+ */
+static int acl_insert(socketserver_acl *acl, unsigned int root, const unsigned char *addr, int len, int action)
+{
+	unsigned int node = root;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		int bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+		unsigned int next = acl->nodes[node].child[bit];
+
+		if (next == 0) {
+			if ((next = acl_newNode(acl)) == 0) {
+				return -1;
+			}
+			acl->nodes[node].child[bit] = next;
+		}
+		node = next;
+	}
+	if (acl->nodes[node].action != ACL_DENY) {
+		acl->nodes[node].action = action;
+	}
+	return 0;
+}
+
+/*
+ * Add the entries of an -allow or -deny list: addresses, which stand for
+ * themselves, and address/length prefixes.  Bits after the prefix are
+ * ignored.
+ */
+static int acl_addList(Tcl_Interp *interp, socketserver_acl *acl, Tcl_Obj *listObj, const char *option, int action)
+{
+	Tcl_Obj **elems;
+	int count, i;
+
+	if (listObj == NULL) {
+		return TCL_OK;
+	}
+	if (Tcl_ListObjGetElements(interp, listObj, &count, &elems) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	if (count > SOCKETSERVER_MAX_ACL) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s is limited to %d entries", option, SOCKETSERVER_MAX_ACL));
+		return TCL_ERROR;
+	}
+	for (i = 0; i < count; i++) {
+		const char *entry = Tcl_GetString(elems[i]);
+		const char *slash = strchr(entry, '/');
+		char host[INET6_ADDRSTRLEN];
+		unsigned char addr[16];
+		size_t hostLen = slash != NULL ? (size_t)(slash - entry) : strlen(entry);
+		int len = -1, max, root;
+		char *end;
+
+		if (hostLen >= sizeof(host)) {
+			goto bad;
+		}
+		memcpy(host, entry, hostLen);
+		host[hostLen] = 0;
+		if (inet_pton(AF_INET, host, addr) == 1) {
+			root = ACL_ROOT4;
+			max = 32;
+		} else if (inet_pton(AF_INET6, host, addr) == 1) {
+			root = ACL_ROOT6;
+			max = 128;
+		} else {
+			goto bad;
+		}
+		if (slash != NULL) {
+			len = (int)strtol(slash + 1, &end, 10);
+			if (slash[1] < '0' || slash[1] > '9' || *end != 0 || len > max) {
+				goto bad;
+			}
+		} else {
+			len = max;
+		}
+		/* ::ffff:a.b.c.d/len is a.b.c.d/(len - 96), the form the lookup uses. */
+		if (root == ACL_ROOT6 && len >= 96 && memcmp(addr, mappedPrefix, 12) == 0) {
+			memmove(addr, addr + 12, 4);
+			root = ACL_ROOT4;
+			len -= 96;
+		}
+		if (acl_insert(acl, root, addr, len, action) < 0) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("out of memory building %s", option));
+			return TCL_ERROR;
+		}
+		continue;
+	bad:
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad %s entry \"%s\": must be an address or address/length",
+				option, entry));
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+static int acl_new(Tcl_Interp *interp, Tcl_Obj *allowObj, const char *allowOption, Tcl_Obj *denyObj,
+		socketserver_acl **aclPtr)
+{
+	socketserver_acl *acl;
+	int allowCount = 0, denyCount = 0;
+
+	*aclPtr = NULL;
+	if ((allowObj != NULL && Tcl_ListObjLength(interp, allowObj, &allowCount) != TCL_OK)
+			|| (denyObj != NULL && Tcl_ListObjLength(interp, denyObj, &denyCount) != TCL_OK)) {
+		return TCL_ERROR;
+	}
+	if (allowCount == 0 && denyCount == 0) {
+		return TCL_OK;
+	}
+	acl = (socketserver_acl *)calloc(1, sizeof(socketserver_acl));
+	if (acl == NULL || (acl->nodes = (acl_node *)calloc(256, sizeof(acl_node))) == NULL) {
+		socketserver_aclFree(acl);
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("out of memory building %s", allowOption));
+		return TCL_ERROR;
+	}
+	/* The two roots */
+	acl->size = 256;
+	acl->count = 2;
+	acl->otherwise = allowCount > 0 ? ACL_DENY : ACL_ALLOW;
+	if (acl_addList(interp, acl, allowObj, allowOption, ACL_ALLOW) != TCL_OK
+			|| acl_addList(interp, acl, denyObj, "-deny", ACL_DENY) != TCL_OK) {
+		socketserver_aclFree(acl);
+		return TCL_ERROR;
+	}
+	*aclPtr = acl;
+	return TCL_OK;
+}
+
+/*
+ * Compile the -allow and -deny lists, either of which may be NULL.
+ *
+ * Returns: TCL_OK with *aclPtr set, to NULL when both lists are empty, or
+ * TCL_ERROR with the message in interp.
+ */
+int socketserver_aclNew(Tcl_Interp *interp, Tcl_Obj *allowObj, Tcl_Obj *denyObj, socketserver_acl **aclPtr)
+{
+	return acl_new(interp, allowObj, "-allow", denyObj, aclPtr);
+}
+
+/*
+ * Compile a list of the only addresses allowed, such as -proxyfrom, named
+ * option in messages.
+ *
+ * Returns: as socketserver_aclNew.
+ */
+int socketserver_aclNewOnly(Tcl_Interp *interp, Tcl_Obj *listObj, const char *option, socketserver_acl **aclPtr)
+{
+	return acl_new(interp, listObj, option, NULL, aclPtr);
+}
+
+/*
+ * Returns: 1 if the client at peer may connect.
+ */
+int socketserver_aclCheck(const socketserver_acl *acl, const socketserver_peer *peer)
+{
+	const unsigned char *addr = peer->addr;
+	unsigned int node;
+	int bits, action, i;
+
+	if (peer->family == AF_INET) {
+		node = ACL_ROOT4;
+		bits = 32;
+	} else if (peer->family == AF_INET6 && memcmp(addr, mappedPrefix, 12) == 0) {
+		node = ACL_ROOT4;
+		bits = 32;
+		addr += 12;
+	} else if (peer->family == AF_INET6) {
+		node = ACL_ROOT6;
+		bits = 128;
+	} else {
+		return acl->otherwise == ACL_ALLOW;
+	}
+	action = acl->nodes[node].action;
+	for (i = 0; i < bits; i++) {
+		if ((node = acl->nodes[node].child[(addr[i / 8] >> (7 - i % 8)) & 1]) == 0) {
+			break;
+		}
+		if (acl->nodes[node].action != ACL_NONE) {
+			action = acl->nodes[node].action;
+		}
+	}
+	if (action == ACL_NONE) {
+		action = acl->otherwise;
+	}
+	return action == ACL_ALLOW;
+}
+
+void socketserver_aclFree(socketserver_acl *acl)
+{
+	if (acl != NULL) {
+		free(acl->nodes);
+		free(acl);
+	}
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,489 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * epollnotify - an epoll based Tcl notifier for socketserver workers
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * The Tcl 8.6 unix notifier uses select(), which costs O(n) per wakeup
+ * and cannot watch descriptors above FD_SETSIZE.  This notifier keeps one
+ * epoll instance per thread and is installed with Tcl_SetNotifier.
+ *
+ * Tcl cannot move file handlers from one notifier to another, nor tell us
+ * which handlers exist, so a live notifier is never swapped.  The epoll
+ * notifier is installed only when the package is loaded with
+ * SOCKETSERVER_NOTIFIER=epoll in the environment, before the script has
+ * had a chance to create file handlers.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "socketserver.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define EPOLL_NOTIFIER_MAXEVENTS 256
+
+/*
+ * One per fd with a Tcl file handler.
+ */
+typedef struct EpollFileHandler {
+	int fd;
+	int mask; /* TCL_READABLE, TCL_WRITABLE and/or TCL_EXCEPTION wanted */
+	int readyMask; /* events seen but not yet serviced */
+	int alwaysReady; /* regular files cannot be epolled, select says they are ready */
+	Tcl_FileProc *proc;
+	ClientData clientData;
+} EpollFileHandler;
+
+typedef struct EpollFileHandlerEvent {
+	Tcl_Event header;
+	int fd;
+} EpollFileHandlerEvent;
+
+/*
+ * Per thread notifier state.
+ */
+typedef struct EpollNotifier {
+	int epollFd;
+	int wakeFd; /* eventfd written by the alert proc */
+	int alwaysReadyCount;
+	ClientData oldClientData; /* what Tcl kept from the select notifier, or NULL */
+	Tcl_HashTable fileHandlers; /* EpollFileHandler keyed by fd */
+	struct epoll_event events[EPOLL_NOTIFIER_MAXEVENTS];
+	struct EpollNotifier *nextPtr;
+} EpollNotifier;
+
+static Tcl_ThreadDataKey dataKey;
+TCL_DECLARE_MUTEX(notifierMutex);
+/* All initialized notifiers, for alerts and for fork. */
+static EpollNotifier *firstNotifierPtr = NULL;
+static int installed = 0;
+/* Set while learning what Tcl passes to epoll_AlertNotifier for this thread. */
+static EpollNotifier *learnPtr = NULL;
+
+static int epoll_events(int mask)
+{
+	int events = 0;
+
+	if (mask & TCL_READABLE) {
+		events |= EPOLLIN;
+	}
+	if (mask & TCL_WRITABLE) {
+		events |= EPOLLOUT;
+	}
+	if (mask & TCL_EXCEPTION) {
+		events |= EPOLLPRI;
+	}
+	return events;
+}
+
+static void epoll_open(EpollNotifier *notifierPtr)
+{
+	struct epoll_event ev;
+	Tcl_HashEntry *entryPtr;
+	Tcl_HashSearch search;
+
+	notifierPtr->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	notifierPtr->wakeFd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (notifierPtr->epollFd == -1 || notifierPtr->wakeFd == -1) {
+		Tcl_Panic("socketserver epoll notifier: %s", strerror(errno));
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(notifierPtr->epollFd, EPOLL_CTL_ADD, notifierPtr->wakeFd, &ev);
+
+	/* Re-register the existing handlers, this is a no-op on first use. */
+	for (entryPtr = Tcl_FirstHashEntry(&notifierPtr->fileHandlers, &search); entryPtr != NULL;
+			entryPtr = Tcl_NextHashEntry(&search)) {
+		EpollFileHandler *filePtr = (EpollFileHandler *)Tcl_GetHashValue(entryPtr);
+		if (filePtr->alwaysReady) {
+			continue;
+		}
+		ev.events = epoll_events(filePtr->mask);
+		ev.data.ptr = filePtr;
+		epoll_ctl(notifierPtr->epollFd, EPOLL_CTL_ADD, filePtr->fd, &ev);
+	}
+}
+
+/*
+ * The epoll instance and eventfd would be shared with the parent after a
+ * fork, so the child makes its own.
+ */
+static void epoll_atForkChild(void)
+{
+	EpollNotifier *notifierPtr;
+
+	for (notifierPtr = firstNotifierPtr; notifierPtr != NULL; notifierPtr = notifierPtr->nextPtr) {
+		close(notifierPtr->epollFd);
+		close(notifierPtr->wakeFd);
+		epoll_open(notifierPtr);
+	}
+}
+
+static ClientData epoll_InitNotifier(void)
+{
+	EpollNotifier **tsdPtr = (EpollNotifier **)Tcl_GetThreadData(&dataKey, sizeof(EpollNotifier *));
+
+	if (*tsdPtr == NULL) {
+		EpollNotifier *notifierPtr = (EpollNotifier *)ckalloc(sizeof(EpollNotifier));
+		memset(notifierPtr, 0, sizeof(EpollNotifier));
+		Tcl_InitHashTable(&notifierPtr->fileHandlers, TCL_ONE_WORD_KEYS);
+		epoll_open(notifierPtr);
+		Tcl_MutexLock(&notifierMutex);
+		notifierPtr->nextPtr = firstNotifierPtr;
+		firstNotifierPtr = notifierPtr;
+		Tcl_MutexUnlock(&notifierMutex);
+		*tsdPtr = notifierPtr;
+	}
+	return (ClientData)*tsdPtr;
+}
+
+static void epoll_FinalizeNotifier(ClientData clientData)
+{
+	EpollNotifier **tsdPtr = (EpollNotifier **)Tcl_GetThreadData(&dataKey, sizeof(EpollNotifier *));
+	EpollNotifier *notifierPtr = *tsdPtr;
+	EpollNotifier **linkPtr;
+	Tcl_HashEntry *entryPtr;
+	Tcl_HashSearch search;
+
+	if (notifierPtr == NULL) {
+		return;
+	}
+	Tcl_MutexLock(&notifierMutex);
+	for (linkPtr = &firstNotifierPtr; *linkPtr != NULL; linkPtr = &(*linkPtr)->nextPtr) {
+		if (*linkPtr == notifierPtr) {
+			*linkPtr = notifierPtr->nextPtr;
+			break;
+		}
+	}
+	Tcl_MutexUnlock(&notifierMutex);
+
+	for (entryPtr = Tcl_FirstHashEntry(&notifierPtr->fileHandlers, &search); entryPtr != NULL;
+			entryPtr = Tcl_NextHashEntry(&search)) {
+		ckfree(Tcl_GetHashValue(entryPtr));
+	}
+	Tcl_DeleteHashTable(&notifierPtr->fileHandlers);
+	close(notifierPtr->epollFd);
+	close(notifierPtr->wakeFd);
+	ckfree(notifierPtr);
+	*tsdPtr = NULL;
+}
+
+/*
+ * Wake up a thread blocked in epoll_wait.  The thread that loaded the
+ * package was initialized by the select notifier, and Tcl keeps handing us
+ * that notifier's clientData for it, so it is matched by oldClientData.  A
+ * thread we cannot match predates the package; it has no handlers with us
+ * to lose, but every epoll notifier is woken so that it is not missed.
+ */
+static void epoll_AlertNotifier(ClientData clientData)
+{
+	EpollNotifier *notifierPtr;
+	uint64_t one = 1;
+	int found = 0;
+
+	Tcl_MutexLock(&notifierMutex);
+	if (learnPtr != NULL) {
+		learnPtr->oldClientData = clientData;
+		learnPtr = NULL;
+	}
+	for (notifierPtr = firstNotifierPtr; notifierPtr != NULL; notifierPtr = notifierPtr->nextPtr) {
+		if (notifierPtr == (EpollNotifier *)clientData || notifierPtr->oldClientData == clientData) {
+			found = 1;
+			break;
+		}
+	}
+	for (notifierPtr = firstNotifierPtr; notifierPtr != NULL; notifierPtr = notifierPtr->nextPtr) {
+		if (!found || notifierPtr == (EpollNotifier *)clientData || notifierPtr->oldClientData == clientData) {
+			if (write(notifierPtr->wakeFd, &one, sizeof(one)) < 0) {
+				/* the counter is already non-zero */
+			}
+		}
+	}
+	Tcl_MutexUnlock(&notifierMutex);
+}
+
+static void epoll_SetTimer(const Tcl_Time *timePtr)
+{
+	/* The timeout is passed to epoll_WaitForEvent directly. */
+}
+
+static void epoll_ServiceModeHook(int mode)
+{
+}
+
+static void epoll_CreateFileHandler(int fd, int mask, Tcl_FileProc *proc, ClientData clientData)
+{
+	EpollNotifier *notifierPtr = (EpollNotifier *)epoll_InitNotifier();
+	EpollFileHandler *filePtr;
+	Tcl_HashEntry *entryPtr;
+	struct epoll_event ev;
+	int op = EPOLL_CTL_MOD;
+	int isNew;
+
+	entryPtr = Tcl_CreateHashEntry(&notifierPtr->fileHandlers, (char *)((long)fd), &isNew);
+	if (isNew) {
+		filePtr = (EpollFileHandler *)ckalloc(sizeof(EpollFileHandler));
+		memset(filePtr, 0, sizeof(EpollFileHandler));
+		filePtr->fd = fd;
+		Tcl_SetHashValue(entryPtr, filePtr);
+		op = EPOLL_CTL_ADD;
+	} else {
+		filePtr = (EpollFileHandler *)Tcl_GetHashValue(entryPtr);
+	}
+	filePtr->proc = proc;
+	filePtr->clientData = clientData;
+	filePtr->mask = mask;
+
+	if (filePtr->alwaysReady) {
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = epoll_events(mask);
+	ev.data.ptr = filePtr;
+	if (epoll_ctl(notifierPtr->epollFd, op, fd, &ev) == -1 && errno == EPERM) {
+		filePtr->alwaysReady = 1;
+		notifierPtr->alwaysReadyCount++;
+	}
+}
+
+static void epoll_DeleteFileHandler(int fd)
+{
+	EpollNotifier *notifierPtr = (EpollNotifier *)epoll_InitNotifier();
+	Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&notifierPtr->fileHandlers, (char *)((long)fd));
+	EpollFileHandler *filePtr;
+
+	if (entryPtr == NULL) {
+		return;
+	}
+	filePtr = (EpollFileHandler *)Tcl_GetHashValue(entryPtr);
+	Tcl_DeleteHashEntry(entryPtr);
+	if (filePtr->alwaysReady) {
+		notifierPtr->alwaysReadyCount--;
+	} else {
+		/* The fd may already be closed, errors are ok. */
+		epoll_ctl(notifierPtr->epollFd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	ckfree(filePtr);
+}
+
+/*
+ * Call the handler for a file that became ready, if it still exists.
+ */
+static int epoll_FileHandlerEventProc(Tcl_Event *evPtr, int flags)
+{
+	EpollNotifier *notifierPtr = (EpollNotifier *)epoll_InitNotifier();
+	Tcl_HashEntry *entryPtr;
+	int fd = ((EpollFileHandlerEvent *)evPtr)->fd;
+
+	if (!(flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+	entryPtr = Tcl_FindHashEntry(&notifierPtr->fileHandlers, (char *)((long)fd));
+	if (entryPtr != NULL) {
+		EpollFileHandler *filePtr = (EpollFileHandler *)Tcl_GetHashValue(entryPtr);
+		int mask = filePtr->readyMask & filePtr->mask;
+		filePtr->readyMask = 0;
+		if (mask != 0) {
+			filePtr->proc(filePtr->clientData, mask);
+		}
+	}
+	return 1;
+}
+
+static void epoll_ready(EpollFileHandler *filePtr, int mask)
+{
+	mask &= filePtr->mask;
+	if (mask == 0) {
+		return;
+	}
+	if (filePtr->readyMask == 0) {
+		EpollFileHandlerEvent *evPtr = (EpollFileHandlerEvent *)ckalloc(sizeof(EpollFileHandlerEvent));
+		evPtr->header.proc = epoll_FileHandlerEventProc;
+		evPtr->fd = filePtr->fd;
+		Tcl_QueueEvent((Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+	}
+	filePtr->readyMask |= mask;
+}
+
+static int epoll_WaitForEvent(const Tcl_Time *timePtr)
+{
+	EpollNotifier *notifierPtr = (EpollNotifier *)epoll_InitNotifier();
+	int timeout = -1;
+	int i, n;
+
+	if (timePtr != NULL) {
+		timeout = (int)(timePtr->sec * 1000 + (timePtr->usec + 999) / 1000);
+	}
+	if (notifierPtr->alwaysReadyCount > 0) {
+		timeout = 0;
+	}
+
+	n = epoll_wait(notifierPtr->epollFd, notifierPtr->events, EPOLL_NOTIFIER_MAXEVENTS, timeout);
+	if (n == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct epoll_event *ev = &notifierPtr->events[i];
+		int mask = 0;
+
+		if (ev->data.ptr == NULL) {
+			uint64_t count;
+			if (read(notifierPtr->wakeFd, &count, sizeof(count)) < 0) {
+				/* already drained */
+			}
+			continue;
+		}
+		/* select() reports hangups and errors as readable, so do we. */
+		if (ev->events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+			mask |= TCL_READABLE;
+		}
+		if (ev->events & (EPOLLOUT|EPOLLERR)) {
+			mask |= TCL_WRITABLE;
+		}
+		if (ev->events & EPOLLPRI) {
+			mask |= TCL_EXCEPTION;
+		}
+		epoll_ready((EpollFileHandler *)ev->data.ptr, mask);
+	}
+
+	if (notifierPtr->alwaysReadyCount > 0) {
+		Tcl_HashSearch search;
+		Tcl_HashEntry *entryPtr;
+		for (entryPtr = Tcl_FirstHashEntry(&notifierPtr->fileHandlers, &search); entryPtr != NULL;
+				entryPtr = Tcl_NextHashEntry(&search)) {
+			EpollFileHandler *filePtr = (EpollFileHandler *)Tcl_GetHashValue(entryPtr);
+			if (filePtr->alwaysReady) {
+				epoll_ready(filePtr, TCL_READABLE|TCL_WRITABLE);
+			}
+		}
+	}
+	return 0;
+}
+
+static Tcl_NotifierProcs epollNotifierProcs = {
+	epoll_SetTimer,
+	epoll_WaitForEvent,
+	epoll_CreateFileHandler,
+	epoll_DeleteFileHandler,
+	epoll_InitNotifier,
+	epoll_FinalizeNotifier,
+	epoll_AlertNotifier,
+	epoll_ServiceModeHook
+};
+
+/*
+ * Install the epoll notifier for the whole process, once.  Tcl_ThreadAlert
+ * on ourselves tells us the clientData Tcl keeps for this thread.
+ */
+static void socketserver_installEpoll(void)
+{
+	EpollNotifier *notifierPtr;
+
+	Tcl_MutexLock(&notifierMutex);
+	if (installed) {
+		Tcl_MutexUnlock(&notifierMutex);
+		return;
+	}
+	pthread_atfork(NULL, NULL, epoll_atForkChild);
+	Tcl_SetNotifier(&epollNotifierProcs);
+	installed = 1;
+	Tcl_MutexUnlock(&notifierMutex);
+
+	notifierPtr = (EpollNotifier *)epoll_InitNotifier();
+	Tcl_MutexLock(&notifierMutex);
+	learnPtr = notifierPtr;
+	Tcl_MutexUnlock(&notifierMutex);
+	Tcl_ThreadAlert(Tcl_GetCurrentThread());
+	Tcl_MutexLock(&notifierMutex);
+	learnPtr = NULL;
+	Tcl_MutexUnlock(&notifierMutex);
+}
+#endif /* __linux__ */
+
+/*
+ * Called as the package is loaded: install the notifier named by
+ * SOCKETSERVER_NOTIFIER, "select" (the default) or "epoll".
+ */
+int socketserver_notifierInit(Tcl_Interp *interp)
+{
+	const char *name = getenv("SOCKETSERVER_NOTIFIER");
+
+	if (name == NULL || *name == '\0' || strcmp(name, "select") == 0) {
+		return TCL_OK;
+	}
+	if (strcmp(name, "epoll") != 0) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad SOCKETSERVER_NOTIFIER \"%s\": must be select or epoll", name));
+		return TCL_ERROR;
+	}
+#ifdef __linux__
+	socketserver_installEpoll();
+	return TCL_OK;
+#else
+	Tcl_SetObjResult(interp, Tcl_NewStringObj("epoll notifier is only available on Linux", -1));
+	return TCL_ERROR;
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * socketserverNotifierObjCmd --
+ *
+ *      ::socketserver::notifier ?epoll?
+ *
+ *      With no argument return the notifier in use.  With "epoll" check
+ *      that the epoll notifier is in use; it can only be installed as the
+ *      package is loaded, see socketserver_notifierInit.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int socketserverNotifierObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	int optIndex;
+	static CONST char *options[] = { "epoll", NULL };
+
+	if (objc > 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "?epoll?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 2) {
+		if (Tcl_GetIndexFromObj (interp, objv[1], options, "notifier",
+					TCL_EXACT, &optIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+#ifdef __linux__
+		if (!installed) {
+			Tcl_SetObjResult(interp, Tcl_NewStringObj("the notifier cannot be changed once file handlers may exist: "
+				"set SOCKETSERVER_NOTIFIER=epoll in the environment before loading the package", -1));
+			return TCL_ERROR;
+		}
+#else
+		Tcl_SetObjResult(interp, Tcl_NewStringObj("epoll notifier is only available on Linux", -1));
+		return TCL_ERROR;
+#endif
+	}
+
+#ifdef __linux__
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(installed ? "epoll" : "select", -1));
+#else
+	Tcl_SetObjResult(interp, Tcl_NewStringObj("select", -1));
+#endif
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
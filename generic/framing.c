@@ -0,0 +1,363 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * framing - message codecs for -framing socketserver handlers
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * With "::socketserver::socket client -framing codec handlerProc" the
+ * received fd is read here, split into messages, and the handler is called
+ * once per complete message as "handlerProc fd message", with the message
+ * as a byte array.  At end of stream, or when the peer breaks the framing,
+ * the handler is called once more with an empty message and
+ * "::socketserver::eof fd" returns 1.  The handler closes the fd with
+ * ::socketserver::close.
+ *
+ *   line       messages end with \n, a \r before it is removed
+ *   netstring  <decimal length>:<data>,
+ *   u32be      4 byte big endian length, then data
+ *   u16be      2 byte big endian length, then data
+ *
+ * ::socketserver::reply fd message writes a message with the same framing,
+ * queueing what the socket cannot take at once.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "socketserver.h"
+
+#define SOCKETSERVER_FRAMING_READ 16384
+/* Longest "<length>:" prefix of a netstring we will look at */
+#define SOCKETSERVER_NETSTRING_PREFIX 11
+
+/*
+ * Find the next complete message in buf.
+ *
+ * Returns: 1 with dataOff, dataLen and frameLen set when a message is
+ * complete, 0 when more bytes are needed and -1 when the framing is broken
+ * or the message is larger than maxFrame.
+ */
+static int socketserver_nextFrame(int framing, const unsigned char *buf, size_t len, size_t maxFrame,
+		size_t *dataOff, size_t *dataLen, size_t *frameLen)
+{
+	size_t need, i;
+
+	switch (framing) {
+		case SOCKETSERVER_FRAMING_LINE: {
+			const unsigned char *nl = memchr(buf, '\n', len);
+			if (nl == NULL) {
+				return len > maxFrame ? -1 : 0;
+			}
+			/* A long line can arrive in one read with its newline. */
+			if ((size_t)(nl - buf) > maxFrame) {
+				return -1;
+			}
+			*dataOff = 0;
+			*dataLen = nl - buf;
+			*frameLen = *dataLen + 1;
+			if (*dataLen > 0 && buf[*dataLen - 1] == '\r') {
+				(*dataLen)--;
+			}
+			return 1;
+		}
+
+		case SOCKETSERVER_FRAMING_NETSTRING:
+			need = 0;
+			for (i = 0; i < len; i++) {
+				if (buf[i] == ':') {
+					break;
+				}
+				if (buf[i] < '0' || buf[i] > '9' || i >= SOCKETSERVER_NETSTRING_PREFIX - 1) {
+					return -1;
+				}
+				need = need * 10 + (buf[i] - '0');
+			}
+			if (i == len) {
+				return 0;
+			}
+			if (i == 0 || need > maxFrame) {
+				return -1;
+			}
+			if (len < i + 1 + need + 1) {
+				return 0;
+			}
+			if (buf[i + 1 + need] != ',') {
+				return -1;
+			}
+			*dataOff = i + 1;
+			*dataLen = need;
+			*frameLen = i + 1 + need + 1;
+			return 1;
+
+		case SOCKETSERVER_FRAMING_U32BE:
+			if (len < 4) {
+				return 0;
+			}
+			need = ((size_t)buf[0] << 24) | ((size_t)buf[1] << 16) | ((size_t)buf[2] << 8) | buf[3];
+			if (need > maxFrame) {
+				return -1;
+			}
+			if (len < 4 + need) {
+				return 0;
+			}
+			*dataOff = 4;
+			*dataLen = need;
+			*frameLen = 4 + need;
+			return 1;
+
+		case SOCKETSERVER_FRAMING_U16BE:
+			if (len < 2) {
+				return 0;
+			}
+			need = ((size_t)buf[0] << 8) | buf[1];
+			if (need > maxFrame) {
+				return -1;
+			}
+			if (len < 2 + need) {
+				return 0;
+			}
+			*dataOff = 2;
+			*dataLen = need;
+			*frameLen = 2 + need;
+			return 1;
+	}
+	return -1;
+}
+
+/*
+ * Call the handler for one message.
+ *
+ * Returns: 0 if the connection was closed by the handler.
+ */
+static int socketserver_deliver(socketserver_conn *conn, Tcl_Obj *messageObj)
+{
+	socketserver_port *port = conn->port;
+	Tcl_Interp *interp = port->interp;
+	Tcl_Obj *cmdPtr = Tcl_DuplicateObj(port->callback);
+
+	Tcl_ListObjAppendElement(NULL, cmdPtr, Tcl_NewIntObj(conn->fd));
+	Tcl_ListObjAppendElement(NULL, cmdPtr, messageObj);
+	Tcl_IncrRefCount(cmdPtr);
+	if (Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) != TCL_OK) {
+		Tcl_BackgroundError(interp);
+	}
+	Tcl_DecrRefCount(cmdPtr);
+
+	return conn->fd != -1;
+}
+
+/*
+ * The peer has finished, or broke the framing.  Stop reading and tell the
+ * handler.
+ */
+static void socketserver_framingEof(socketserver_conn *conn)
+{
+	conn->eof = 1;
+	socketserver_watchConn(conn);
+	/* A trailing line without a newline is still a line. */
+	if (conn->framing == SOCKETSERVER_FRAMING_LINE && conn->bufLen > 0) {
+		Tcl_Obj *lineObj = Tcl_NewByteArrayObj(conn->buf, conn->bufLen);
+		conn->bufLen = 0;
+		if (!socketserver_deliver(conn, lineObj)) {
+			return;
+		}
+	}
+	conn->bufLen = 0;
+	socketserver_deliver(conn, Tcl_NewByteArrayObj(NULL, 0));
+}
+
+/*
+ * Deliver every complete message in the buffer.  Each message is removed
+ * from the buffer before the handler runs, so a handler that enters the
+ * event loop cannot see it twice.  The caller holds a Tcl_Preserve on conn.
+ */
+static void socketserver_framingDeliver(socketserver_conn *conn)
+{
+	size_t maxFrame = conn->port->maxFrame;
+
+	while (conn->fd != -1 && !conn->eof) {
+		size_t dataOff, dataLen, frameLen;
+		Tcl_Obj *messageObj;
+		int found = socketserver_nextFrame(conn->framing, conn->buf, conn->bufLen,
+				maxFrame, &dataOff, &dataLen, &frameLen);
+
+		if (found < 0) {
+			socketserver_framingEof(conn);
+		}
+		if (found <= 0) {
+			break;
+		}
+		messageObj = Tcl_NewByteArrayObj(conn->buf + dataOff, dataLen);
+		conn->bufLen -= frameLen;
+		memmove(conn->buf, conn->buf + frameLen, conn->bufLen);
+		if (!socketserver_deliver(conn, messageObj)) {
+			break;
+		}
+	}
+}
+
+/*
+ * Read what is available and deliver every complete message, when the
+ * file handler on the connection finds it readable.
+ */
+void socketserver_readFraming(socketserver_conn *conn)
+{
+	ssize_t n;
+
+	if (conn->bufSize - conn->bufLen < SOCKETSERVER_FRAMING_READ) {
+		conn->bufSize *= 2;
+		if (conn->bufSize < conn->bufLen + SOCKETSERVER_FRAMING_READ) {
+			conn->bufSize = conn->bufLen + SOCKETSERVER_FRAMING_READ;
+		}
+		conn->buf = (unsigned char *)ckrealloc((char *)conn->buf, conn->bufSize);
+	}
+	n = read(conn->fd, conn->buf + conn->bufLen, conn->bufSize - conn->bufLen);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+
+	Tcl_Preserve(conn);
+	if (n <= 0) {
+		socketserver_framingEof(conn);
+		Tcl_Release(conn);
+		return;
+	}
+	conn->bufLen += n;
+	socketserver_framingDeliver(conn);
+	Tcl_Release(conn);
+}
+
+/*
+ * Start reading messages on a newly received connection.  Messages in the
+ * preLen bytes the master read ahead are delivered at once.
+ */
+void socketserver_startFraming(socketserver_conn *conn, const unsigned char *pre, size_t preLen)
+{
+	int flags = fcntl(conn->fd, F_GETFL);
+
+	fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+	conn->framing = conn->port->framing;
+	socketserver_watchConn(conn);
+	if (preLen > 0) {
+		conn->bufSize = preLen + SOCKETSERVER_FRAMING_READ;
+		conn->buf = (unsigned char *)ckalloc(conn->bufSize);
+		memcpy(conn->buf, pre, preLen);
+		conn->bufLen = preLen;
+		Tcl_Preserve(conn);
+		socketserver_framingDeliver(conn);
+		Tcl_Release(conn);
+	}
+}
+
+/*
+ * Stop reading messages.  The caller updates the file handler.
+ */
+void socketserver_stopFraming(socketserver_conn *conn)
+{
+	conn->eof = 1;
+	if (conn->buf != NULL) {
+		ckfree(conn->buf);
+		conn->buf = NULL;
+	}
+	conn->bufLen = conn->bufSize = 0;
+}
+
+/*
+ * ::socketserver::reply fd message
+ *
+ * Write message with the framing of the connection.  What the socket
+ * cannot take now is queued, so a slow reader only delays its own
+ * replies.
+ */
+int socketserverReplyObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+	unsigned char prefix[SOCKETSERVER_NETSTRING_PREFIX + 1];
+	struct iovec iov[3];
+	int iovcnt = 0;
+	int len;
+	unsigned char *data;
+
+	if (objc != 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd message");
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	if (!conn->framing) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("fd %d was not received with -framing", conn->fd));
+		return TCL_ERROR;
+	}
+	data = Tcl_GetByteArrayFromObj(objv[2], &len);
+
+	switch (conn->framing) {
+		case SOCKETSERVER_FRAMING_NETSTRING:
+			iov[iovcnt].iov_base = prefix;
+			iov[iovcnt++].iov_len = sprintf((char *)prefix, "%d:", len);
+			break;
+		case SOCKETSERVER_FRAMING_U32BE:
+			prefix[0] = (len >> 24) & 0xff;
+			prefix[1] = (len >> 16) & 0xff;
+			prefix[2] = (len >> 8) & 0xff;
+			prefix[3] = len & 0xff;
+			iov[iovcnt].iov_base = prefix;
+			iov[iovcnt++].iov_len = 4;
+			break;
+		case SOCKETSERVER_FRAMING_U16BE:
+			if (len > 0xffff) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("message too long for u16be framing", -1));
+				return TCL_ERROR;
+			}
+			prefix[0] = (len >> 8) & 0xff;
+			prefix[1] = len & 0xff;
+			iov[iovcnt].iov_base = prefix;
+			iov[iovcnt++].iov_len = 2;
+			break;
+	}
+	iov[iovcnt].iov_base = data;
+	iov[iovcnt++].iov_len = len;
+	if (conn->framing == SOCKETSERVER_FRAMING_LINE) {
+		iov[iovcnt].iov_base = "\n";
+		iov[iovcnt++].iov_len = 1;
+	} else if (conn->framing == SOCKETSERVER_FRAMING_NETSTRING) {
+		iov[iovcnt].iov_base = ",";
+		iov[iovcnt++].iov_len = 1;
+	}
+
+	if (socketserver_queueWrite(conn, iov, iovcnt) < 0) {
+		Tcl_SetErrno(errno);
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing fd %d: %s", conn->fd, Tcl_PosixError(interp)));
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/*
+ * ::socketserver::eof fd
+ *
+ * Returns 1 once the stream of messages on fd has ended.
+ */
+int socketserverEofObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd");
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(conn->eof));
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
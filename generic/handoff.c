@@ -0,0 +1,296 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * handoff - messages on the socketpair between the master and its workers
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ * educated by code snippets from flingfd under Apache V2.0 license.
+ *
+ * Each message is a socketserver_msg, optionally carrying one fd with
+ * SCM_RIGHTS.  The master sends connections to the workers; workers send
+ * messages about connections back on the same socketpair.  Every message
+ * carries SOCKETSERVER_MSG_VERSION so a worker and a master built from
+ * different sources never misread each other's fields.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "socketserver.h"
+
+/*
+ * Send msg over sock, followed by msg->preLen bytes of pre, with fd
+ * attached when it is not -1.
+ *
+ * Returns: 0 for success and 1 for error.
+ */
+int socketserver_sendConn(int sock, const socketserver_msg *msg, const void *pre, int fd, int flags)
+{
+	socketserver_msg out = *msg;
+	struct msghdr hdr;
+	struct iovec iov[2];
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	out.version = SOCKETSERVER_MSG_VERSION;
+	out.sentAt = socketserver_now();
+	if (pre == NULL) {
+		out.preLen = 0;
+	}
+	iov[0].iov_base = &out;
+	iov[0].iov_len = sizeof(socketserver_msg);
+	iov[1].iov_base = (void *)pre;
+	iov[1].iov_len = out.preLen;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = out.preLen > 0 ? 2 : 1;
+
+	if (fd != -1) {
+		struct cmsghdr *header;
+		hdr.msg_control = control.buf;
+		hdr.msg_controllen = sizeof(control.buf);
+		header = CMSG_FIRSTHDR(&hdr);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+	}
+
+	return sendmsg(sock, &hdr, flags | MSG_NOSIGNAL) == (ssize_t)(sizeof(socketserver_msg) + out.preLen) ? 0 : 1;
+}
+
+/*
+ * Send msg over sock, with fd attached when it is not -1.
+ *
+ * Returns: 0 for success and 1 for error.
+ */
+int socketserver_sendMsg(int sock, const socketserver_msg *msg, int fd, int flags)
+{
+	return socketserver_sendConn(sock, msg, NULL, fd, flags);
+}
+
+/*
+ * Throw away count bytes of payload left on a SOCK_STREAM socket, so the
+ * next read starts at the next message.
+ */
+static void recv_skip(int sock, size_t count)
+{
+	char scratch[256];
+
+	while (count > 0) {
+		ssize_t n = recv(sock, scratch, count < sizeof(scratch) ? count : sizeof(scratch), MSG_DONTWAIT);
+		if (n <= 0) {
+			break;
+		}
+		count -= n;
+	}
+}
+
+/*
+ * Receive a message from sock without blocking, and up to preSize bytes
+ * of payload after it into pre.  *fdPtr is set to the attached fd, or -1.
+ * Without pre the payload is discarded and msg->preLen set to 0.
+ *
+ * The socket may be SOCK_SEQPACKET or SOCK_STREAM.  On a stream nothing
+ * past the message may be read, or the next one is lost, so when there
+ * can be payload the header is looked at first to learn its length.
+ *
+ * Returns: 1 for a message, 0 at end of file and -1 for error, including
+ * no message being available and a message of another version.
+ */
+int socketserver_recvConn(int sock, socketserver_msg *msg, void *pre, size_t preSize, int *fdPtr)
+{
+	struct msghdr hdr;
+	struct iovec iov[2];
+	struct cmsghdr *header;
+	size_t want = 0;
+	ssize_t n;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	*fdPtr = -1;
+	if (pre != NULL) {
+		n = recv(sock, msg, sizeof(socketserver_msg), MSG_PEEK | MSG_DONTWAIT);
+		if (n <= 0) {
+			return n == 0 ? 0 : -1;
+		}
+		if (n == (ssize_t)sizeof(socketserver_msg) && msg->version == SOCKETSERVER_MSG_VERSION) {
+			want = msg->preLen < preSize ? msg->preLen : preSize;
+		}
+	}
+	iov[0].iov_base = msg;
+	iov[0].iov_len = sizeof(socketserver_msg);
+	iov[1].iov_base = pre;
+	iov[1].iov_len = want;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = want > 0 ? 2 : 1;
+	hdr.msg_control = control.buf;
+	hdr.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(sock, &hdr, MSG_DONTWAIT);
+	if (n <= 0) {
+		return n == 0 ? 0 : -1;
+	}
+
+	for (header = CMSG_FIRSTHDR(&hdr); header != NULL; header = CMSG_NXTHDR(&hdr, header)) {
+		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+			int count = (header->cmsg_len - (CMSG_DATA(header) - (unsigned char *)header)) / sizeof(int);
+			if (count > 0) {
+				memcpy(fdPtr, CMSG_DATA(header), sizeof(int));
+			}
+		}
+	}
+
+	/* SOCK_SEQPACKET drops what is left of a message, a stream keeps it. */
+	if (n == (ssize_t)(sizeof(socketserver_msg) + want) && msg->version == SOCKETSERVER_MSG_VERSION
+			&& msg->preLen > want && !(hdr.msg_flags & MSG_TRUNC)) {
+		recv_skip(sock, msg->preLen - want);
+	}
+	if (n != (ssize_t)(sizeof(socketserver_msg) + want) || msg->version != SOCKETSERVER_MSG_VERSION
+			|| (pre != NULL && msg->preLen != want)) {
+		/* A short, oversized or foreign message cannot be trusted. */
+		if (*fdPtr != -1) {
+			close(*fdPtr);
+			*fdPtr = -1;
+		}
+		return -1;
+	}
+	if (pre == NULL) {
+		msg->preLen = 0;
+	}
+	return 1;
+}
+
+/*
+ * Receive a message from sock without blocking, as socketserver_recvConn
+ * without payload.
+ */
+int socketserver_recvMsg(int sock, socketserver_msg *msg, int *fdPtr)
+{
+	return socketserver_recvConn(sock, msg, NULL, 0, fdPtr);
+}
+
+/*
+ * DONE messages the socketpair had no room for, sent again from the event
+ * loop.  Each one the master never gets keeps a connection counted until
+ * its -deadline or -donetimeout.
+ */
+typedef struct handoff_done {
+	int sock;
+	unsigned int id;
+	struct handoff_done *nextPtr;
+} handoff_done;
+
+#define HANDOFF_DONE_RETRY 20 /* ms between attempts */
+
+static handoff_done *doneHead = NULL;
+static handoff_done *doneTail = NULL;
+static Tcl_TimerToken doneTimer = NULL;
+static pid_t donePid = 0; /* process the list belongs to */
+
+/*
+ * Returns: 0 when sent or not worth retrying, 1 to try again later.
+ */
+static int done_send(int sock, unsigned int id)
+{
+	socketserver_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = SOCKETSERVER_MSG_DONE;
+	msg.id = id;
+	if (socketserver_sendMsg(sock, &msg, -1, MSG_DONTWAIT) == 0) {
+		return 0;
+	}
+	/* Anything else means the master has gone away. */
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ENOMEM || errno == EINTR;
+}
+
+/*
+ * Forget what a parent process left queued, it sends that itself.
+ */
+static void done_own(void)
+{
+	if (donePid != getpid()) {
+		donePid = getpid();
+		doneHead = doneTail = NULL;
+		doneTimer = NULL;
+	}
+}
+
+static void done_retry(ClientData clientData)
+{
+	done_own();
+	doneTimer = NULL;
+	while (doneHead != NULL && done_send(doneHead->sock, doneHead->id) == 0) {
+		handoff_done *done = doneHead;
+		doneHead = done->nextPtr;
+		ckfree((char *)done);
+	}
+	if (doneHead == NULL) {
+		doneTail = NULL;
+	} else {
+		doneTimer = Tcl_CreateTimerHandler(HANDOFF_DONE_RETRY, done_retry, NULL);
+	}
+}
+
+/*
+ * Tell the master that the worker has closed connection id, so it can
+ * close its own copy or stop counting the connection.  This never blocks;
+ * if the socketpair is full the message is queued and sent from the event
+ * loop.
+ */
+void socketserver_sendDone(int sock, unsigned int id)
+{
+	handoff_done *done;
+
+	if (id == 0) {
+		return;
+	}
+	done_own();
+	if (doneHead == NULL && done_send(sock, id) == 0) {
+		return;
+	}
+	done = (handoff_done *)ckalloc(sizeof(handoff_done));
+	done->sock = sock;
+	done->id = id;
+	done->nextPtr = NULL;
+	if (doneTail != NULL) {
+		doneTail->nextPtr = done;
+	} else {
+		doneHead = done;
+	}
+	doneTail = done;
+	if (doneTimer == NULL) {
+		doneTimer = Tcl_CreateTimerHandler(HANDOFF_DONE_RETRY, done_retry, NULL);
+	}
+}
+
+/*
+ * Tell the master that this process can take a connection.  The master
+ * counts one credit per message, so it is sent once between connections.
+ */
+void socketserver_sendReady(socketserver_port *data)
+{
+	socketserver_msg msg;
+	pid_t pid = getpid();
+
+	if (data->creditPid == pid) {
+		return;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.type = SOCKETSERVER_MSG_READY;
+	if (socketserver_sendMsg(data->out, &msg, -1, MSG_DONTWAIT) == 0) {
+		data->creditPid = pid;
+	}
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,355 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * httphead - HTTP/1.x request head parsing for -http socketserver handlers
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * With "::socketserver::socket client -http handlerProc" the request line
+ * and headers are read and parsed in C when the fd is received, and the
+ * handler is called as
+ *
+ *   handlerProc channel method target version headers
+ *
+ * where headers is a dict keyed by lower case header name (repeated
+ * headers are joined with ", ") and the channel is positioned at the
+ * start of the request body.  A malformed or oversized head is answered
+ * with a 400 or 431 response, and a head that does not arrive within
+ * -headtimeout ms with a 408, without calling the handler.
+ *
+ * Scanning is done with memchr, which the C library vectorizes.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/socket.h>
+
+#include "socketserver.h"
+
+typedef struct socketserver_httpReq {
+	socketserver_port *port;
+	int fd;
+	unsigned int id; /* master's id for the connection */
+	Tcl_TimerToken timer;
+	size_t len; /* bytes in buf */
+	size_t scanned; /* bytes already searched for the end of the head */
+	int started; /* something other than blank lines has arrived */
+	unsigned char buf[1]; /* port->maxHead bytes, more if the master read more ahead */
+} socketserver_httpReq;
+
+static const char *http_400 = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *http_408 = "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static const char *http_431 = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+/*
+ * Find the end of the request head, the blank line after the headers.
+ * Blank lines before the request line do not count, as http_parse skips
+ * them.
+ *
+ * Returns: the length of the head including the blank line, or 0.
+ */
+static size_t http_headEnd(socketserver_httpReq *req)
+{
+	const unsigned char *buf = req->buf;
+	size_t pos = req->scanned;
+
+	if (!req->started) {
+		while (pos < req->len && (buf[pos] == '\r' || buf[pos] == '\n')) {
+			pos++;
+		}
+		if (pos == req->len) {
+			req->scanned = pos;
+			return 0;
+		}
+		req->started = 1;
+	}
+	while (pos < req->len) {
+		const unsigned char *nl = memchr(buf + pos, '\n', req->len - pos);
+		size_t at;
+		if (nl == NULL) {
+			break;
+		}
+		at = nl - buf;
+		if (at + 1 < req->len && buf[at + 1] == '\n') {
+			return at + 2;
+		}
+		if (at + 2 < req->len && buf[at + 1] == '\r' && buf[at + 2] == '\n') {
+			return at + 3;
+		}
+		if (at + 2 >= req->len) {
+			/* Cannot decide yet, look at this newline again. */
+			req->scanned = at;
+			return 0;
+		}
+		pos = at + 1;
+	}
+	req->scanned = req->len;
+	return 0;
+}
+
+/*
+ * Return the next line of [*pos, end) without its line ending and advance
+ * *pos past it.
+ */
+static const unsigned char * http_line(const unsigned char **pos, const unsigned char *end, size_t *len)
+{
+	const unsigned char *line = *pos;
+	const unsigned char *nl = memchr(line, '\n', end - line);
+
+	if (nl == NULL) {
+		nl = end;
+		*pos = end;
+	} else {
+		*pos = nl + 1;
+	}
+	*len = nl - line;
+	if (*len > 0 && line[*len - 1] == '\r') {
+		(*len)--;
+	}
+	return line;
+}
+
+static int http_isToken(const unsigned char *s, size_t len)
+{
+	size_t i;
+
+	if (len == 0) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		if (s[i] <= ' ' || s[i] >= 0x7f || strchr("\"(),/:;<=>?@[\\]{}", s[i]) != NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Parse the request line and headers in buf[0, len).
+ *
+ * Returns: TCL_OK with objv[0..3] set to method, target, version and the
+ * headers dict, or TCL_ERROR for a malformed head.
+ */
+static int http_parse(const unsigned char *buf, size_t len, Tcl_Obj *objv[4])
+{
+	const unsigned char *pos = buf;
+	const unsigned char *end = buf + len;
+	const unsigned char *line, *sp1, *sp2;
+	const unsigned char *request;
+	size_t lineLen, requestLen;
+	Tcl_Obj *headers;
+
+	/* Ignore blank lines before the request line, as RFC 7230 allows. */
+	do {
+		line = http_line(&pos, end, &lineLen);
+	} while (lineLen == 0 && pos < end);
+	request = line;
+	requestLen = lineLen;
+
+	/* method SP request-target SP HTTP/1.x */
+	sp1 = memchr(request, ' ', requestLen);
+	if (sp1 == NULL) {
+		return TCL_ERROR;
+	}
+	sp2 = memchr(sp1 + 1, ' ', request + requestLen - (sp1 + 1));
+	if (sp2 == NULL || sp2 == sp1 + 1 || !http_isToken(request, sp1 - request)) {
+		return TCL_ERROR;
+	}
+	if (request + requestLen - (sp2 + 1) != 8 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0 || !isdigit(sp2[8])) {
+		return TCL_ERROR;
+	}
+
+	headers = Tcl_NewDictObj();
+	while (pos < end) {
+		const unsigned char *colon, *value, *valueEnd;
+		Tcl_Obj *nameObj, *oldObj;
+		char *name;
+		size_t i;
+
+		line = http_line(&pos, end, &lineLen);
+		if (lineLen == 0) {
+			break;
+		}
+		colon = memchr(line, ':', lineLen);
+		/* Obsolete line folding and names with white space are rejected. */
+		if (colon == NULL || !http_isToken(line, colon - line)) {
+			Tcl_DecrRefCount(headers);
+			return TCL_ERROR;
+		}
+		value = colon + 1;
+		valueEnd = line + lineLen;
+		while (value < valueEnd && (*value == ' ' || *value == '\t')) {
+			value++;
+		}
+		while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+			valueEnd--;
+		}
+
+		nameObj = Tcl_NewStringObj((const char *)line, colon - line);
+		name = Tcl_GetString(nameObj);
+		for (i = 0; name[i] != 0; i++) {
+			name[i] = tolower((unsigned char)name[i]);
+		}
+		Tcl_DictObjGet(NULL, headers, nameObj, &oldObj);
+		if (oldObj != NULL) {
+			Tcl_Obj *joined = Tcl_DuplicateObj(oldObj);
+			Tcl_AppendToObj(joined, ", ", 2);
+			Tcl_AppendToObj(joined, (const char *)value, valueEnd - value);
+			Tcl_DictObjPut(NULL, headers, nameObj, joined);
+		} else {
+			Tcl_DictObjPut(NULL, headers, nameObj, Tcl_NewStringObj((const char *)value, valueEnd - value));
+		}
+	}
+
+	objv[0] = Tcl_NewStringObj((const char *)request, sp1 - request);
+	objv[1] = Tcl_NewStringObj((const char *)sp1 + 1, sp2 - (sp1 + 1));
+	objv[2] = Tcl_NewStringObj((const char *)sp2 + 1, 8);
+	objv[3] = headers;
+	return TCL_OK;
+}
+
+static void http_readable(ClientData clientData, int mask);
+static void http_timeout(ClientData clientData);
+
+/*
+ * Give up on a request without calling the handler.
+ */
+static void http_reject(socketserver_httpReq *req, const char *response)
+{
+	socketserver_port *port = req->port;
+
+	Tcl_DeleteFileHandler(req->fd);
+	if (req->timer != NULL) {
+		Tcl_DeleteTimerHandler(req->timer);
+	}
+	if (response != NULL) {
+		if (send(req->fd, response, strlen(response), MSG_NOSIGNAL) < 0) {
+			/* the client is gone */
+		}
+	}
+	close(req->fd);
+	socketserver_sendDone(port->out, req->id);
+	ckfree(req);
+
+	port->inFlight--;
+	if (!port->active && port->inFlight < port->maxConcurrent) {
+		socketserver_rearm(port);
+	}
+}
+
+static void http_timeout(ClientData clientData)
+{
+	socketserver_httpReq *req = (socketserver_httpReq *)clientData;
+
+	req->timer = NULL;
+	http_reject(req, http_408);
+}
+
+/*
+ * Look for a complete head in what has arrived, and call the handler when
+ * there is one.
+ */
+static void http_received(socketserver_httpReq *req)
+{
+	socketserver_port *port = req->port;
+	Tcl_Obj *objv[5];
+	Tcl_Channel channel;
+	size_t headLen;
+	int flags;
+
+	headLen = http_headEnd(req);
+	if (headLen == 0) {
+		if (req->len >= (size_t)port->maxHead) {
+			http_reject(req, http_431);
+		}
+		return;
+	}
+	if (http_parse(req->buf, headLen, objv + 1) != TCL_OK) {
+		http_reject(req, http_400);
+		return;
+	}
+
+	Tcl_DeleteFileHandler(req->fd);
+	if (req->timer != NULL) {
+		Tcl_DeleteTimerHandler(req->timer);
+	}
+	port->inFlight--;
+
+	/* Hand the fd to a channel in blocking mode, as for other handlers. */
+	flags = fcntl(req->fd, F_GETFL);
+	fcntl(req->fd, F_SETFL, flags & ~O_NONBLOCK);
+	channel = socketserver_makeChannel(port, req->fd, req->id);
+	if (channel == NULL) {
+		int i;
+		for (i = 1; i < 5; i++) {
+			Tcl_DecrRefCount(objv[i]);
+		}
+		ckfree(req);
+		return;
+	}
+	/* Body bytes that arrived with the head are put back into the channel. */
+	if (req->len > headLen) {
+		Tcl_Ungets(channel, (const char *)req->buf + headLen, req->len - headLen, 0);
+	}
+	ckfree(req);
+
+	objv[0] = Tcl_NewStringObj(Tcl_GetChannelName(channel), -1);
+	socketserver_invoke(port, channel, 5, objv);
+}
+
+static void http_readable(ClientData clientData, int mask)
+{
+	socketserver_httpReq *req = (socketserver_httpReq *)clientData;
+	ssize_t n;
+
+	n = recv(req->fd, req->buf + req->len, req->port->maxHead - req->len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		http_reject(req, NULL);
+		return;
+	}
+	req->len += n;
+	http_received(req);
+}
+
+/*
+ * Start reading the request head of a newly received connection, beginning
+ * with the preLen bytes the master read ahead.
+ */
+void socketserver_startHttp(socketserver_port *data, int fd, unsigned int id, const unsigned char *pre, size_t preLen)
+{
+	size_t room = (size_t)data->maxHead > preLen ? (size_t)data->maxHead : preLen;
+	socketserver_httpReq *req = (socketserver_httpReq *)ckalloc(sizeof(socketserver_httpReq) + room);
+	int flags = fcntl(fd, F_GETFL);
+
+	memset(req, 0, sizeof(socketserver_httpReq));
+	req->port = data;
+	req->fd = fd;
+	req->id = id;
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	Tcl_CreateFileHandler(fd, TCL_READABLE, http_readable, (ClientData)req);
+	if (data->headTimeout > 0) {
+		req->timer = Tcl_CreateTimerHandler(data->headTimeout, http_timeout, (ClientData)req);
+	}
+
+	/* A slow client only holds a slot while its head is arriving. */
+	data->inFlight++;
+	if (data->inFlight < data->maxConcurrent) {
+		socketserver_rearm(data);
+	}
+
+	if (preLen > 0) {
+		memcpy(req->buf, pre, preLen);
+		req->len = preLen;
+		http_received(req);
+	}
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
@@ -0,0 +1,512 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * rawio - unbuffered fd commands for -raw socketserver handlers
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * A handler registered with "::socketserver::socket client -raw" (or
+ * -framing) is passed the accepted fd as an integer instead of a Tcl
+ * channel.  These commands
+ * read and write byte arrays on such an fd directly with read(2),
+ * readv(2) and sendmsg(2), without the channel layer buffering,
+ * encoding and translation.  What the socket cannot take at once is
+ * queued and written from the event loop, so a client that stops reading
+ * holds up only its own connection.
+ *
+ *   ::socketserver::read fd ?numBytes?
+ *   ::socketserver::readv fd numBytes ?numBytes ...?
+ *   ::socketserver::write fd data
+ *   ::socketserver::writev fd data ?data ...?
+ *   ::socketserver::close fd
+ *
+ * Bytes the master read ahead with "server -preread" are returned by the
+ * first reads, before anything is read from the fd.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "socketserver.h"
+
+#define SOCKETSERVER_READ_SIZE 65536
+#define SOCKETSERVER_MAX_IOV 64
+/* ms a closed connection has to write the output it still has queued */
+#define SOCKETSERVER_WRITE_LINGER 30000
+
+socketserver_conn *
+socketserver_registerConn(socketserver_objectClientData *cdPtr, socketserver_port *port, int fd)
+{
+	int isNew;
+	Tcl_HashEntry *entryPtr = Tcl_CreateHashEntry(&cdPtr->conns, (char *)((long)fd), &isNew);
+	socketserver_conn *conn;
+
+	if (!isNew) {
+		/* The fd number was reused after a close we did not see. */
+		conn = (socketserver_conn *)Tcl_GetHashValue(entryPtr);
+		if (conn->out != NULL) {
+			ckfree(conn->out);
+		}
+		Tcl_EventuallyFree(conn, TCL_DYNAMIC);
+	}
+	conn = (socketserver_conn *)ckalloc(sizeof(socketserver_conn));
+	memset(conn, 0, sizeof(socketserver_conn));
+	conn->fd = fd;
+	conn->port = port;
+	conn->owner = cdPtr;
+	Tcl_SetHashValue(entryPtr, conn);
+	return conn;
+}
+
+/*
+ * Really close a connection, once its queued output is written or given
+ * up on.
+ */
+static void socketserver_finishClose(socketserver_conn *conn)
+{
+	if (conn->watched) {
+		Tcl_DeleteFileHandler(conn->fd);
+		conn->watched = 0;
+	}
+	if (conn->lingerTimer != NULL) {
+		Tcl_DeleteTimerHandler(conn->lingerTimer);
+		conn->lingerTimer = NULL;
+	}
+	if (conn->out != NULL) {
+		ckfree(conn->out);
+		conn->out = NULL;
+	}
+	close(conn->fd);
+	socketserver_setPeer(conn->owner, conn->fd, NULL);
+	socketserver_sendDone(conn->doneSock, conn->id);
+	conn->fd = -1;
+	Tcl_EventuallyFree(conn, TCL_DYNAMIC);
+}
+
+static void socketserver_lingerExpired(ClientData clientData)
+{
+	socketserver_conn *conn = (socketserver_conn *)clientData;
+
+	conn->lingerTimer = NULL;
+	socketserver_finishClose(conn);
+}
+
+/*
+ * Forget and close a connection.  The structure may still be in use by a
+ * framing callback further up the stack, so it is freed with
+ * Tcl_EventuallyFree.  Output still queued is written first, for at most
+ * SOCKETSERVER_WRITE_LINGER ms, unless the port is going away.
+ */
+void
+socketserver_closeConn(socketserver_objectClientData *cdPtr, socketserver_conn *conn)
+{
+	Tcl_HashEntry *entryPtr = Tcl_FindHashEntry(&cdPtr->conns, (char *)((long)conn->fd));
+	socketserver_port *port = conn->port;
+	int framing = conn->framing;
+
+	if (entryPtr != NULL) {
+		Tcl_DeleteHashEntry(entryPtr);
+	}
+	if (framing) {
+		socketserver_stopFraming(conn);
+	} else if (conn->buf != NULL) {
+		ckfree(conn->buf);
+		conn->buf = NULL;
+	}
+	if (conn->outOff < conn->outLen && port != NULL) {
+		conn->closing = 1;
+		socketserver_watchConn(conn);
+		conn->lingerTimer = Tcl_CreateTimerHandler(SOCKETSERVER_WRITE_LINGER,
+				socketserver_lingerExpired, (ClientData)conn);
+	} else {
+		socketserver_finishClose(conn);
+	}
+
+	/* A framed connection frees a slot for the next one. */
+	if (framing && port != NULL) {
+		port->inFlight--;
+		if (!port->active && port->inFlight < port->maxConcurrent) {
+			socketserver_rearm(port);
+		}
+	}
+}
+
+/*
+ * Write as much of the queued output as the socket takes now.
+ */
+static void socketserver_flushConn(socketserver_conn *conn)
+{
+	while (conn->outOff < conn->outLen) {
+		ssize_t n = send(conn->fd, conn->out + conn->outOff, conn->outLen - conn->outOff,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				/* Reported by the next write; the rest cannot be sent. */
+				conn->outError = errno;
+				conn->outOff = conn->outLen;
+			}
+			break;
+		}
+		conn->outOff += n;
+	}
+	if (conn->outOff == conn->outLen) {
+		conn->outOff = conn->outLen = 0;
+	}
+}
+
+static void socketserver_connReady(ClientData clientData, int mask)
+{
+	socketserver_conn *conn = (socketserver_conn *)clientData;
+
+	Tcl_Preserve(conn);
+	if (mask & TCL_WRITABLE) {
+		socketserver_flushConn(conn);
+		if (conn->closing && conn->outLen == 0) {
+			socketserver_finishClose(conn);
+		} else {
+			socketserver_watchConn(conn);
+		}
+	}
+	if ((mask & TCL_READABLE) && conn->fd != -1 && !conn->closing) {
+		socketserver_readFraming(conn);
+	}
+	Tcl_Release(conn);
+}
+
+/*
+ * Keep the file handler on a connection in step with what it waits for:
+ * messages for a framed connection still reading, and room for queued
+ * output.
+ */
+void socketserver_watchConn(socketserver_conn *conn)
+{
+	int mask = 0;
+
+	if (conn->framing && !conn->eof && !conn->closing) {
+		mask |= TCL_READABLE;
+	}
+	if (conn->outOff < conn->outLen) {
+		mask |= TCL_WRITABLE;
+	}
+	if (mask == conn->watched) {
+		return;
+	}
+	if (mask == 0) {
+		Tcl_DeleteFileHandler(conn->fd);
+	} else {
+		Tcl_CreateFileHandler(conn->fd, mask, socketserver_connReady, (ClientData)conn);
+	}
+	conn->watched = mask;
+}
+
+/*
+ * Write iov to a connection without blocking.  What the socket does not
+ * take now is queued and written from the event loop, so a client that
+ * stops reading holds up only its own connection.
+ *
+ * Returns: 0, or -1 with errno set when the connection has failed.
+ */
+int socketserver_queueWrite(socketserver_conn *conn, const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0, skip = 0;
+	int i;
+
+	if (conn->outError != 0) {
+		errno = conn->outError;
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	if (conn->outLen == 0 && total > 0) {
+		struct msghdr hdr;
+		ssize_t n;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = (struct iovec *)iov;
+		hdr.msg_iovlen = iovcnt;
+		do {
+			n = sendmsg(conn->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+		skip = n < 0 ? 0 : (size_t)n;
+	}
+	if (skip == total) {
+		return 0;
+	}
+
+	if (conn->outOff > 0) {
+		memmove(conn->out, conn->out + conn->outOff, conn->outLen - conn->outOff);
+		conn->outLen -= conn->outOff;
+		conn->outOff = 0;
+	}
+	if (conn->outSize - conn->outLen < total - skip) {
+		conn->outSize = conn->outLen + total - skip;
+		conn->out = (unsigned char *)ckrealloc((char *)conn->out, conn->outSize);
+	}
+	for (i = 0; i < iovcnt; i++) {
+		size_t len = iov[i].iov_len;
+		const unsigned char *base = (const unsigned char *)iov[i].iov_base;
+
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		memcpy(conn->out + conn->outLen, base + skip, len - skip);
+		conn->outLen += len - skip;
+		skip = 0;
+	}
+	socketserver_watchConn(conn);
+	return 0;
+}
+
+/*
+ * Look up the connection for an fd argument.  Only fds handed out by
+ * socketserver are accepted.
+ */
+socketserver_conn * socketserver_getConn(Tcl_Interp *interp, socketserver_objectClientData *cdPtr, Tcl_Obj *fdObj)
+{
+	int fd;
+	Tcl_HashEntry *entryPtr;
+
+	if (Tcl_GetIntFromObj(interp, fdObj, &fd) != TCL_OK) {
+		return NULL;
+	}
+	entryPtr = Tcl_FindHashEntry(&cdPtr->conns, (char *)((long)fd));
+	if (entryPtr == NULL) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("fd %d is not a socketserver connection", fd));
+		return NULL;
+	}
+	return (socketserver_conn *)Tcl_GetHashValue(entryPtr);
+}
+
+/*
+ * Take up to size bytes read ahead by the master.
+ *
+ * Returns: the number of bytes copied to buf.
+ */
+static size_t socketserver_takeBuffered(socketserver_conn *conn, unsigned char *buf, size_t size)
+{
+	size_t n = conn->bufLen < size ? conn->bufLen : size;
+
+	if (conn->framing || n == 0) {
+		return 0;
+	}
+	memcpy(buf, conn->buf, n);
+	conn->bufLen -= n;
+	memmove(conn->buf, conn->buf + n, conn->bufLen);
+	return n;
+}
+
+static int socketserver_ioError(Tcl_Interp *interp, const char *op, int fd)
+{
+	Tcl_SetErrno(errno);
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf("error %s fd %d: %s", op, fd, Tcl_PosixError(interp)));
+	return TCL_ERROR;
+}
+
+/*
+ * ::socketserver::read fd ?numBytes?
+ *
+ * One read(2) of up to numBytes.  Returns an empty byte array at end of file.
+ */
+int socketserverReadObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+	int size = SOCKETSERVER_READ_SIZE;
+	Tcl_Obj *resultObj;
+	unsigned char *buf;
+	ssize_t n;
+
+	if (objc != 2 && objc != 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd ?numBytes?");
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	if (objc == 3 && (Tcl_GetIntFromObj(interp, objv[2], &size) != TCL_OK || size < 0)) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj("numBytes must be a non-negative integer", -1));
+		return TCL_ERROR;
+	}
+
+	resultObj = Tcl_NewByteArrayObj(NULL, 0);
+	buf = Tcl_SetByteArrayLength(resultObj, size);
+	if ((n = socketserver_takeBuffered(conn, buf, size)) == 0) {
+		do {
+			n = read(conn->fd, buf, size);
+		} while (n < 0 && errno == EINTR);
+	}
+	if (n < 0) {
+		Tcl_DecrRefCount(resultObj);
+		return socketserver_ioError(interp, "reading", conn->fd);
+	}
+	Tcl_SetByteArrayLength(resultObj, n);
+	Tcl_SetObjResult(interp, resultObj);
+	return TCL_OK;
+}
+
+/*
+ * ::socketserver::readv fd numBytes ?numBytes ...?
+ *
+ * One readv(2) scattering into buffers of the given sizes.  Returns a list
+ * with one byte array per size, shortened to what was actually read.
+ */
+int socketserverReadvObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+	struct iovec iov[SOCKETSERVER_MAX_IOV];
+	Tcl_Obj *bufObjs[SOCKETSERVER_MAX_IOV];
+	int i, count = objc - 2;
+	ssize_t n;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd numBytes ?numBytes ...?");
+		return TCL_ERROR;
+	}
+	if (count > SOCKETSERVER_MAX_IOV) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("at most %d buffers", SOCKETSERVER_MAX_IOV));
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	for (i = 0; i < count; i++) {
+		int size;
+		if (Tcl_GetIntFromObj(interp, objv[i + 2], &size) != TCL_OK || size < 0) {
+			Tcl_SetObjResult(interp, Tcl_NewStringObj("numBytes must be a non-negative integer", -1));
+			return TCL_ERROR;
+		}
+		iov[i].iov_len = size;
+	}
+	for (i = 0; i < count; i++) {
+		bufObjs[i] = Tcl_NewByteArrayObj(NULL, 0);
+		iov[i].iov_base = Tcl_SetByteArrayLength(bufObjs[i], iov[i].iov_len);
+	}
+
+	if (conn->bufLen > 0 && !conn->framing) {
+		/* Scatter the bytes read ahead, as one short read. */
+		n = 0;
+		for (i = 0; i < count && conn->bufLen > 0; i++) {
+			n += socketserver_takeBuffered(conn, iov[i].iov_base, iov[i].iov_len);
+		}
+	} else {
+		do {
+			n = readv(conn->fd, iov, count);
+		} while (n < 0 && errno == EINTR);
+	}
+	if (n < 0) {
+		for (i = 0; i < count; i++) {
+			Tcl_DecrRefCount(bufObjs[i]);
+		}
+		return socketserver_ioError(interp, "reading", conn->fd);
+	}
+
+	for (i = 0; i < count; i++) {
+		size_t len = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+		Tcl_SetByteArrayLength(bufObjs[i], len);
+		n -= len;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewListObj(count, bufObjs));
+	return TCL_OK;
+}
+
+/*
+ * ::socketserver::write fd data
+ *
+ * Write all of data, queueing what the socket cannot take now.  Returns
+ * the number of bytes written or queued.
+ */
+int socketserverWriteObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+	struct iovec iov;
+	int len;
+
+	if (objc != 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd data");
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	iov.iov_base = Tcl_GetByteArrayFromObj(objv[2], &len);
+	iov.iov_len = len;
+	if (socketserver_queueWrite(conn, &iov, 1) < 0) {
+		return socketserver_ioError(interp, "writing", conn->fd);
+	}
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(len));
+	return TCL_OK;
+}
+
+/*
+ * ::socketserver::writev fd data ?data ...?
+ *
+ * Gather write of all the data arguments, queueing what the socket cannot
+ * take now.  Returns the number of bytes written or queued.
+ */
+int socketserverWritevObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+	struct iovec iov[SOCKETSERVER_MAX_IOV];
+	int i, count = objc - 2;
+	Tcl_WideInt total = 0;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd data ?data ...?");
+		return TCL_ERROR;
+	}
+	if (count > SOCKETSERVER_MAX_IOV) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("at most %d buffers", SOCKETSERVER_MAX_IOV));
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	for (i = 0; i < count; i++) {
+		int len;
+		iov[i].iov_base = Tcl_GetByteArrayFromObj(objv[i + 2], &len);
+		iov[i].iov_len = len;
+		total += len;
+	}
+	if (socketserver_queueWrite(conn, iov, count) < 0) {
+		return socketserver_ioError(interp, "writing", conn->fd);
+	}
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(total));
+	return TCL_OK;
+}
+
+/*
+ * ::socketserver::close fd
+ */
+int socketserverCloseObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_conn *conn;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "fd");
+		return TCL_ERROR;
+	}
+	if ((conn = socketserver_getConn(interp, cdPtr, objv[1])) == NULL) {
+		return TCL_ERROR;
+	}
+	socketserver_closeConn(cdPtr, conn);
+	return TCL_OK;
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
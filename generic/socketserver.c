@@ -22,7 +22,9 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #ifdef __FreeBSD__
 #include <netinet/in.h>
 #include <signal.h>
@@ -33,159 +35,332 @@
 TCL_DECLARE_MUTEX(threadMutex);
 
 /*
- * Send and fd over sock with SCM_RIGHTS.
- *
- * Returns: 0 for success and 1 for error.
+ * Usage shown by Tcl_WrongNumArgs, one per subcommand.  A misspelled server
+ * option gets the full list from Tcl_GetIndexFromObj instead.
+ */
+#define SOCKETSERVER_USAGE "subcommand ?arg ...?"
+#define SOCKETSERVER_SERVER_USAGE "?-option value ...? port"
+#define SOCKETSERVER_CLIENT_USAGE "?-port N? ?-pool name? ?-coroutine? ?-maxconcurrent N? ?-raw | -framing codec ?-maxframe bytes? | -http ?-maxhead bytes? ?-headtimeout ms?? ?-maxqueuewait ms? ?-queueresponse data? ?-stopcommand script? handlerProc"
+#define SOCKETSERVER_STOP_USAGE "?-timeout ms? ?-command script? port"
+#define SOCKETSERVER_PARK_USAGE "?-port N? channel|fd"
+#define SOCKETSERVER_STATS_USAGE "?-port N?"
+
+/*
+ * The lock over the port structures shared with the acceptor threads.
  */
-static int send_fd(int sock, int fd) {
-	struct msghdr msg;
-	struct iovec iov;
-	char buf[CMSG_SPACE(sizeof(int))];
-
-	iov.iov_base = buf;
-	iov.iov_len = 1;
-
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-
-	struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
-	header->cmsg_level = SOL_SOCKET;
-	header->cmsg_type = SCM_RIGHTS;
-	header->cmsg_len = CMSG_LEN(sizeof(int));
-	memcpy(CMSG_DATA(header), &fd, sizeof(fd));
-
-	return sendmsg(sock, &msg, 0) > 0 ? 0 : 1;
+void socketserver_lock(void)
+{
+	Tcl_MutexLock(&threadMutex);
 }
 
+void socketserver_unlock(void)
+{
+	Tcl_MutexUnlock(&threadMutex);
+}
+
+static void socketserver_readable(ClientData client_data, int mask);
+static void socketserver_portStopped(socketserver_port *data);
+
 /*
- * Receive a fd from socket.
- *
- * Returns: -1 for error or the fd one success.
+ * Allow the next fd to be received from the socketpair, ask the master for
+ * one and queue an event in case one is already waiting.
  */
-static int recv_fd(int sock) {
-	struct msghdr msg;
-	struct iovec iov;
-	char buf[CMSG_SPACE(sizeof(int))];
-
-	iov.iov_base = buf;
-	iov.iov_len = 1;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-
-	if (recvmsg(sock, &msg, MSG_DONTWAIT) == -1)
-		return -1;
+void socketserver_rearm(socketserver_port *data)
+{
+	Tcl_MutexLock(&threadMutex);
+	data->active = 1;
+	Tcl_MutexUnlock(&threadMutex);
+	socketserver_sendReady(data);
+	socketserver_readable(data, 0);
+}
 
-	struct cmsghdr *header;
-	for (header = CMSG_FIRSTHDR(&msg); header != NULL; header = CMSG_NXTHDR(&msg, header)) {
-		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
-			int count = (header->cmsg_len - (CMSG_DATA(header) - (unsigned char *)header)) / sizeof(int);
-			if (count > 0) {
-				int fd = -1;
-				memcpy(&fd, CMSG_DATA(header), sizeof(fd));
-				return fd;
-			}
+/*
+ * Command delete trace on a handler coroutine.  The coroutine has
+ * returned, so another connection may be accepted.
+ */
+static void socketserver_coroutineDone(ClientData clientData, Tcl_Interp *interp,
+		const char *oldName, const char *newName, int flags)
+{
+	socketserver_port * data = (socketserver_port *)clientData;
+
+	data->inFlight--;
+	if (!data->active && data->inFlight < data->maxConcurrent) {
+		socketserver_rearm(data);
+	}
+}
+
+/*
+ * Invoke the callback handler with the channel name, or the fd in raw mode,
+ * and any further arguments appended.  In coroutine mode the handler runs
+ * as the body of a new coroutine and the channel is made non-blocking so
+ * the ::socketserver::co helpers can yield on it.
+ */
+void socketserver_invoke(socketserver_port *data, Tcl_Channel channel, int objc, Tcl_Obj *CONST objv[])
+{
+	Tcl_Interp *interp = data->interp;
+	Tcl_Obj *cmdPtr;
+	Tcl_Obj *coroName = NULL;
+
+	if (data->coroutine) {
+		if (channel != NULL) {
+			Tcl_SetChannelOption(interp, channel, "-blocking", "0");
 		}
+		coroName = Tcl_ObjPrintf("::socketserver::co::handler%d_%lu",
+				data->targs.port, ++data->coroCounter);
+		Tcl_IncrRefCount(coroName);
+		cmdPtr = Tcl_NewStringObj("::coroutine", -1);
+		cmdPtr = Tcl_NewListObj(1, &cmdPtr);
+		Tcl_ListObjAppendElement(NULL, cmdPtr, coroName);
+		Tcl_ListObjAppendList(NULL, cmdPtr, data->callback);
+	} else {
+		cmdPtr = Tcl_DuplicateObj(data->callback);
 	}
+	Tcl_ListObjReplace(NULL, cmdPtr, INT_MAX, 0, objc, objv);
 
-	return -1;
+	Tcl_Preserve(interp);
+	Tcl_IncrRefCount(cmdPtr);
+	if (Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) != TCL_OK) {
+		Tcl_BackgroundError(interp);
+	}
+	Tcl_DecrRefCount(cmdPtr);
+
+	if (coroName != NULL) {
+		Tcl_CmdInfo info;
+		/* A coroutine that has not returned yet is still a command. */
+		if (Tcl_GetCommandInfo(interp, Tcl_GetString(coroName), &info)) {
+			data->inFlight++;
+			Tcl_TraceCommand(interp, Tcl_GetString(coroName), TCL_TRACE_DELETE,
+					socketserver_coroutineDone, (ClientData)data);
+		}
+		Tcl_DecrRefCount(coroName);
+		if (data->inFlight < data->maxConcurrent) {
+			socketserver_rearm(data);
+		}
+	}
+	Tcl_Release(interp);
 }
 
 /*
- *----------------------------------------------------------------------
- *
- * sockerserverObjCmd --
- *
- *      socketserver command
- *
- * Results:
- *      A standard Tcl result.
- *
- *----------------------------------------------------------------------
+ * Remember the client a PROXY header named for fd, or forget it when peer
+ * is NULL.
  */
+void socketserver_setPeer(socketserver_objectClientData *cdPtr, int fd, const socketserver_peer *peer)
+{
+	Tcl_HashEntry *entryPtr;
+	int isNew;
 
-#ifdef SOCKETSERVER_DEBUG
-static char debug_msgbuf[512];
-#endif
+	if (peer == NULL) {
+		if ((entryPtr = Tcl_FindHashEntry(&cdPtr->peers, (char *)((long)fd))) != NULL) {
+			ckfree(Tcl_GetHashValue(entryPtr));
+			Tcl_DeleteHashEntry(entryPtr);
+		}
+		return;
+	}
+	entryPtr = Tcl_CreateHashEntry(&cdPtr->peers, (char *)((long)fd), &isNew);
+	if (isNew) {
+		Tcl_SetHashValue(entryPtr, ckalloc(sizeof(socketserver_peer)));
+	}
+	*(socketserver_peer *)Tcl_GetHashValue(entryPtr) = *peer;
+}
 
-static void debug(const char * msg) {
-#ifdef SOCKETSERVER_DEBUG
-	strcpy(debug_msgbuf, msg);
-	fprintf(stderr, "%s\n", msg);
-#endif
+/* A channel whose close is reported to the master, or whose peer is remembered */
+typedef struct socketserver_tracked {
+	int doneSock;
+	unsigned int id;
+	socketserver_objectClientData *owner;
+	int fd;
+} socketserver_tracked;
+
+static void socketserver_channelClosed(ClientData clientData)
+{
+	socketserver_tracked *tracked = (socketserver_tracked *)clientData;
+
+	socketserver_sendDone(tracked->doneSock, tracked->id);
+	if (tracked->owner != NULL) {
+		socketserver_setPeer(tracked->owner, tracked->fd, NULL);
+	}
+	ckfree(tracked);
 }
 
 /*
- * Thread entry point.
- * The thread creates the IP socket and accepts connections.
- * When a connection is accepted it is written to socketpair to pass
- * the FD to the worker using SCM_RIGHTS.
+ * Create a TCP channel from the accepted socket and register it in the
+ * handler's interpreter.  fconfigure -peername/-sockname report the socket
+ * itself: behind -proxy that is the balancer, and a relayed TLS connection
+ * is a unix socket with no address at all.  ::socketserver::peer, which
+ * reads the address remembered from the handoff, is what names the client
+ * in every mode.  When the master keeps a copy of the
+ * connection (id is not 0) it is told when the channel is closed, and a
+ * remembered PROXY peer is forgotten then.
  *
- * Arguments - socketpair write side and TCP port number.
+ * Returns: the channel, or NULL after closing fd and re-arming the port.
  */
-static void * socketserver_thread(void *args)
+Tcl_Channel socketserver_makeChannel(socketserver_port *data, int fd, unsigned int id)
 {
-	socketserver_thread_args* targs = (socketserver_thread_args *)args;
-	int sock = targs->in;
-	int socket_desc , client_sock;
-	struct sockaddr_in server , client;
-	int c = sizeof(struct sockaddr_in);
-	int on = 1;
+	void *fdPtr = (void *)((long)fd);
+	Tcl_Channel channel = Tcl_MakeTcpClientChannel(fdPtr);
+
+	int hasPeer = Tcl_FindHashEntry(&data->owner->peers, (char *)((long)fd)) != NULL;
 
-	// create tcp socket
-	socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-	if (socket_desc == -1)
-	{
-		debug("Could not create socket");
+	if (channel == NULL) {
+		close(fd);
+		socketserver_setPeer(data->owner, fd, NULL);
+		socketserver_sendDone(data->out, id);
+		socketserver_rearm(data);
+		return NULL;
+	}
+	if (id != 0 || hasPeer) {
+		socketserver_tracked *tracked = (socketserver_tracked *)ckalloc(sizeof(socketserver_tracked));
+		tracked->doneSock = data->out;
+		tracked->id = id;
+		tracked->owner = hasPeer ? data->owner : NULL;
+		tracked->fd = fd;
+		Tcl_CreateCloseHandler(channel, socketserver_channelClosed, (ClientData)tracked);
 	}
-	debug("Socket created");
+	Tcl_RegisterChannel(data->interp, channel);
+	return channel;
+}
 
-	if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int)) < 0) {
-		debug("SO_REUSEADDR failed");    
+/*
+ * Drop a connection that waited in the queue longer than -maxqueuewait.
+ * Its client has most likely given up already.
+ */
+static void socketserver_queueExpired(socketserver_port *data, int fd, unsigned int id)
+{
+	SOCKETSERVER_STAT_ADD(data->stats, queueExpired, 1);
+	if (data->queueResponse != NULL) {
+		int len;
+		unsigned char *bytes = Tcl_GetByteArrayFromObj(data->queueResponse, &len);
+		if (send(fd, bytes, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			/* the client is gone */
+		}
 	}
+	close(fd);
+	socketserver_setPeer(data->owner, fd, NULL);
+	socketserver_sendDone(data->out, id);
+}
 
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = INADDR_ANY;
-	server.sin_port = htons( targs->port );
-	if( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0)
-	{
-		debug("bind failed");
-		// Send a TERM signal to self, to exit the master process
-		kill(getpid(), 15);
-		return (void *)1;
+/*
+ * Evaluate a stop callback at global level.
+ */
+static void socketserver_evalStopCommand(Tcl_Interp *interp, Tcl_Obj *cmdPtr)
+{
+	if (interp == NULL || cmdPtr == NULL) {
+		return;
+	}
+	Tcl_Preserve(interp);
+	if (Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) != TCL_OK) {
+		Tcl_BackgroundError(interp);
 	}
-	debug("bind done");
+	Tcl_Release(interp);
+}
+
+/*
+ * The master has stopped the port.  No more connections will arrive;
+ * those the worker holds are finished as usual.
+ */
+static void socketserver_portStopped(socketserver_port *data)
+{
+	Tcl_Obj *cmdPtr = data->clientStopCommand;
 
-	listen(socket_desc , SOMAXCONN);
+	if (data->stopped) {
+		return;
+	}
+	data->stopped = 1;
+	data->active = 0;
+	if (data->have_channel) {
+		Tcl_DeleteChannelHandler(data->channel, socketserver_readable, (ClientData)data);
+	}
+	if (cmdPtr != NULL) {
+		data->clientStopCommand = NULL;
+		socketserver_evalStopCommand(data->interp, cmdPtr);
+		Tcl_DecrRefCount(cmdPtr);
+	}
+}
 
-	debug("Waiting for incoming connections...");
+/*
+ * The acceptor thread has exited.  Join it and tell the master's script.
+ */
+static int socketserver_stoppedEventProc(Tcl_Event *tcl_event, int flags)
+{
+	socketserver_ThreadEvent *evPtr = (socketserver_ThreadEvent *)tcl_event;
+	socketserver_port *data = evPtr->data;
+	Tcl_Obj *cmdPtr = data->stopCommand;
 
-	while (1) {
-		client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c);
-		if (client_sock < 0 && errno != EINTR)
-		{
-			// EINTR are ok in accept calls, retry
-			debug("accept failed");
-		}
-		else if (client_sock != -1)
-		{
-			debug("Connection accepted");
-			if (send_fd(sock, client_sock)) {
-				debug("Send fd failed");
-			} else {
-				debug("Sent fd.");
-			}
-			close(client_sock);
-		}
+	socketserver_joinAcceptor(data);
+	/* This process may also be serving the port. */
+	socketserver_portStopped(data);
+	if (cmdPtr != NULL) {
+		data->stopCommand = NULL;
+		socketserver_evalStopCommand(data->masterInterp, cmdPtr);
+		Tcl_DecrRefCount(cmdPtr);
+	}
+	return 1;
+}
+
+/*
+ * Called by the acceptor thread as it exits.
+ */
+void socketserver_acceptorDone(socketserver_port *data)
+{
+	socketserver_ThreadEvent *event = (socketserver_ThreadEvent *)ckalloc(sizeof(socketserver_ThreadEvent));
+
+	event->event.proc = socketserver_stoppedEventProc;
+	event->event.nextPtr = NULL;
+	event->data = data;
+	Tcl_ThreadQueueEvent(data->masterThread, (Tcl_Event *)event, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(data->masterThread);
+}
+
+static int socketserver_deleteStoppedEvent(Tcl_Event *tcl_event, ClientData clientData)
+{
+	return tcl_event->proc == socketserver_stoppedEventProc
+		&& ((socketserver_ThreadEvent *)tcl_event)->data == (socketserver_port *)clientData;
+}
+
+/*
+ * Release everything a port holds, when the ::socketserver::socket command
+ * is deleted.  A running acceptor thread is stopped and joined first, so
+ * it never sees the port freed.
+ */
+void socketserver_releasePort(socketserver_port *data)
+{
+	if (data->haveThread && data->masterPid == getpid()) {
+		socketserver_stopAcceptor(data, 0);
+		socketserver_joinAcceptor(data);
+		Tcl_DeleteEvents(socketserver_deleteStoppedEvent, (ClientData)data);
+	}
+	if (data->have_channel && !data->stopped) {
+		Tcl_DeleteChannelHandler(data->channel, socketserver_readable, (ClientData)data);
+	}
+	if (data->callback != NULL) {
+		Tcl_DecrRefCount(data->callback);
+	}
+	if (data->queueResponse != NULL) {
+		Tcl_DecrRefCount(data->queueResponse);
+	}
+	if (data->stopCommand != NULL) {
+		Tcl_DecrRefCount(data->stopCommand);
+	}
+	if (data->clientStopCommand != NULL) {
+		Tcl_DecrRefCount(data->clientStopCommand);
+	}
+	if (data->allowObj != NULL) {
+		Tcl_DecrRefCount(data->allowObj);
+	}
+	if (data->denyObj != NULL) {
+		Tcl_DecrRefCount(data->denyObj);
+	}
+	socketserver_aclFree(data->acl);
+	if (data->proxyFromObj != NULL) {
+		Tcl_DecrRefCount(data->proxyFromObj);
+	}
+	socketserver_aclFree(data->proxyAcl);
+	while (data->pools != NULL) {
+		socketserver_port *pool = data->pools;
+		data->pools = pool->nextPtr;
+		socketserver_releasePort(pool);
+		ckfree((char *)pool);
 	}
-	return (void *)0;
 }
 
 /*
@@ -204,34 +379,86 @@ static int socketserver_EventProc(Tcl_Event *tcl_event, int flags)
 		return 1;
 	}
 	data->active = 0;
-	/* attempt to read and FD from the socketpair. */
-	int fd = recv_fd(data->out);
-	if (fd == -1) {
+	/* attempt to read and FD from the socketpair, with any bytes the master read ahead. */
+	socketserver_msg msg;
+	unsigned char pre[SOCKETSERVER_MAX_PREREAD];
+	int fd;
+	int got = socketserver_recvConn(data->out, &msg, pre, sizeof(pre), &fd);
+	if (got == 0) {
+		/* The master closed its end: the port has been stopped. */
+		Tcl_MutexUnlock(&threadMutex);
+		socketserver_portStopped(data);
+		return 1;
+	}
+	if (got < 0 || msg.type != SOCKETSERVER_MSG_CONN || fd == -1) {
+		if (fd != -1) {
+			close(fd);
+		}
 		/* receive errors are ok. The socketpair is non-blocking and
 		 * interrupts can happen. */
 		data->active = 1;
 		Tcl_MutexUnlock(&threadMutex);
 		return 1;
 	}
+	/* The credit is used up, the next rearm asks again. */
+	data->creditPid = 0;
 	Tcl_MutexUnlock(&threadMutex);
+	SOCKETSERVER_STAT_ADD(data->stats, received, 1);
+	/* An fd number seen before may carry a stale peer. */
+	socketserver_setPeer(data->owner, fd, (msg.flags & SOCKETSERVER_MSGF_PEER) ? &msg.peer : NULL);
 
-	/* Create a channel from the unix fd. */
-	void *fdPtr = (void *)((long)fd);
-	Tcl_Channel channel = Tcl_MakeFileChannel(fdPtr, TCL_READABLE|TCL_WRITABLE);
-	Tcl_RegisterChannel(data->interp, channel);
+	if (data->maxQueueWait > 0 && msg.acceptedAt + data->maxQueueWait < socketserver_now()) {
+		socketserver_queueExpired(data, fd, msg.id);
+		socketserver_rearm(data);
+		return 1;
+	}
 
-	/* Invoke the callback handler. */
-	const char *channel_name = Tcl_GetChannelName(channel);
-	if (channel_name == NULL || *channel_name == 0) {
-		Tcl_AddErrorInfo(data->interp, "Failed to get channel name for ancil_recv_fd file descriptor.");
+	/* Framed connections are read here and the handler gets messages. */
+	if (data->framing) {
+		socketserver_conn *conn = socketserver_registerConn(data->owner, data, fd);
+		conn->id = msg.id;
+		conn->doneSock = data->out;
+		data->inFlight++;
+		if (data->inFlight < data->maxConcurrent) {
+			socketserver_rearm(data);
+		}
+		socketserver_startFraming(conn, pre, msg.preLen);
+		return 1;
+	}
+
+	/* Raw mode hands the fd itself to the handler. */
+	if (data->raw) {
+		Tcl_Obj *fdObj = Tcl_NewIntObj(fd);
+		socketserver_conn *conn = socketserver_registerConn(data->owner, data, fd);
+		conn->id = msg.id;
+		conn->doneSock = data->out;
+		/* ::socketserver::read returns the bytes read ahead first. */
+		if (msg.preLen > 0) {
+			conn->buf = (unsigned char *)ckalloc(msg.preLen);
+			memcpy(conn->buf, pre, msg.preLen);
+			conn->bufLen = conn->bufSize = msg.preLen;
+		}
+		socketserver_invoke(data, NULL, 1, &fdObj);
 		return 1;
 	}
-	char * script = (char *)ckalloc(data->scriptLen);
-	strcpy(script, data->callback);
-	strcat(script, " ");
-	strcat(script, channel_name);
-	Tcl_Eval(data->interp, script);
-	ckfree(script);
+
+	/* The HTTP request head is read and parsed before the handler runs. */
+	if (data->http) {
+		socketserver_startHttp(data, fd, msg.id, pre, msg.preLen);
+		return 1;
+	}
+
+	Tcl_Channel channel = socketserver_makeChannel(data, fd, msg.id);
+	if (channel == NULL) {
+		return 1;
+	}
+	if (msg.preLen > 0) {
+		Tcl_Ungets(channel, (const char *)pre, msg.preLen, 0);
+	}
+
+	/* Invoke the callback handler. */
+	Tcl_Obj *chanObj = Tcl_NewStringObj(Tcl_GetChannelName(channel), -1);
+	socketserver_invoke(data, channel, 1, &chanObj);
 
 	return 1;
 }
@@ -296,10 +523,409 @@ static socketserver_port * socketserver_getPort(socketserver_objectClientData *c
 	memset(p, 0, sizeof(socketserver_port));
 	p->targs.port = port;
 	p->targs.in = -1;
+	p->owner = clientData;
+	p->config.queueInterval = SOCKETSERVER_DEFAULT_QUEUEINTERVAL;
+	p->config.overflow = SOCKETSERVER_DEFAULT_OVERFLOW;
+	p->config.prereadTimeout = SOCKETSERVER_DEFAULT_PREREADTIMEOUT;
+	p->config.doneTimeout = SOCKETSERVER_DEFAULT_DONETIMEOUT;
+	p->wakeFd = -1;
+	p->wakeRead = -1;
+	p->inheritedFd = -1;
 
 	return p;
 }
 
+/*
+ * The listening sockets passed by systemd socket activation, as
+ * sd_listen_fds(3) finds them.
+ *
+ * Returns: the number of fds from SOCKETSERVER_LISTEN_FDS_START on, with
+ * *namesPtr set to LISTEN_FDNAMES or NULL.
+ */
+static int socketserver_listenFds(const char **namesPtr)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int count;
+
+	*namesPtr = NULL;
+	if (pid == NULL || fds == NULL || strtol(pid, NULL, 10) != (long)getpid()) {
+		return 0;
+	}
+	count = (int)strtol(fds, NULL, 10);
+	if (count <= 0) {
+		return 0;
+	}
+	*namesPtr = getenv("LISTEN_FDNAMES");
+	return count;
+}
+
+/*
+ * Find the name'th entry of a colon separated LISTEN_FDNAMES.
+ *
+ * Returns: the index, or -1.
+ */
+static int socketserver_listenFdIndex(const char *names, const char *name)
+{
+	size_t len = strlen(name);
+	int index = 0;
+
+	while (names != NULL) {
+		const char *colon = strchr(names, ':');
+		size_t nameLen = colon != NULL ? (size_t)(colon - names) : strlen(names);
+		if (nameLen == len && strncmp(names, name, len) == 0) {
+			return index;
+		}
+		names = colon != NULL ? colon + 1 : NULL;
+		index++;
+	}
+	return -1;
+}
+
+/*
+ * Return the TCP port fd is bound to, or -1.
+ */
+static int socketserver_boundPort(int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		return -1;
+	}
+	if (addr.ss_family == AF_INET) {
+		return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	}
+	if (addr.ss_family == AF_INET6) {
+		return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	}
+	return -1;
+}
+
+/*
+ * Pick the listening socket for port from one created before the master
+ * started.  fdObj, from "server -fd", is an fd number or a name in
+ * LISTEN_FDNAMES.  Without it a socket passed by systemd that is bound to
+ * port is used.
+ *
+ * Returns: TCL_OK with *fdPtr set to the fd, or -1 when the master should
+ * bind the port itself, or TCL_ERROR.
+ */
+static int socketserver_inheritedListener(Tcl_Interp *interp, Tcl_Obj *fdObj, int port, int *fdPtr)
+{
+	const char *names;
+	int count = socketserver_listenFds(&names);
+	int fd = -1, on = 0, type = 0, i;
+	socklen_t len;
+
+	if (fdObj != NULL) {
+		if (Tcl_GetIntFromObj(NULL, fdObj, &fd) != TCL_OK) {
+			i = socketserver_listenFdIndex(names, Tcl_GetString(fdObj));
+			if (i < 0 || i >= count) {
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("no inherited socket named \"%s\"", Tcl_GetString(fdObj)));
+				return TCL_ERROR;
+			}
+			fd = SOCKETSERVER_LISTEN_FDS_START + i;
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			if (socketserver_boundPort(SOCKETSERVER_LISTEN_FDS_START + i) == port) {
+				fd = SOCKETSERVER_LISTEN_FDS_START + i;
+				break;
+			}
+		}
+		if (fd == -1) {
+			*fdPtr = -1;
+			return TCL_OK;
+		}
+	}
+
+	len = sizeof(on);
+	if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) < 0 || !on) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("fd %d is not a listening socket", fd));
+		return TCL_ERROR;
+	}
+	len = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("fd %d is not a stream socket", fd));
+		return TCL_ERROR;
+	}
+	*fdPtr = fd;
+	return TCL_OK;
+}
+
+/*
+ * Create a worker pool with its own socketpair for each pool named by the
+ * -route rules, and number the rules' pools.  Pool "default" is the
+ * port's own workers.  The pools are set up before the acceptor starts
+ * and the workers are forked, and never change.
+ */
+static int socketserver_makePools(Tcl_Interp *interp, socketserver_port *data,
+		socketserver_route *routes, Tcl_Obj **names, int count)
+{
+	socketserver_port **tail = &data->pools;
+	int i;
+
+	data->routePeek = 1;
+	for (i = 0; i < count; i++) {
+		const char *name = Tcl_GetString(names[i]);
+		socketserver_port *pool = NULL;
+		int index = 0;
+
+		if (strcmp(name, "default") != 0) {
+			for (index = 1, pool = data->pools; pool != NULL; index++, pool = pool->nextPtr) {
+				if (strcmp(pool->poolName, name) == 0) {
+					break;
+				}
+			}
+		}
+		if (index > 0 && pool == NULL) {
+			int sock[2];
+
+			if (socketpair(PF_UNIX, data->seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0, sock)) {
+				while (data->pools != NULL) {
+					pool = data->pools;
+					data->pools = pool->nextPtr;
+					socketserver_closeOwnedFd(pool->targs.in);
+					close(pool->out);
+					ckfree((char *)pool);
+				}
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not create the socketpair of pool \"%s\"", name));
+				return TCL_ERROR;
+			}
+			pool = (socketserver_port *)ckalloc(sizeof(socketserver_port));
+			memset(pool, 0, sizeof(socketserver_port));
+			strcpy(pool->poolName, name);
+			pool->targs.port = data->targs.port;
+			/* The master end must not stay open in forked workers. */
+			socketserver_ownFd(sock[0]);
+			pool->targs.in = sock[0];
+			pool->out = sock[1];
+			pool->seqpacket = data->seqpacket;
+			pool->owner = data->owner;
+			pool->wakeFd = -1;
+			pool->wakeRead = -1;
+			pool->inheritedFd = -1;
+			*tail = pool;
+			tail = &pool->nextPtr;
+		}
+		routes[i].pool = index;
+		if (routes[i].len > data->routePeek) {
+			data->routePeek = routes[i].len;
+		}
+		data->routes[i] = routes[i];
+	}
+	data->routeCount = count;
+	return TCL_OK;
+}
+
+/*
+ * Hand an idle connection back to the master, which watches it and passes
+ * it to a worker again when the next request arrives.  The connection is
+ * closed here.  Bytes already read from it would be lost, so a connection
+ * with buffered input, or a raw one with output still queued, is refused.
+ */
+static int socketserver_park(Tcl_Interp *interp, socketserver_objectClientData *cdPtr,
+		socketserver_port *data, Tcl_Obj *connObj)
+{
+	socketserver_conn *conn = NULL;
+	Tcl_Channel channel = NULL;
+	Tcl_HashEntry *entryPtr;
+	socketserver_msg msg;
+	int fd;
+
+	if (Tcl_GetIntFromObj(NULL, connObj, &fd) == TCL_OK) {
+		if ((conn = socketserver_getConn(interp, cdPtr, connObj)) == NULL) {
+			return TCL_ERROR;
+		}
+		if (conn->bufLen > 0) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("fd %d has unread data", fd));
+			return TCL_ERROR;
+		}
+		if (conn->outOff < conn->outLen) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("fd %d has unwritten data", fd));
+			return TCL_ERROR;
+		}
+	} else {
+		ClientData handle;
+		if ((channel = Tcl_GetChannel(interp, Tcl_GetString(connObj), NULL)) == NULL) {
+			return TCL_ERROR;
+		}
+		if (Tcl_Flush(channel) != TCL_OK) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("error flushing %s: %s",
+					Tcl_GetString(connObj), Tcl_PosixError(interp)));
+			return TCL_ERROR;
+		}
+		if (Tcl_InputBuffered(channel) > 0) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s has unread data", Tcl_GetString(connObj)));
+			return TCL_ERROR;
+		}
+		if (Tcl_GetChannelHandle(channel, TCL_READABLE, &handle) != TCL_OK) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s has no fd", Tcl_GetString(connObj)));
+			return TCL_ERROR;
+		}
+		fd = (int)(long)handle;
+	}
+
+	/* The next worker expects a blocking socket, as accept() returns it. */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = SOCKETSERVER_MSG_PARK;
+	/* The master keeps the client's address for the next worker. */
+	if ((entryPtr = Tcl_FindHashEntry(&cdPtr->peers, (char *)((long)fd))) != NULL) {
+		msg.flags = SOCKETSERVER_MSGF_PEER;
+		msg.peer = *(socketserver_peer *)Tcl_GetHashValue(entryPtr);
+	}
+	if (socketserver_sendMsg(data->out, &msg, fd, 0)) {
+		Tcl_SetErrno(errno);
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("error parking connection: %s", Tcl_PosixError(interp)));
+		return TCL_ERROR;
+	}
+
+	if (conn != NULL) {
+		socketserver_closeConn(cdPtr, conn);
+	} else {
+		Tcl_UnregisterChannel(interp, channel);
+	}
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * socketserverPeerObjCmd --
+ *
+ *      ::socketserver::peer channel|fd
+ *
+ *      The client's address and port, as named by the PROXY header when
+ *      the server has -proxy, otherwise those of the socket's peer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int socketserverPeerObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+	socketserver_peer peer;
+	Tcl_HashEntry *entryPtr;
+	Tcl_Obj *result[2];
+	char addr[INET6_ADDRSTRLEN];
+	int fd;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "channel|fd");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIntFromObj(NULL, objv[1], &fd) != TCL_OK) {
+		ClientData handle;
+		Tcl_Channel channel = Tcl_GetChannel(interp, Tcl_GetString(objv[1]), NULL);
+		if (channel == NULL) {
+			return TCL_ERROR;
+		}
+		if (Tcl_GetChannelHandle(channel, TCL_READABLE, &handle) != TCL_OK) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s has no fd", Tcl_GetString(objv[1])));
+			return TCL_ERROR;
+		}
+		fd = (int)(long)handle;
+	}
+
+	memset(&peer, 0, sizeof(peer));
+	if ((entryPtr = Tcl_FindHashEntry(&cdPtr->peers, (char *)((long)fd))) != NULL) {
+		peer = *(socketserver_peer *)Tcl_GetHashValue(entryPtr);
+	} else {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+
+		if (getpeername(fd, (struct sockaddr *)&ss, &len) < 0) {
+			Tcl_SetErrno(errno);
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("error getting peer of %s: %s",
+					Tcl_GetString(objv[1]), Tcl_PosixError(interp)));
+			return TCL_ERROR;
+		}
+		if (ss.ss_family == AF_INET) {
+			peer.family = AF_INET;
+			peer.port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+			memcpy(peer.addr, &((struct sockaddr_in *)&ss)->sin_addr, 4);
+		} else if (ss.ss_family == AF_INET6) {
+			peer.family = AF_INET6;
+			peer.port = ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+			memcpy(peer.addr, &((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+		}
+	}
+	if (peer.family == 0 || inet_ntop(peer.family, peer.addr, addr, sizeof(addr)) == NULL) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s has no internet peer", Tcl_GetString(objv[1])));
+		return TCL_ERROR;
+	}
+	result[0] = Tcl_NewStringObj(addr, -1);
+	result[1] = Tcl_NewIntObj(peer.port);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(2, result));
+	return TCL_OK;
+}
+
+/*
+ * The counters of a port as a dict.  They cover the master and all of its
+ * workers.
+ */
+static Tcl_Obj * socketserver_statsObj(socketserver_stats *stats)
+{
+	Tcl_Obj *dictObj = Tcl_NewDictObj();
+	socketserver_stats s = *stats;
+
+#define SOCKETSERVER_STAT_PUT(name, value) \
+	Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj(name, -1), Tcl_NewWideIntObj((Tcl_WideInt)(value)))
+	SOCKETSERVER_STAT_PUT("accepted", s.accepted);
+	SOCKETSERVER_STAT_PUT("dispatched", s.dispatched);
+	SOCKETSERVER_STAT_PUT("received", s.received);
+	/* Connections sent to the workers that no worker has taken yet */
+	SOCKETSERVER_STAT_PUT("queued", s.dispatched > s.received ? s.dispatched - s.received : 0);
+	SOCKETSERVER_STAT_PUT("queueExpired", s.queueExpired);
+	SOCKETSERVER_STAT_PUT("pending", (long)s.pending < 0 ? 0 : s.pending);
+	SOCKETSERVER_STAT_PUT("queueDropped", s.queueDropped);
+	SOCKETSERVER_STAT_PUT("shed", s.shed);
+	SOCKETSERVER_STAT_PUT("paused", s.paused);
+	SOCKETSERVER_STAT_PUT("parked", s.parked);
+	SOCKETSERVER_STAT_PUT("idle", (long)s.idle < 0 ? 0 : s.idle);
+	SOCKETSERVER_STAT_PUT("parkTimeouts", s.parkTimeouts);
+	SOCKETSERVER_STAT_PUT("deadlineExpired", s.deadlineExpired);
+	SOCKETSERVER_STAT_PUT("fdExhausted", s.fdExhausted);
+	SOCKETSERVER_STAT_PUT("acceptAborted", s.acceptAborted);
+	SOCKETSERVER_STAT_PUT("acceptErrors", s.acceptErrors);
+	SOCKETSERVER_STAT_PUT("acceptBackoffs", s.acceptBackoffs);
+	SOCKETSERVER_STAT_PUT("overflowed", s.overflowed);
+	SOCKETSERVER_STAT_PUT("overflowDropped", s.overflowDropped);
+	SOCKETSERVER_STAT_PUT("sendErrors", s.sendErrors);
+	SOCKETSERVER_STAT_PUT("prereadTimeouts", s.prereadTimeouts);
+	SOCKETSERVER_STAT_PUT("routed", s.routed);
+	SOCKETSERVER_STAT_PUT("proxyErrors", s.proxyErrors);
+	SOCKETSERVER_STAT_PUT("tlsHandshakes", s.tlsHandshakes);
+	SOCKETSERVER_STAT_PUT("tlsErrors", s.tlsErrors);
+	SOCKETSERVER_STAT_PUT("tlsKtls", s.tlsKtls);
+	SOCKETSERVER_STAT_PUT("tlsRelayed", s.tlsRelayed);
+	SOCKETSERVER_STAT_PUT("sourceRefused", s.sourceRefused);
+	SOCKETSERVER_STAT_PUT("sourceHeld", s.sourceHeld);
+	SOCKETSERVER_STAT_PUT("sources", (long)s.sources < 0 ? 0 : s.sources);
+	SOCKETSERVER_STAT_PUT("limitShed", s.limitShed);
+	SOCKETSERVER_STAT_PUT("limitPauses", s.limitPauses);
+	SOCKETSERVER_STAT_PUT("denied", s.denied);
+	SOCKETSERVER_STAT_PUT("doneTimeouts", s.doneTimeouts);
+#undef SOCKETSERVER_STAT_PUT
+	return dictObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * sockerserverObjCmd --
+ *
+ *      socketserver command
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+
 int socketserverObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
 	socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
@@ -310,11 +936,20 @@ int socketserverObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_
 
 	enum options {
 		OPT_CLIENT,
-		OPT_SERVER
+		OPT_SERVER,
+		OPT_PARK,
+		OPT_STATS,
+		OPT_PAUSE,
+		OPT_RESUME,
+		OPT_STOP
 	};
-	static CONST char *options[] = { "client", "server" };
+	static CONST char *options[] = { "client", "server", "park", "stats", "pause", "resume", "stop", NULL };
 
 	// basic command line processing
+	if (objc < 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, SOCKETSERVER_USAGE);
+		return TCL_ERROR;
+	}
 
 	// argument must be one of the subOptions defined above
 	if (Tcl_GetIndexFromObj (interp, objv[1], options, "option",
@@ -328,63 +963,724 @@ int socketserverObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_
 	}
 
 	switch ((enum options) optIndex) {
-		case OPT_SERVER:
+		case OPT_SERVER: {
+			socketserver_config config;
+			char controlPath[SOCKETSERVER_MAX_PATH] = "";
+			char takeoverPath[SOCKETSERVER_MAX_PATH] = "";
+			Tcl_Obj *fdObj = NULL;
+			int inheritedFd = -1;
+			socketserver_route routes[SOCKETSERVER_MAX_ROUTES];
+			Tcl_Obj *routeNames[SOCKETSERVER_MAX_ROUTES];
+			int routeCount = 0;
+			Tcl_Obj *tlsCert = NULL;
+			Tcl_Obj *tlsKey = NULL;
+			int tlsThreads = SOCKETSERVER_DEFAULT_TLSTHREADS;
+			Tcl_Obj *allowObj = NULL;
+			Tcl_Obj *denyObj = NULL;
+			socketserver_acl *acl = NULL;
+			Tcl_Obj *proxyFromObj = NULL;
+			socketserver_acl *proxyAcl = NULL;
+			int argIndex;
 
-			if (objc != 3) {
-				Tcl_WrongNumArgs (interp, 1, objv, "server port | client [-port N] handlerProc");
+			if (objc < 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_SERVER_USAGE);
 				return TCL_ERROR;
 			}
 
 			/* parse the port number argument */
-			if (Tcl_GetIntFromObj(interp, objv[2], &port)) {
+			if (Tcl_GetIntFromObj(interp, objv[objc - 1], &port)) {
 				Tcl_AddErrorInfo(interp, "problem getting port number as integer");
 				return TCL_ERROR;
 			}
 
 			Tcl_MutexLock(&threadMutex);
 			data = socketserver_getPort(cdPtr, port, 1);
+			config = data->config;
+			Tcl_MutexUnlock(&threadMutex);
+
+			for (argIndex = 2; argIndex < objc - 1; argIndex += 2) {
+				int serverIndex;
+				enum serverOptions {
+					SERVER_PARKTIMEOUT,
+					SERVER_DEADLINE,
+					SERVER_QUEUETARGET,
+					SERVER_QUEUEINTERVAL,
+					SERVER_SHEDTHRESHOLD,
+					SERVER_SHEDRESPONSE,
+					SERVER_HIGHWATER,
+					SERVER_LOWWATER,
+					SERVER_OVERFLOW,
+					SERVER_PREREAD,
+					SERVER_PREREADTIMEOUT,
+					SERVER_CONTROL,
+					SERVER_TAKEOVER,
+					SERVER_FD,
+					SERVER_ROUTE,
+					SERVER_PROXY,
+					SERVER_TLSCERT,
+					SERVER_TLSKEY,
+					SERVER_TLSTHREADS,
+					SERVER_SOURCEMAX,
+					SERVER_SOURCERATE,
+					SERVER_SOURCEBURST,
+					SERVER_SOURCEWAIT,
+					SERVER_ACCEPTRATE,
+					SERVER_ACCEPTBURST,
+					SERVER_MAXINFLIGHT,
+					SERVER_OVERLIMIT,
+					SERVER_ALLOW,
+					SERVER_DENY,
+					SERVER_DONETIMEOUT,
+					SERVER_PROXYFROM
+				};
+				static CONST char *overLimits[] = { "backlog", "shed", NULL };
+				static CONST char *serverOptions[] = { "-parktimeout", "-deadline", "-queuetarget",
+					"-queueinterval", "-shed-threshold", "-shed-response", "-highwater", "-lowwater",
+					"-overflow", "-preread", "-prereadtimeout", "-control", "-takeover", "-fd", "-route", "-proxy",
+					"-tlscert", "-tlskey", "-tlsthreads", "-sourcemax", "-sourcerate", "-sourceburst",
+					"-sourcewait", "-acceptrate", "-acceptburst", "-maxinflight", "-overlimit",
+					"-allow", "-deny", "-donetimeout", "-proxyfrom", NULL };
+
+				if (Tcl_GetIndexFromObj (interp, objv[argIndex], serverOptions, "server option",
+							TCL_EXACT, &serverIndex) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				if (argIndex + 1 >= objc - 1) {
+					Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_SERVER_USAGE);
+					return TCL_ERROR;
+				}
+				switch ((enum serverOptions) serverIndex) {
+					case SERVER_PARKTIMEOUT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.parkTimeout) || config.parkTimeout < 0) {
+							Tcl_AddErrorInfo(interp, "-parktimeout must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_DEADLINE:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.deadline) || config.deadline < 0) {
+							Tcl_AddErrorInfo(interp, "-deadline must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_QUEUETARGET:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.queueTarget) || config.queueTarget < 0) {
+							Tcl_AddErrorInfo(interp, "-queuetarget must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_QUEUEINTERVAL:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.queueInterval) || config.queueInterval < 1) {
+							Tcl_AddErrorInfo(interp, "-queueinterval must be a positive integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_SHEDTHRESHOLD:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.shedThreshold) || config.shedThreshold < 0) {
+							Tcl_AddErrorInfo(interp, "-shed-threshold must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_SHEDRESPONSE: {
+						int len;
+						unsigned char *bytes = Tcl_GetByteArrayFromObj(objv[argIndex + 1], &len);
+						if (len > SOCKETSERVER_MAX_SHEDRESPONSE) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("-shed-response is limited to %d bytes",
+									SOCKETSERVER_MAX_SHEDRESPONSE));
+							return TCL_ERROR;
+						}
+						memcpy(config.shedResponse, bytes, len);
+						config.shedResponseLen = len;
+						break;
+					}
+					case SERVER_HIGHWATER:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.highWater) || config.highWater < 0) {
+							Tcl_AddErrorInfo(interp, "-highwater must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_LOWWATER:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.lowWater) || config.lowWater < 0) {
+							Tcl_AddErrorInfo(interp, "-lowwater must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_OVERFLOW:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.overflow) || config.overflow < 0) {
+							Tcl_AddErrorInfo(interp, "-overflow must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_PREREAD:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.preread) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						if (config.preread < 0 || config.preread > SOCKETSERVER_MAX_PREREAD) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("-preread must be 0 to %d bytes",
+									SOCKETSERVER_MAX_PREREAD));
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_PREREADTIMEOUT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.prereadTimeout) || config.prereadTimeout < 0) {
+							Tcl_AddErrorInfo(interp, "-prereadtimeout must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_CONTROL:
+					case SERVER_TAKEOVER: {
+						int len;
+						const char *path = Tcl_GetStringFromObj(objv[argIndex + 1], &len);
+						if (len == 0 || len >= SOCKETSERVER_MAX_PATH) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s path must be 1 to %d bytes",
+									serverOptions[serverIndex], SOCKETSERVER_MAX_PATH - 1));
+							return TCL_ERROR;
+						}
+						strcpy(serverIndex == SERVER_CONTROL ? controlPath : takeoverPath, path);
+						break;
+					}
+					case SERVER_FD:
+						fdObj = objv[argIndex + 1];
+						break;
+					case SERVER_ROUTE: {
+						Tcl_Obj **elems;
+						int count, i;
+						if (Tcl_ListObjGetElements(interp, objv[argIndex + 1], &count, &elems) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						if (count % 2 != 0 || count / 2 > SOCKETSERVER_MAX_ROUTES) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("-route must be a list of up to %d pool and prefix pairs",
+									SOCKETSERVER_MAX_ROUTES));
+							return TCL_ERROR;
+						}
+						for (i = 0; i < count; i += 2) {
+							int nameLen, len;
+							unsigned char *prefix;
+							Tcl_GetStringFromObj(elems[i], &nameLen);
+							prefix = Tcl_GetByteArrayFromObj(elems[i + 1], &len);
+							if (nameLen == 0 || nameLen >= SOCKETSERVER_MAX_POOLNAME) {
+								Tcl_SetObjResult(interp, Tcl_ObjPrintf("-route pool names must be 1 to %d bytes",
+										SOCKETSERVER_MAX_POOLNAME - 1));
+								return TCL_ERROR;
+							}
+							if (len > SOCKETSERVER_MAX_PREFIX) {
+								Tcl_SetObjResult(interp, Tcl_ObjPrintf("-route prefixes are limited to %d bytes",
+										SOCKETSERVER_MAX_PREFIX));
+								return TCL_ERROR;
+							}
+							memcpy(routes[i / 2].prefix, prefix, len);
+							routes[i / 2].len = len;
+							routeNames[i / 2] = elems[i];
+						}
+						routeCount = count / 2;
+						break;
+					}
+					case SERVER_PROXY:
+						if (Tcl_GetBooleanFromObj(interp, objv[argIndex + 1], &config.proxy) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_TLSCERT:
+					case SERVER_TLSKEY:
+#ifdef SOCKETSERVER_TLS
+						if (serverIndex == SERVER_TLSCERT) {
+							tlsCert = objv[argIndex + 1];
+						} else {
+							tlsKey = objv[argIndex + 1];
+						}
+						break;
+#else
+						Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s needs socketserver built with OpenSSL",
+								serverOptions[serverIndex]));
+						return TCL_ERROR;
+#endif
+					case SERVER_TLSTHREADS:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &tlsThreads) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						if (tlsThreads < 1 || tlsThreads > SOCKETSERVER_MAX_TLSTHREADS) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("-tlsthreads must be 1 to %d",
+									SOCKETSERVER_MAX_TLSTHREADS));
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_SOURCEMAX:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.sourceMax) || config.sourceMax < 0) {
+							Tcl_AddErrorInfo(interp, "-sourcemax must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_SOURCERATE:
+					case SERVER_SOURCEBURST: {
+						int *valuePtr = serverIndex == SERVER_SOURCERATE ? &config.sourceRate : &config.sourceBurst;
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], valuePtr) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						if (*valuePtr < 0 || *valuePtr > SOCKETSERVER_MAX_SOURCERATE) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s must be 0 to %d",
+									serverOptions[serverIndex], SOCKETSERVER_MAX_SOURCERATE));
+							return TCL_ERROR;
+						}
+						break;
+					}
+					case SERVER_SOURCEWAIT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.sourceWait) || config.sourceWait < 0) {
+							Tcl_AddErrorInfo(interp, "-sourcewait must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_ACCEPTRATE:
+					case SERVER_ACCEPTBURST: {
+						int *valuePtr = serverIndex == SERVER_ACCEPTRATE ? &config.acceptRate : &config.acceptBurst;
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], valuePtr) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						if (*valuePtr < 0 || *valuePtr > SOCKETSERVER_MAX_ACCEPTRATE) {
+							Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s must be 0 to %d",
+									serverOptions[serverIndex], SOCKETSERVER_MAX_ACCEPTRATE));
+							return TCL_ERROR;
+						}
+						break;
+					}
+					case SERVER_MAXINFLIGHT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.maxInflight) || config.maxInflight < 0) {
+							Tcl_AddErrorInfo(interp, "-maxinflight must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_OVERLIMIT:
+						/* Numbered as SOCKETSERVER_OVERLIMIT_* */
+						if (Tcl_GetIndexFromObj(interp, objv[argIndex + 1], overLimits, "-overlimit action",
+									TCL_EXACT, &config.overLimit) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_ALLOW:
+						allowObj = objv[argIndex + 1];
+						break;
+					case SERVER_DENY:
+						denyObj = objv[argIndex + 1];
+						break;
+					case SERVER_DONETIMEOUT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &config.doneTimeout) || config.doneTimeout < 1) {
+							Tcl_AddErrorInfo(interp, "-donetimeout must be a positive integer");
+							return TCL_ERROR;
+						}
+						break;
+					case SERVER_PROXYFROM:
+						proxyFromObj = objv[argIndex + 1];
+						break;
+				}
+			}
+
+			if (data->stopped || data->stopRequested) {
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("port %d has been stopped", port));
+				return TCL_ERROR;
+			}
+			if (config.lowWater >= config.highWater && config.highWater > 0) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("-lowwater must be below -highwater", -1));
+				return TCL_ERROR;
+			}
+			if (tlsKey != NULL && tlsCert == NULL) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("-tlskey needs -tlscert", -1));
+				return TCL_ERROR;
+			}
+			/* A list not given stays as it was. */
+			if ((allowObj != NULL || denyObj != NULL) && socketserver_aclNew(interp,
+						allowObj != NULL ? allowObj : data->allowObj,
+						denyObj != NULL ? denyObj : data->denyObj, &acl) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			if (proxyFromObj != NULL && socketserver_aclNewOnly(interp, proxyFromObj, "-proxyfrom", &proxyAcl) != TCL_OK) {
+				socketserver_aclFree(acl);
+				return TCL_ERROR;
+			}
+			if (data->targs.in == -1 && socketserver_inheritedListener(interp, fdObj, port, &inheritedFd) != TCL_OK) {
+				socketserver_aclFree(acl);
+				socketserver_aclFree(proxyAcl);
+				return TCL_ERROR;
+			}
+
+			Tcl_MutexLock(&threadMutex);
+			data->config = config;
+			data->configEpoch++;
+			if (allowObj != NULL || denyObj != NULL) {
+				if (allowObj != NULL) {
+					Tcl_IncrRefCount(allowObj);
+					if (data->allowObj != NULL) {
+						Tcl_DecrRefCount(data->allowObj);
+					}
+					data->allowObj = allowObj;
+				}
+				if (denyObj != NULL) {
+					Tcl_IncrRefCount(denyObj);
+					if (data->denyObj != NULL) {
+						Tcl_DecrRefCount(data->denyObj);
+					}
+					data->denyObj = denyObj;
+				}
+				/* The acceptor has not taken the last one yet. */
+				socketserver_aclFree(data->acl);
+				data->acl = acl;
+				data->aclChanged = 1;
+			}
+			if (proxyFromObj != NULL) {
+				Tcl_IncrRefCount(proxyFromObj);
+				if (data->proxyFromObj != NULL) {
+					Tcl_DecrRefCount(data->proxyFromObj);
+				}
+				data->proxyFromObj = proxyFromObj;
+				socketserver_aclFree(data->proxyAcl);
+				data->proxyAcl = proxyAcl;
+				data->proxyAclChanged = 1;
+			}
 
 			/* If we do not have a socket pair create it */
 			if (data->targs.in == -1) {
 				int sock[2];
-				pthread_t tid;
+				int wake[2];
+				socketserver_port *pool;
 
-				if (socketpair(PF_UNIX, SOCK_STREAM, 0, sock)) {
+				/* SOCK_SEQPACKET keeps message boundaries, not every system has it for unix sockets. */
+				if (socketpair(PF_UNIX, SOCK_SEQPACKET, 0, sock) == 0) {
+					data->seqpacket = 1;
+				} else if (socketpair(PF_UNIX, SOCK_STREAM, 0, sock)) {
+					Tcl_AddErrorInfo(interp, "Failed to create thread to read socketpipe");
+					Tcl_MutexUnlock(&threadMutex);
+					return TCL_ERROR;
+				}
+				if (pipe(wake)) {
+					close(sock[0]);
+					close(sock[1]);
 					Tcl_AddErrorInfo(interp, "Failed to create thread to read socketpipe");
 					Tcl_MutexUnlock(&threadMutex);
 					return TCL_ERROR;
 				}
+#ifdef SOCKETSERVER_TLS
+				/* So does TLS; a bad certificate or key is reported here. */
+				if (tlsCert != NULL && (data->tls = socketserver_tlsNew(interp, Tcl_GetString(tlsCert),
+								Tcl_GetString(tlsKey != NULL ? tlsKey : tlsCert), tlsThreads)) == NULL) {
+					close(sock[0]);
+					close(sock[1]);
+					close(wake[0]);
+					close(wake[1]);
+					Tcl_MutexUnlock(&threadMutex);
+					return TCL_ERROR;
+				}
+#endif
+				/* Routes and their pools only matter when the acceptor starts. */
+				if (socketserver_makePools(interp, data, routes, routeNames, routeCount) != TCL_OK) {
+					close(sock[0]);
+					close(sock[1]);
+					close(wake[0]);
+					close(wake[1]);
+#ifdef SOCKETSERVER_TLS
+					if (data->tls != NULL) {
+						socketserver_tlsFree(data->tls);
+						data->tls = NULL;
+					}
+#endif
+					Tcl_MutexUnlock(&threadMutex);
+					return TCL_ERROR;
+				}
+				fcntl(wake[0], F_SETFL, O_NONBLOCK);
+				fcntl(wake[1], F_SETFL, O_NONBLOCK);
+				socketserver_ownFd(wake[0]);
+				socketserver_ownFd(wake[1]);
+				data->wakeRead = wake[0];
+				data->wakeFd = wake[1];
+				data->masterPid = getpid();
+				data->masterThread = Tcl_GetCurrentThread();
+				data->masterInterp = interp;
+				/* Counters shared with the workers forked from here on */
+				data->stats = (socketserver_stats *)mmap(NULL, sizeof(socketserver_stats),
+						PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+				if (data->stats == MAP_FAILED) {
+					data->stats = NULL;
+				} else {
+					memset(data->stats, 0, sizeof(socketserver_stats));
+				}
+				for (pool = data->pools; pool != NULL; pool = pool->nextPtr) {
+					pool->stats = data->stats;
+					pool->masterPid = data->masterPid;
+				}
+				/* The master end must not stay open in forked workers. */
+				socketserver_ownFd(sock[0]);
 				data->targs.in = sock[0];
 				data->out = sock[1];
+				/* Upgrade paths only matter when the acceptor starts. */
+				strcpy(data->controlPath, controlPath);
+				strcpy(data->takeoverPath, takeoverPath);
+				if (inheritedFd != -1) {
+					/* Workers must not keep the listener open either. */
+					socketserver_ownFd(inheritedFd);
+					fcntl(inheritedFd, F_SETFD, FD_CLOEXEC);
+					data->inheritedFd = inheritedFd;
+				}
 
 				/* Create a background thread to call accept and send the fd to the socketpair. */
-				if (pthread_create(&tid, NULL, socketserver_thread, &data->targs) != 0) {
+				if (socketserver_startAcceptor(data) != 0) {
+#ifdef SOCKETSERVER_TLS
+					if (data->tls != NULL) {
+						socketserver_tlsFree(data->tls);
+						data->tls = NULL;
+					}
+#endif
 					Tcl_AddErrorInfo(interp, "Failed to create thread to read socketpipe");
 					Tcl_MutexUnlock(&threadMutex);
 					return TCL_ERROR;
 				}
-				pthread_detach(tid);
 			}
 			Tcl_MutexUnlock(&threadMutex);
+			/* A running acceptor picks the new settings up when it wakes. */
+			socketserver_wakeAcceptor(data);
+			break;
+		}
+
+		case OPT_PAUSE:
+		case OPT_RESUME:
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, "port");
+				return TCL_ERROR;
+			}
+			if (Tcl_GetIntFromObj(interp, objv[2], &port)) {
+				Tcl_AddErrorInfo(interp, "problem getting port number as integer");
+				return TCL_ERROR;
+			}
+			Tcl_MutexLock(&threadMutex);
+			data = socketserver_getPort(cdPtr, port, 0);
+			if (data == NULL || data->targs.in == -1 || data->masterPid != getpid()) {
+				Tcl_MutexUnlock(&threadMutex);
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("no server for port in this process", -1));
+				return TCL_ERROR;
+			}
+			data->config.paused = (optIndex == OPT_PAUSE);
+			data->configEpoch++;
+			Tcl_MutexUnlock(&threadMutex);
+			socketserver_wakeAcceptor(data);
 			break;
 
-		case OPT_CLIENT:
-			if (objc == 5) {
-				/* parse the port number argument */
-				if (Tcl_GetIntFromObj(interp, objv[3], &port)) {
-					Tcl_AddErrorInfo(interp, "problem getting port number as integer");
+		case OPT_STOP: {
+			int timeout = SOCKETSERVER_DEFAULT_STOPTIMEOUT;
+			Tcl_Obj *command = NULL;
+			int argIndex;
+			enum stopOptions {
+				STOP_TIMEOUT,
+				STOP_COMMAND
+			};
+			static CONST char *stopOptions[] = { "-timeout", "-command", NULL };
+
+			if (objc < 3 || objc % 2 == 0) {
+				Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_STOP_USAGE);
+				return TCL_ERROR;
+			}
+			for (argIndex = 2; argIndex < objc - 1; argIndex += 2) {
+				int stopIndex;
+				if (Tcl_GetIndexFromObj (interp, objv[argIndex], stopOptions, "stop option",
+							TCL_EXACT, &stopIndex) != TCL_OK) {
 					return TCL_ERROR;
 				}
-				callback = Tcl_GetString(objv[4]);
-			} else if (objc == 3) {
-				port = 0;
-				callback = Tcl_GetString(objv[2]);
-			} else {
-				Tcl_WrongNumArgs (interp, 1, objv, "server port | client [-port N] handlerProc");
+				switch ((enum stopOptions) stopIndex) {
+					case STOP_TIMEOUT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex + 1], &timeout) || timeout < 0) {
+							Tcl_AddErrorInfo(interp, "-timeout must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case STOP_COMMAND:
+						command = objv[argIndex + 1];
+						break;
+				}
+			}
+			if (Tcl_GetIntFromObj(interp, objv[objc - 1], &port)) {
+				Tcl_AddErrorInfo(interp, "problem getting port number as integer");
+				return TCL_ERROR;
+			}
+			Tcl_MutexLock(&threadMutex);
+			data = socketserver_getPort(cdPtr, port, 0);
+			Tcl_MutexUnlock(&threadMutex);
+			if (data == NULL || !data->haveThread || data->masterPid != getpid()) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("no server for port in this process", -1));
 				return TCL_ERROR;
 			}
+			if (command != NULL) {
+				Tcl_IncrRefCount(command);
+				if (data->stopCommand != NULL) {
+					Tcl_DecrRefCount(data->stopCommand);
+				}
+				data->stopCommand = command;
+				data->masterInterp = interp;
+			}
+			socketserver_stopAcceptor(data, timeout);
+			break;
+		}
 
-			if (callback == NULL) {
+		case OPT_PARK: {
+			if (objc != 3 && !(objc == 5 && strcmp(Tcl_GetString(objv[2]), "-port") == 0)) {
+				Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_PARK_USAGE);
+				return TCL_ERROR;
+			}
+			if (objc == 5 && Tcl_GetIntFromObj(interp, objv[3], &port)) {
+				Tcl_AddErrorInfo(interp, "problem getting port number as integer");
+				return TCL_ERROR;
+			}
+			Tcl_MutexLock(&threadMutex);
+			data = socketserver_getPort(cdPtr, port, 0);
+			Tcl_MutexUnlock(&threadMutex);
+			if (data == NULL || data->targs.in == -1) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("no server for port", -1));
+				return TCL_ERROR;
+			}
+			return socketserver_park(interp, cdPtr, data, objv[objc - 1]);
+		}
+
+		case OPT_STATS: {
+			if (objc != 2 && !(objc == 4 && strcmp(Tcl_GetString(objv[2]), "-port") == 0)) {
+				Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_STATS_USAGE);
+				return TCL_ERROR;
+			}
+			if (objc == 4 && Tcl_GetIntFromObj(interp, objv[3], &port)) {
+				Tcl_AddErrorInfo(interp, "problem getting port number as integer");
+				return TCL_ERROR;
+			}
+			Tcl_MutexLock(&threadMutex);
+			data = socketserver_getPort(cdPtr, port, 0);
+			Tcl_MutexUnlock(&threadMutex);
+			if (data == NULL || data->stats == NULL) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("no server for port", -1));
+				return TCL_ERROR;
+			}
+			Tcl_SetObjResult(interp, socketserver_statsObj(data->stats));
+			return TCL_OK;
+		}
+
+		case OPT_CLIENT: {
+			int coroutine = 0;
+			int raw = 0;
+			int framing = SOCKETSERVER_FRAMING_NONE;
+			int maxFrame = SOCKETSERVER_DEFAULT_MAXFRAME;
+			int http = 0;
+			int maxHead = SOCKETSERVER_DEFAULT_MAXHEAD;
+			int headTimeout = 0;
+			int maxQueueWait = 0;
+			Tcl_Obj *queueResponse = NULL;
+			Tcl_Obj *stopCommand = NULL;
+			const char *poolName = NULL;
+			int maxConcurrent = 1;
+			int argIndex;
+			enum clientOptions {
+				CLIENT_PORT,
+				CLIENT_COROUTINE,
+				CLIENT_MAXCONCURRENT,
+				CLIENT_RAW,
+				CLIENT_FRAMING,
+				CLIENT_MAXFRAME,
+				CLIENT_HTTP,
+				CLIENT_MAXHEAD,
+				CLIENT_HEADTIMEOUT,
+				CLIENT_MAXQUEUEWAIT,
+				CLIENT_QUEUERESPONSE,
+				CLIENT_STOPCOMMAND,
+				CLIENT_POOL
+			};
+			static CONST char *clientOptions[] = { "-port", "-coroutine", "-maxconcurrent", "-raw",
+				"-framing", "-maxframe", "-http", "-maxhead", "-headtimeout", "-maxqueuewait", "-queueresponse", "-stopcommand",
+				"-pool", NULL };
+			static CONST char *framings[] = { "line", "netstring", "u32be", "u16be", NULL };
+
+			if (objc < 3) {
+				Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_CLIENT_USAGE);
+				return TCL_ERROR;
+			}
+
+			for (argIndex = 2; argIndex < objc - 1; argIndex++) {
+				int clientIndex;
+				if (Tcl_GetIndexFromObj (interp, objv[argIndex], clientOptions, "client option",
+							TCL_EXACT, &clientIndex) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				switch ((enum clientOptions) clientIndex) {
+					case CLIENT_COROUTINE:
+						coroutine = 1;
+						continue;
+					case CLIENT_RAW:
+						raw = 1;
+						continue;
+					case CLIENT_HTTP:
+						http = 1;
+						continue;
+					default:
+						break;
+				}
+				if (++argIndex >= objc - 1) {
+					Tcl_WrongNumArgs (interp, 2, objv, SOCKETSERVER_CLIENT_USAGE);
+					return TCL_ERROR;
+				}
+				switch ((enum clientOptions) clientIndex) {
+					case CLIENT_PORT:
+						/* parse the port number argument */
+						if (Tcl_GetIntFromObj(interp, objv[argIndex], &port)) {
+							Tcl_AddErrorInfo(interp, "problem getting port number as integer");
+							return TCL_ERROR;
+						}
+						break;
+					case CLIENT_MAXCONCURRENT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex], &maxConcurrent) || maxConcurrent < 1) {
+							Tcl_AddErrorInfo(interp, "-maxconcurrent must be a positive integer");
+							return TCL_ERROR;
+						}
+						break;
+					case CLIENT_FRAMING:
+						if (Tcl_GetIndexFromObj (interp, objv[argIndex], framings, "framing",
+									TCL_EXACT, &framing) != TCL_OK) {
+							return TCL_ERROR;
+						}
+						/* The codecs are numbered from SOCKETSERVER_FRAMING_LINE */
+						framing += SOCKETSERVER_FRAMING_LINE;
+						break;
+					case CLIENT_MAXFRAME:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex], &maxFrame) || maxFrame < 1) {
+							Tcl_AddErrorInfo(interp, "-maxframe must be a positive integer");
+							return TCL_ERROR;
+						}
+						break;
+					case CLIENT_MAXHEAD:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex], &maxHead) || maxHead < 16) {
+							Tcl_AddErrorInfo(interp, "-maxhead must be an integer of at least 16");
+							return TCL_ERROR;
+						}
+						break;
+					case CLIENT_HEADTIMEOUT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex], &headTimeout) || headTimeout < 0) {
+							Tcl_AddErrorInfo(interp, "-headtimeout must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case CLIENT_MAXQUEUEWAIT:
+						if (Tcl_GetIntFromObj(interp, objv[argIndex], &maxQueueWait) || maxQueueWait < 0) {
+							Tcl_AddErrorInfo(interp, "-maxqueuewait must be a non-negative integer");
+							return TCL_ERROR;
+						}
+						break;
+					case CLIENT_QUEUERESPONSE:
+						queueResponse = objv[argIndex];
+						break;
+					case CLIENT_STOPCOMMAND:
+						stopCommand = objv[argIndex];
+						break;
+					case CLIENT_POOL:
+						poolName = Tcl_GetString(objv[argIndex]);
+						break;
+					default:
+						break;
+				}
+			}
+			if (raw + http + (framing != SOCKETSERVER_FRAMING_NONE) > 1) {
+				Tcl_SetObjResult(interp, Tcl_NewStringObj("only one of -raw, -framing and -http may be used", -1));
+				return TCL_ERROR;
+			}
+			callback = Tcl_GetString(objv[objc - 1]);
+
+			if (callback == NULL || *callback == 0) {
 				Tcl_AddErrorInfo(interp, "problem getting callback proc name");
 				return TCL_ERROR;
 			}
@@ -396,25 +1692,72 @@ int socketserverObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_
 				Tcl_MutexUnlock(&threadMutex);
 				return TCL_ERROR;
 			}
+			/* A -route pool is served like a port of its own. */
+			if (poolName != NULL && strcmp(poolName, "default") != 0) {
+				socketserver_port *pool;
+				for (pool = data->pools; pool != NULL && strcmp(pool->poolName, poolName) != 0; pool = pool->nextPtr) {
+				}
+				if (pool == NULL) {
+					Tcl_MutexUnlock(&threadMutex);
+					Tcl_SetObjResult(interp, Tcl_ObjPrintf("port %d has no pool \"%s\"", data->targs.port, poolName));
+					return TCL_ERROR;
+				}
+				data = pool;
+			}
+			if (data->stopped) {
+				Tcl_MutexUnlock(&threadMutex);
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("port %d has been stopped", data->targs.port));
+				return TCL_ERROR;
+			}
 			data->interp = interp;
 			data->threadId = Tcl_GetCurrentThread();
-			data->callback = callback;
-			/* Bytes needed for callback script. Command plus sockXXXXXXXX */
-			data->scriptLen = strlen(data->callback) + 80;
+			/* Keep our own reference, the argument may be freed after we return. */
+			Tcl_IncrRefCount(objv[objc - 1]);
+			if (data->callback != NULL) {
+				Tcl_DecrRefCount(data->callback);
+			}
+			data->callback = objv[objc - 1];
+			data->coroutine = coroutine;
+			data->raw = raw;
+			data->framing = framing;
+			data->maxFrame = maxFrame;
+			data->http = http;
+			data->maxHead = maxHead;
+			data->headTimeout = headTimeout;
+			data->maxQueueWait = maxQueueWait;
+			if (queueResponse != NULL) {
+				Tcl_IncrRefCount(queueResponse);
+			}
+			if (data->queueResponse != NULL) {
+				Tcl_DecrRefCount(data->queueResponse);
+			}
+			data->queueResponse = queueResponse;
+			if (stopCommand != NULL) {
+				Tcl_IncrRefCount(stopCommand);
+				if (data->clientStopCommand != NULL) {
+					Tcl_DecrRefCount(data->clientStopCommand);
+				}
+				data->clientStopCommand = stopCommand;
+			}
+			data->maxConcurrent = (coroutine || framing) ? maxConcurrent : 1;
 			/* When the client end of the socketpair is readable, then
 			 * create an event to consume the fd.
 			 */
 			if (!data->have_channel) {
 				data->channel = Tcl_MakeFileChannel((void *)((long)data->out), TCL_READABLE);
-				data->have_channel = 0;
+				data->have_channel = 1;
 				Tcl_CreateChannelHandler(data->channel, TCL_READABLE, socketserver_readable, (void *)data);
 			}
 			/* Allow a readable event to process a message */
-			data->active = 1;
+			data->active = data->inFlight < data->maxConcurrent;
 			Tcl_MutexUnlock(&threadMutex);
+			if (data->active) {
+				socketserver_sendReady(data);
+			}
 			/* Because the socket is no blocking, we can attempt to queue an event right away. */
 			socketserver_readable(data, 0);
 			break;
+		}
 
 		default:
 			Tcl_AddErrorInfo(interp, "Unexpected command option");
@@ -14,12 +14,228 @@
 
 #include <tcl.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 extern int
 socketserverObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
 
+extern int
+socketserverNotifierObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserver_notifierInit(Tcl_Interp *interp);
+
+extern int
+socketserverReadObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverReadvObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverWriteObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverWritevObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverCloseObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverReplyObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverEofObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern int
+socketserverPeerObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
 #define SOCKETSERVER_OBJECT_MAGIC 71820352
 
+/* Message framing for -framing client handlers */
+#define SOCKETSERVER_FRAMING_NONE 0
+#define SOCKETSERVER_FRAMING_LINE 1
+#define SOCKETSERVER_FRAMING_NETSTRING 2
+#define SOCKETSERVER_FRAMING_U32BE 3
+#define SOCKETSERVER_FRAMING_U16BE 4
+
+#define SOCKETSERVER_DEFAULT_MAXFRAME (16 * 1024 * 1024)
+#define SOCKETSERVER_DEFAULT_MAXHEAD 16384
+#define SOCKETSERVER_DEFAULT_QUEUEINTERVAL 100
+#define SOCKETSERVER_DEFAULT_OVERFLOW 1024
+#define SOCKETSERVER_MAX_PREREAD 4096 /* largest -preread, sent with the connection */
+#define SOCKETSERVER_DEFAULT_PREREADTIMEOUT 5000
+#define SOCKETSERVER_MAX_SHEDRESPONSE 4096
+#define SOCKETSERVER_DEFAULT_STOPTIMEOUT 30000
+#define SOCKETSERVER_DEFAULT_DONETIMEOUT 300000
+#define SOCKETSERVER_MAX_PATH 104 /* longest control socket path, as sun_path allows */
+#define SOCKETSERVER_LISTEN_FDS_START 3 /* first fd passed by systemd socket activation */
+#define SOCKETSERVER_MAX_ROUTES 16 /* -route rules per port */
+#define SOCKETSERVER_MAX_PREFIX 64 /* longest -route prefix */
+#define SOCKETSERVER_MAX_POOLNAME 32 /* longest -route pool name, including the NUL */
+#define SOCKETSERVER_DEFAULT_TLSTHREADS 2
+#define SOCKETSERVER_MAX_TLSTHREADS 64
+#define SOCKETSERVER_MAX_SOURCERATE 1000000 /* largest -sourcerate and -sourceburst */
+#define SOCKETSERVER_MAX_ACCEPTRATE 1000000 /* largest -acceptrate and -acceptburst */
+#define SOCKETSERVER_MAX_ACL 65536 /* entries of an -allow or -deny list */
+
+/* What -overlimit does with connections over -acceptrate or -maxinflight */
+#define SOCKETSERVER_OVERLIMIT_BACKLOG 0 /* leave them in the listen backlog */
+#define SOCKETSERVER_OVERLIMIT_SHED 1 /* accept and refuse them */
+
+/* Message types on the socketpair between the master and the workers */
+#define SOCKETSERVER_MSG_CONN 'C' /* master to worker: a new connection */
+#define SOCKETSERVER_MSG_PARK 'P' /* worker to master: hold this idle connection */
+#define SOCKETSERVER_MSG_DONE 'D' /* worker to master: the worker closed connection id */
+#define SOCKETSERVER_MSG_READY 'R' /* worker to master: the worker can take a connection */
+
+/* Messages on the control socket from a new master to the old one, and back */
+#define SOCKETSERVER_MSG_TAKEOVER 'T' /* new master: hand over the port */
+#define SOCKETSERVER_MSG_LISTENER 'L' /* old master: the listening socket */
+#define SOCKETSERVER_MSG_QUEUED 'Q' /* old master: a connection not yet dispatched */
+#define SOCKETSERVER_MSG_PARKED 'K' /* old master: a parked connection */
+#define SOCKETSERVER_MSG_END 'E' /* old master: nothing more follows */
+
+/* Layout of socketserver_msg; messages of another version are dropped */
+#define SOCKETSERVER_MSG_VERSION 1
+
+/* socketserver_msg flags */
+#define SOCKETSERVER_MSGF_PARKED 1 /* the connection was parked and has a new request */
+#define SOCKETSERVER_MSGF_PEER 2 /* peer is the client, from a PROXY header or a TLS relay, not the fd's own peer */
+#define SOCKETSERVER_MSGF_CHARGED 0x8000 /* master only, never sent: counted against the client's -sourcemax */
+
+/*
+ * Address of a connection's peer, family 0 when it is not known.
+ */
+typedef struct socketserver_peer {
+	unsigned short family; /* AF_INET or AF_INET6 */
+	unsigned short port; /* host order */
+	unsigned char addr[16]; /* network order, 4 bytes for AF_INET */
+} socketserver_peer;
+
+/*
+ * A message on the socketpair, which is SOCK_SEQPACKET where the system
+ * has it so each message keeps its boundary.  Connections travel as an
+ * SCM_RIGHTS fd attached to the message.  A message may be followed by
+ * preLen bytes of payload; receivers ignore what they do not know.
+ */
+typedef struct socketserver_msg {
+	unsigned char version; /* SOCKETSERVER_MSG_VERSION, set by socketserver_sendMsg */
+	unsigned char type; /* SOCKETSERVER_MSG_* */
+	unsigned short flags; /* SOCKETSERVER_MSGF_* */
+	unsigned int id; /* connection the master keeps a copy of, or 0 */
+	unsigned long long acceptedAt; /* socketserver_now() when the connection became ready */
+	unsigned long long sentAt; /* socketserver_now() when the message was sent */
+	socketserver_peer peer; /* client of the connection */
+	unsigned short localPort; /* port the connection was accepted on */
+	unsigned short preLen; /* bytes of payload after the message */
+} socketserver_msg;
+
+/*
+ * Counters of a port, in memory shared by the master and its forked
+ * workers.  They are only changed with SOCKETSERVER_STAT_ADD.
+ */
+typedef struct socketserver_stats {
+	unsigned long accepted; /* connections accepted by the master */
+	unsigned long dispatched; /* connections sent to the workers, including parked ones */
+	unsigned long received; /* connections taken by workers */
+	unsigned long queueExpired; /* dropped by workers after waiting longer than -maxqueuewait */
+	unsigned long parked; /* connections parked by workers */
+	unsigned long parkTimeouts; /* parked connections closed after -parktimeout */
+	unsigned long deadlineExpired; /* connections shut down after -deadline */
+	unsigned long idle; /* connections parked now */
+	unsigned long pending; /* connections waiting in the master for a worker */
+	unsigned long queueDropped; /* dropped from the master's queue by -queuetarget */
+	unsigned long shed; /* refused by the master over -shed-threshold */
+	unsigned long paused; /* 1 while the master is not accepting */
+	unsigned long fdExhausted; /* accepts that failed with EMFILE or ENFILE */
+	unsigned long acceptAborted; /* connections that went away before accept returned them */
+	unsigned long acceptErrors; /* other accept failures */
+	unsigned long acceptBackoffs; /* times accepting was suspended after an error */
+	unsigned long overflowed; /* connections held because the socketpair was full */
+	unsigned long overflowDropped; /* refused because -overflow connections were held already */
+	unsigned long sendErrors; /* connections lost because the socketpair could not be written */
+	unsigned long prereadTimeouts; /* closed after sending nothing for -prereadtimeout */
+	unsigned long routed; /* connections sent to a -route pool rather than the default one */
+	unsigned long proxyErrors; /* closed for a missing or malformed PROXY header */
+	unsigned long tlsHandshakes; /* TLS handshakes completed by the master */
+	unsigned long tlsErrors; /* closed for a failed or timed out TLS handshake */
+	unsigned long tlsKtls; /* handed to a worker with kernel TLS installed */
+	unsigned long tlsRelayed; /* handed to a worker through a relay in the master */
+	unsigned long sourceRefused; /* refused because the client was over -sourcemax or -sourcerate */
+	unsigned long sourceHeld; /* waited in the master because the client was at -sourcemax */
+	unsigned long sources; /* client addresses the master keeps limits for now */
+	unsigned long limitShed; /* refused over -acceptrate or -maxinflight */
+	unsigned long limitPauses; /* times accepting stopped for -acceptrate or -maxinflight */
+	unsigned long denied; /* closed because -allow, -deny or -proxyfrom does not let the client in */
+	unsigned long doneTimeouts; /* connections no longer counted after -donetimeout without a report */
+} socketserver_stats;
+
+#define SOCKETSERVER_STAT_ADD(stats, field, n) \
+	do { if ((stats) != NULL) __sync_fetch_and_add(&(stats)->field, (n)); } while (0)
+
+/*
+ * Settings of the acceptor thread, changed by "server" options.  The
+ * thread takes a copy when configEpoch changes.
+ */
+typedef struct socketserver_config {
+	int parkTimeout; /* ms a parked connection may stay idle, 0 for no limit */
+	int deadline; /* ms a worker may hold a connection before the master shuts it down, 0 for no limit */
+	int queueTarget; /* ms a connection may wait in an overloaded queue, 0 to queue in the socketpair */
+	int queueInterval; /* ms the queue must stay non-empty to count as overloaded */
+	int shedThreshold; /* connections waiting for a worker above which new ones are refused, 0 for no limit */
+	int shedResponseLen;
+	char shedResponse[SOCKETSERVER_MAX_SHEDRESPONSE]; /* written to refused and dropped connections */
+	int paused; /* stop accepting, set by "pause" */
+	int highWater; /* connections waiting for a worker at which accepting stops, 0 for no limit */
+	int lowWater; /* connections waiting for a worker at which accepting starts again */
+	int overflow; /* connections held while the socketpair is full, beyond that they are refused */
+	int preread; /* bytes to read before dispatching a new connection, 0 to dispatch at once */
+	int prereadTimeout; /* ms to wait for the first bytes before closing the connection */
+	int proxy; /* new connections start with a PROXY protocol header */
+	int sourceMax; /* connections one client address may have with the workers, 0 for no limit */
+	int sourceRate; /* new connections per second one client address may open, 0 for no limit */
+	int sourceBurst; /* connections above sourceRate allowed at once, 0 for sourceRate */
+	int sourceWait; /* ms a connection over sourceMax may wait for a slot, 0 refuses it */
+	int acceptRate; /* new connections per second the port accepts, 0 for no limit */
+	int acceptBurst; /* connections above acceptRate accepted at once, 0 for acceptRate */
+	int maxInflight; /* connections the workers may have at once, 0 for no limit */
+	int overLimit; /* SOCKETSERVER_OVERLIMIT_* */
+	int doneTimeout; /* ms a dispatched connection counts without -deadline if its worker never reports it closed */
+} socketserver_config;
+
+/*
+ * A -route rule: connections whose first bytes start with prefix go to
+ * worker pool pool, 0 being the default pool.
+ */
+typedef struct socketserver_route {
+	int pool;
+	int len;
+	unsigned char prefix[SOCKETSERVER_MAX_PREFIX];
+} socketserver_route;
+
+/*
+ * TLS termination for -tlscert: the context and the handshake threads.
+ * Only tls.c looks inside.
+ */
+typedef struct socketserver_tls socketserver_tls;
+
+/*
+ * Readiness of fds for threads other than the acceptor, over the
+ * acceptor's epoll or poll() code.
+ */
+typedef struct socketserver_poller socketserver_poller;
+
+/*
+ * The -allow, -deny and -proxyfrom lists, compiled by acl.c.
+ */
+typedef struct socketserver_acl socketserver_acl;
+
+#define SOCKETSERVER_POLLER_IN 1
+#define SOCKETSERVER_POLLER_OUT 2
+#define SOCKETSERVER_POLLER_MAXEVENTS 64
+
 typedef struct socketserver_thread_args {
 	int port;
 	int in;
@@ -28,23 +244,236 @@ typedef struct socketserver_thread_args {
 typedef struct socketserver_port {
 	socketserver_thread_args targs;
 	int out; /* Output for socketpair to write FD */
-	const char *callback; /* tcl handler proc */
-	size_t scriptLen; /* length of callback plus overhead */
+	socketserver_config config; /* guarded by socketserver_lock */
+	unsigned int configEpoch; /* incremented when config changes */
+	socketserver_stats *stats; /* shared with the workers, NULL until "server" */
+	int wakeFd; /* write end of the pipe that wakes the acceptor thread */
+	int wakeRead; /* read end, watched by the acceptor thread */
+	pid_t masterPid; /* process running the acceptor thread */
+	Tcl_ThreadId masterThread; /* Tcl thread that started the acceptor thread */
+	Tcl_Interp *masterInterp; /* interpreter for stopCommand */
+	pthread_t acceptorThread;
+	int haveThread; /* acceptorThread is running or not yet joined */
+	int stopRequested; /* set by "stop", guarded by socketserver_lock */
+	int stopTimeout; /* ms to drain after "stop", 0 stops at once */
+	Tcl_Obj *stopCommand; /* run in the master when the port has stopped */
+	Tcl_Obj *clientStopCommand; /* run in a worker when the master has stopped the port */
+	int stopped; /* the master has stopped the port */
+	char controlPath[SOCKETSERVER_MAX_PATH]; /* control socket for upgrades, or empty */
+	char takeoverPath[SOCKETSERVER_MAX_PATH]; /* take the port over from the master at this path, or empty */
+	int inheritedFd; /* listening socket created by a supervisor, or -1 */
+	int seqpacket; /* the socketpair is SOCK_SEQPACKET rather than SOCK_STREAM */
+	socketserver_route routes[SOCKETSERVER_MAX_ROUTES]; /* fixed when the acceptor starts */
+	int routeCount;
+	int routePeek; /* bytes needed to match every route */
+	char poolName[SOCKETSERVER_MAX_POOLNAME]; /* name of a -route pool, empty for the port itself */
+	struct socketserver_port *pools; /* -route pools, each with its own socketpair, numbered from 1 and chained by nextPtr */
+	socketserver_tls *tls; /* -tlscert termination, or NULL; the acceptor frees it when it exits */
+	Tcl_Obj *allowObj; /* -allow list, or NULL */
+	Tcl_Obj *denyObj; /* -deny list, or NULL */
+	socketserver_acl *acl; /* lists compiled since the acceptor last looked, guarded by socketserver_lock */
+	int aclChanged; /* acl is new, even if NULL; the acceptor takes it and frees the one it had */
+	Tcl_Obj *proxyFromObj; /* -proxyfrom list, or NULL */
+	socketserver_acl *proxyAcl; /* and compiled, handed over as acl is */
+	int proxyAclChanged;
+	Tcl_Obj *callback; /* tcl handler command prefix */
 	Tcl_Interp *interp;
 	Tcl_ThreadId threadId;
 	int active; /* process event from socketpair */
+	pid_t creditPid; /* process that has told the master it can take a connection */
 	int have_channel; 
 	Tcl_Channel channel;
+	int coroutine; /* run each handler in its own coroutine */
+	int maxConcurrent; /* coroutines or framed connections allowed in flight */
+	int inFlight; /* coroutines or framed connections currently running */
+	unsigned long coroCounter; /* used to name the coroutines */
+	int raw; /* pass the handler a plain fd instead of a channel */
+	int framing; /* SOCKETSERVER_FRAMING_* codec, handler is called per message */
+	int maxFrame; /* largest message accepted by the codec */
+	int http; /* parse the HTTP request head before calling the handler */
+	int maxHead; /* largest HTTP request head accepted */
+	int headTimeout; /* ms to wait for the whole request head, 0 waits forever */
+	int maxQueueWait; /* ms a connection may wait for a worker before it is dropped, 0 for no limit */
+	Tcl_Obj *queueResponse; /* written to connections dropped after maxQueueWait, or NULL */
+	struct socketserver_objectClientData *owner;
 	struct socketserver_port * nextPtr;
 } socketserver_port;
 
+/*
+ * A connection handed to a -raw or -framing handler.  The handler refers
+ * to it by fd.
+ */
+typedef struct socketserver_conn {
+	int fd;
+	socketserver_port *port;
+	int framing; /* SOCKETSERVER_FRAMING_* of the port when received */
+	int eof; /* end of stream or framing error seen */
+	unsigned char *buf; /* received bytes not yet delivered as a message */
+	size_t bufLen;
+	size_t bufSize;
+	unsigned int id; /* master's id for the connection, 0 if it keeps no copy */
+	int doneSock; /* socketpair to report the close to */
+	unsigned char *out; /* written by the handler, not yet taken by the socket */
+	size_t outOff;
+	size_t outLen;
+	size_t outSize;
+	int outError; /* errno of a failed write of out, 0 if none */
+	int watched; /* TCL_READABLE and TCL_WRITABLE of the file handler on fd */
+	int closing; /* closed by the handler, fd stays open until out is written */
+	Tcl_TimerToken lingerTimer;
+	struct socketserver_objectClientData *owner;
+} socketserver_conn;
+
 typedef struct socketserver_objectClientData
 {
 	int object_magic;
 	// Allocate a structure per port, NULL terminated array
 	socketserver_port* ports;
+	Tcl_HashTable conns; /* socketserver_conn keyed by fd */
+	Tcl_HashTable peers; /* socketserver_peer from a PROXY header or TLS relay, keyed by fd */
 } socketserver_objectClientData;
 
+extern socketserver_conn *
+socketserver_registerConn(socketserver_objectClientData *cdPtr, socketserver_port *port, int fd);
+
+extern void
+socketserver_closeConn(socketserver_objectClientData *cdPtr, socketserver_conn *conn);
+
+extern void
+socketserver_setPeer(socketserver_objectClientData *cdPtr, int fd, const socketserver_peer *peer);
+
+extern socketserver_conn *
+socketserver_getConn(Tcl_Interp *interp, socketserver_objectClientData *cdPtr, Tcl_Obj *fdObj);
+
+extern int
+socketserver_queueWrite(socketserver_conn *conn, const struct iovec *iov, int iovcnt);
+
+extern void
+socketserver_watchConn(socketserver_conn *conn);
+
+extern void
+socketserver_readFraming(socketserver_conn *conn);
+
+extern void
+socketserver_startFraming(socketserver_conn *conn, const unsigned char *pre, size_t preLen);
+
+extern void
+socketserver_stopFraming(socketserver_conn *conn);
+
+extern void
+socketserver_rearm(socketserver_port *data);
+
+extern void
+socketserver_invoke(socketserver_port *data, Tcl_Channel channel, int objc, Tcl_Obj *CONST objv[]);
+
+extern Tcl_Channel
+socketserver_makeChannel(socketserver_port *data, int fd, unsigned int id);
+
+extern void
+socketserver_startHttp(socketserver_port *data, int fd, unsigned int id, const unsigned char *pre, size_t preLen);
+
+extern int
+socketserver_sendMsg(int sock, const socketserver_msg *msg, int fd, int flags);
+
+extern int
+socketserver_sendConn(int sock, const socketserver_msg *msg, const void *pre, int fd, int flags);
+
+extern int
+socketserver_recvMsg(int sock, socketserver_msg *msg, int *fdPtr);
+
+extern int
+socketserver_recvConn(int sock, socketserver_msg *msg, void *pre, size_t preSize, int *fdPtr);
+
+extern void
+socketserver_sendDone(int sock, unsigned int id);
+
+extern void
+socketserver_sendReady(socketserver_port *data);
+
+extern void
+socketserver_ownFd(int fd);
+
+extern void
+socketserver_closeOwnedFd(int fd);
+
+extern int
+socketserver_ownedSocketpair(int type, int sv[2]);
+
+extern unsigned long long
+socketserver_now(void);
+
+extern socketserver_poller *
+socketserver_pollerNew(void);
+
+extern void
+socketserver_pollerFree(socketserver_poller *p);
+
+extern int
+socketserver_pollerAdd(socketserver_poller *p, int fd, int events, void *ptr);
+
+extern int
+socketserver_pollerMod(socketserver_poller *p, int fd, int events, void *ptr);
+
+extern void
+socketserver_pollerDel(socketserver_poller *p, int fd);
+
+extern int
+socketserver_pollerWait(socketserver_poller *p, int timeout, void **ptrs, int *events);
+
+extern socketserver_tls *
+socketserver_tlsNew(Tcl_Interp *interp, const char *certFile, const char *keyFile, int threads);
+
+extern int
+socketserver_tlsStart(socketserver_tls *tls, socketserver_stats *stats);
+
+extern int
+socketserver_tlsAccept(socketserver_tls *tls, int fd, const socketserver_msg *arrival, int timeout);
+
+extern int
+socketserver_tlsReady(socketserver_tls *tls, int *fdPtr, socketserver_msg *arrival);
+
+extern int
+socketserver_tlsBusy(socketserver_tls *tls);
+
+extern void
+socketserver_tlsFree(socketserver_tls *tls);
+
+extern int
+socketserver_aclNew(Tcl_Interp *interp, Tcl_Obj *allowObj, Tcl_Obj *denyObj, socketserver_acl **aclPtr);
+
+extern int
+socketserver_aclNewOnly(Tcl_Interp *interp, Tcl_Obj *listObj, const char *option, socketserver_acl **aclPtr);
+
+extern int
+socketserver_aclCheck(const socketserver_acl *acl, const socketserver_peer *peer);
+
+extern void
+socketserver_aclFree(socketserver_acl *acl);
+
+extern int
+socketserver_startAcceptor(socketserver_port *data);
+
+extern void
+socketserver_wakeAcceptor(socketserver_port *data);
+
+extern void
+socketserver_stopAcceptor(socketserver_port *data, int timeout);
+
+extern void
+socketserver_joinAcceptor(socketserver_port *data);
+
+extern void
+socketserver_acceptorDone(socketserver_port *data);
+
+extern void
+socketserver_releasePort(socketserver_port *data);
+
+extern void
+socketserver_lock(void);
+
+extern void
+socketserver_unlock(void);
+
 typedef struct socketserver_ThreadEvent {
 	Tcl_Event event;
 	socketserver_port* data;
@@ -17,11 +17,27 @@ static void socketserver_CmdDeleteProc(ClientData clientData)
 {
 	if (clientData != NULL) {
 		socketserver_objectClientData *cdPtr = (socketserver_objectClientData *)clientData;
+		Tcl_HashSearch search;
+		Tcl_HashEntry *entryPtr;
+		/* Close the connections still held by -raw handlers. */
+		while ((entryPtr = Tcl_FirstHashEntry(&cdPtr->conns, &search)) != NULL) {
+			socketserver_conn *conn = (socketserver_conn *)Tcl_GetHashValue(entryPtr);
+			/* The ports are going away, do not re-arm them. */
+			conn->port = NULL;
+			socketserver_closeConn(cdPtr, conn);
+		}
+		Tcl_DeleteHashTable(&cdPtr->conns);
+		while ((entryPtr = Tcl_FirstHashEntry(&cdPtr->peers, &search)) != NULL) {
+			ckfree(Tcl_GetHashValue(entryPtr));
+			Tcl_DeleteHashEntry(entryPtr);
+		}
+		Tcl_DeleteHashTable(&cdPtr->peers);
 		if (cdPtr->ports != NULL) {
 			socketserver_port *p = cdPtr->ports;
 			while (p != NULL) {
 				socketserver_port *prev = p;
 				p = p->nextPtr;
+				socketserver_releasePort(prev);
 				ckfree(prev);
 			}
 		}
@@ -43,7 +59,10 @@ static void socketserver_CmdDeleteProc(ClientData clientData)
  *	A standard Tcl result
  *
  * Side effects:
- *	One new command "::socketserver::socket" is added to the Tcl interpreter.
+ *	The commands "::socketserver::socket", "::socketserver::notifier",
+ *	"::socketserver::peer" and the fd commands read, readv, write, writev,
+ *	close, reply and eof used by -raw and -framing handlers are added to
+ *	the ::socketserver namespace.
  *
  *----------------------------------------------------------------------
  */
@@ -64,6 +83,11 @@ Socketserver_Init(Tcl_Interp *interp)
 		return TCL_ERROR;
 	}
 
+	/* Before anything can create a file handler, see epollnotify.c */
+	if (socketserver_notifierInit(interp) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
 	if (Tcl_PkgProvide(interp, PACKAGE_NAME, PACKAGE_VERSION) != TCL_OK) {
 		return TCL_ERROR;
 	}
@@ -77,11 +101,39 @@ Socketserver_Init(Tcl_Interp *interp)
 
 	data->object_magic = SOCKETSERVER_OBJECT_MAGIC;
 	data->ports = NULL;
+	Tcl_InitHashTable(&data->conns, TCL_ONE_WORD_KEYS);
+	Tcl_InitHashTable(&data->peers, TCL_ONE_WORD_KEYS);
 
 	/* Create the create command  */
 	Tcl_CreateObjCommand(interp, "::socketserver::socket", (Tcl_ObjCmdProc *) socketserverObjCmd, 
 						 (ClientData)data, (Tcl_CmdDeleteProc *)socketserver_CmdDeleteProc);
 
+	/* Unbuffered fd commands for -raw handlers */
+	Tcl_CreateObjCommand(interp, "::socketserver::read", (Tcl_ObjCmdProc *) socketserverReadObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+	Tcl_CreateObjCommand(interp, "::socketserver::readv", (Tcl_ObjCmdProc *) socketserverReadvObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+	Tcl_CreateObjCommand(interp, "::socketserver::write", (Tcl_ObjCmdProc *) socketserverWriteObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+	Tcl_CreateObjCommand(interp, "::socketserver::writev", (Tcl_ObjCmdProc *) socketserverWritevObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+	Tcl_CreateObjCommand(interp, "::socketserver::close", (Tcl_ObjCmdProc *) socketserverCloseObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+
+	/* Message commands for -framing handlers */
+	Tcl_CreateObjCommand(interp, "::socketserver::reply", (Tcl_ObjCmdProc *) socketserverReplyObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+	Tcl_CreateObjCommand(interp, "::socketserver::eof", (Tcl_ObjCmdProc *) socketserverEofObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+
+	/* Client address of a connection, from a PROXY header when there was one */
+	Tcl_CreateObjCommand(interp, "::socketserver::peer", (Tcl_ObjCmdProc *) socketserverPeerObjCmd,
+						 (ClientData)data, (Tcl_CmdDeleteProc *)NULL);
+
+	/* Optional epoll notifier for workers with many channels */
+	Tcl_CreateObjCommand(interp, "::socketserver::notifier", (Tcl_ObjCmdProc *) socketserverNotifierObjCmd,
+						 (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+
 	Tcl_Export (interp, namespace, "*", 0);
 
 	return TCL_OK;
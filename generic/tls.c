@@ -0,0 +1,764 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: t -*- */
+
+/*
+ * tls - TLS termination in the master for "server -tlscert"
+ *
+ * Copyright (C) 2017 FlightAware LLC
+ *
+ * freely redistributable under the Berkeley license
+ *
+ * The acceptor hands each new connection to one of a few TLS threads,
+ * which do the handshake with OpenSSL without blocking.  When the kernel
+ * can take the session over (kTLS), OpenSSL has installed the keys on the
+ * socket and the socket itself goes back to the acceptor: the worker
+ * reads and writes plaintext on an ordinary fd and the master does
+ * nothing more for it.  Otherwise the thread keeps the TLS connection
+ * and relays between it and a unix socketpair, whose other end goes back
+ * to the acceptor instead.
+ *
+ * Connections go to a thread, and come back to the acceptor, on lists
+ * guarded by a mutex, with a socketpair to wake the other side.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "socketserver.h"
+
+/* Plaintext buffered in each direction of a relay */
+#define TLS_RELAY_BUFSIZE 16384
+
+#define TLS_LIST_HANDSHAKE 1
+#define TLS_LIST_RELAY 2
+
+typedef struct tls_conn {
+	int fd; /* the client's socket */
+	int relay; /* the thread's end of the relay socketpair, -1 until the handshake is done */
+	SSL *ssl;
+	socketserver_msg arrival;
+	unsigned long long deadline; /* end of the handshake, 0 for none */
+	int fdEvents; /* SOCKETSERVER_POLLER_* watched on fd */
+	int relayEvents; /* and on relay */
+	int sslWants; /* SOCKETSERVER_POLLER_* OpenSSL waits for on fd */
+	unsigned char *up; /* plaintext from the client for the worker */
+	int upLen;
+	int upOff;
+	unsigned char *down; /* plaintext from the worker for the client */
+	int downLen;
+	int downOff;
+	int clientEof; /* the client has closed or sent close_notify */
+	int list; /* TLS_LIST_* the conn is on, or 0 */
+	int dead; /* closed, freed at the end of the event batch */
+	struct tls_conn *prev; /* neighbours in the handshake or relay list */
+	struct tls_conn *next;
+	struct tls_conn *nextPtr; /* chain of jobs, or of the graveyard */
+} tls_conn;
+
+/* A connection for the acceptor to pass on */
+typedef struct tls_ready {
+	int fd;
+	socketserver_msg arrival;
+	struct tls_ready *nextPtr;
+} tls_ready;
+
+typedef struct tls_thread {
+	struct socketserver_tls *tls;
+	pthread_t thread;
+	int started;
+	int wakeRead; /* watched by the thread */
+	int wakeFd; /* written by the acceptor after adding to jobs */
+	tls_conn *jobs; /* new connections, newest first, guarded by tls->mutex */
+	socketserver_poller *poller;
+	tls_conn *hsHead; /* handshakes, oldest first */
+	tls_conn *hsTail;
+	tls_conn *relays;
+	tls_conn *graveyard; /* conns closed during this event batch */
+} tls_thread;
+
+struct socketserver_tls {
+	SSL_CTX *ctx;
+	int threadCount;
+	tls_thread *threads;
+	int nextThread; /* next thread to get a connection, used by the acceptor only */
+	pthread_mutex_t mutex;
+	tls_ready *ready; /* connections for the acceptor, oldest first, guarded by mutex */
+	tls_ready **readyTail;
+	int readyRead; /* watched by the acceptor */
+	int readyFd; /* written by the threads after adding to ready */
+	int busy; /* connections given to the threads and not yet finished, guarded by mutex */
+	int stopping; /* guarded by mutex */
+	socketserver_stats *stats;
+};
+
+static void tls_wake(int fd)
+{
+	char c = 0;
+
+	/* A byte already waiting wakes the reader just as well. */
+	while (send(fd, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR) {
+	}
+}
+
+static void tls_drainWake(int fd)
+{
+	char buf[64];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+	}
+}
+
+/*
+ * Pass a connection to the acceptor.
+ */
+static void tls_pass(socketserver_tls *tls, int fd, const socketserver_msg *arrival)
+{
+	tls_ready *ready = (tls_ready *)malloc(sizeof(tls_ready));
+
+	if (ready == NULL) {
+		socketserver_closeOwnedFd(fd);
+		return;
+	}
+	ready->fd = fd;
+	ready->arrival = *arrival;
+	ready->nextPtr = NULL;
+	pthread_mutex_lock(&tls->mutex);
+	*tls->readyTail = ready;
+	tls->readyTail = &ready->nextPtr;
+	pthread_mutex_unlock(&tls->mutex);
+	tls_wake(tls->readyFd);
+}
+
+static void tls_unlink(tls_thread *t, tls_conn *conn)
+{
+	tls_conn **head = conn->list == TLS_LIST_HANDSHAKE ? &t->hsHead : &t->relays;
+
+	if (conn->list == 0) {
+		return;
+	}
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		*head = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	} else if (conn->list == TLS_LIST_HANDSHAKE) {
+		t->hsTail = conn->prev;
+	}
+	conn->prev = conn->next = NULL;
+	conn->list = 0;
+}
+
+/*
+ * Close what is left of a connection.  The conn itself lasts until the
+ * end of the event batch, which may still name it.
+ */
+static void tls_finish(tls_thread *t, tls_conn *conn)
+{
+	tls_unlink(t, conn);
+	if (conn->ssl != NULL) {
+		SSL_free(conn->ssl);
+		conn->ssl = NULL;
+	}
+	if (conn->fd != -1) {
+		socketserver_pollerDel(t->poller, conn->fd);
+		socketserver_closeOwnedFd(conn->fd);
+		conn->fd = -1;
+	}
+	if (conn->relay != -1) {
+		socketserver_pollerDel(t->poller, conn->relay);
+		socketserver_closeOwnedFd(conn->relay);
+		conn->relay = -1;
+	}
+	free(conn->up);
+	free(conn->down);
+	conn->up = conn->down = NULL;
+	conn->dead = 1;
+	conn->nextPtr = t->graveyard;
+	t->graveyard = conn;
+	pthread_mutex_lock(&t->tls->mutex);
+	t->tls->busy--;
+	pthread_mutex_unlock(&t->tls->mutex);
+}
+
+/*
+ * Watch fd for events only.  An fd watched for nothing is taken out of
+ * the poller, as epoll would report a hangup on it over and over.
+ */
+static void tls_watch(tls_thread *t, tls_conn *conn, int fd, int *current, int events)
+{
+	if (*current == events) {
+		return;
+	}
+	if (events == 0) {
+		socketserver_pollerDel(t->poller, fd);
+	} else if (*current == 0) {
+		socketserver_pollerAdd(t->poller, fd, events, conn);
+	} else {
+		socketserver_pollerMod(t->poller, fd, events, conn);
+	}
+	*current = events;
+}
+
+/*
+ * Note what OpenSSL waits for after a call that returned result.
+ *
+ * Returns: 1 if the call should be made again when fd is ready, 0 if
+ * the connection has ended or failed.
+ */
+static int tls_wants(tls_conn *conn, int result)
+{
+	switch (SSL_get_error(conn->ssl, result)) {
+		case SSL_ERROR_WANT_READ:
+			conn->sslWants |= SOCKETSERVER_POLLER_IN;
+			return 1;
+		case SSL_ERROR_WANT_WRITE:
+			conn->sslWants |= SOCKETSERVER_POLLER_OUT;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tls_pump --
+ *
+ *      Move plaintext both ways between the TLS connection and the
+ *      relay socketpair until neither side can take or give more, then
+ *      watch what is needed to go on.  Each direction has one buffer,
+ *      which is only refilled once it has been written out, so a slow
+ *      reader holds back its writer.  When the worker closes its end,
+ *      the client gets close_notify and the connection is closed; when
+ *      the client does, the worker sees the end of the stream.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void tls_pump(tls_thread *t, tls_conn *conn)
+{
+	int progress = 1;
+	int n;
+
+	while (progress) {
+		progress = 0;
+		conn->sslWants = 0;
+
+		if (!conn->clientEof && conn->upLen == 0) {
+			ERR_clear_error();
+			n = SSL_read(conn->ssl, conn->up, TLS_RELAY_BUFSIZE);
+			if (n > 0) {
+				conn->upLen = n;
+				conn->upOff = 0;
+				progress = 1;
+			} else if (!tls_wants(conn, n)) {
+				conn->clientEof = 1;
+				shutdown(conn->relay, SHUT_WR);
+			}
+		}
+		if (conn->upOff < conn->upLen) {
+			n = send(conn->relay, conn->up + conn->upOff, conn->upLen - conn->upOff, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n > 0) {
+				conn->upOff += n;
+				if (conn->upOff == conn->upLen) {
+					conn->upOff = conn->upLen = 0;
+				}
+				progress = 1;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				tls_finish(t, conn);
+				return;
+			}
+		}
+
+		if (conn->downLen == 0) {
+			n = recv(conn->relay, conn->down, TLS_RELAY_BUFSIZE, MSG_DONTWAIT);
+			if (n > 0) {
+				conn->downLen = n;
+				conn->downOff = 0;
+				progress = 1;
+			} else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+				/* The worker is done, everything it wrote has been sent. */
+				ERR_clear_error();
+				SSL_shutdown(conn->ssl);
+				tls_finish(t, conn);
+				return;
+			}
+		}
+		if (conn->downOff < conn->downLen) {
+			ERR_clear_error();
+			n = SSL_write(conn->ssl, conn->down + conn->downOff, conn->downLen - conn->downOff);
+			if (n > 0) {
+				conn->downOff += n;
+				if (conn->downOff == conn->downLen) {
+					conn->downOff = conn->downLen = 0;
+				}
+				progress = 1;
+			} else if (!tls_wants(conn, n)) {
+				tls_finish(t, conn);
+				return;
+			}
+		}
+	}
+
+	tls_watch(t, conn, conn->fd, &conn->fdEvents, conn->sslWants);
+	tls_watch(t, conn, conn->relay, &conn->relayEvents,
+			(conn->downLen == 0 ? SOCKETSERVER_POLLER_IN : 0)
+			| (conn->upOff < conn->upLen ? SOCKETSERVER_POLLER_OUT : 0));
+}
+
+/*
+ * The handshake is done: hand the socket over with kTLS if the kernel
+ * has taken the session, otherwise start relaying.
+ */
+static void tls_established(tls_thread *t, tls_conn *conn)
+{
+	socketserver_tls *tls = t->tls;
+	socketserver_msg arrival = conn->arrival;
+	int sv[2];
+
+	tls_unlink(t, conn);
+	SOCKETSERVER_STAT_ADD(tls->stats, tlsHandshakes, 1);
+	/* Like a preread connection, it is ready when the handshake is done. */
+	arrival.acceptedAt = socketserver_now();
+
+#if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+	if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) && BIO_get_ktls_recv(SSL_get_rbio(conn->ssl))
+			&& !SSL_has_pending(conn->ssl)) {
+		int fd = conn->fd;
+
+		socketserver_pollerDel(t->poller, fd);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		conn->fd = -1;
+		SOCKETSERVER_STAT_ADD(tls->stats, tlsKtls, 1);
+		tls_pass(tls, fd, &arrival);
+		/* The socket BIO does not close the fd. */
+		tls_finish(t, conn);
+		return;
+	}
+#endif
+
+	conn->up = (unsigned char *)malloc(TLS_RELAY_BUFSIZE);
+	conn->down = (unsigned char *)malloc(TLS_RELAY_BUFSIZE);
+	if (conn->up == NULL || conn->down == NULL || socketserver_ownedSocketpair(SOCK_STREAM, sv) != 0) {
+		tls_finish(t, conn);
+		return;
+	}
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	if (socketserver_pollerAdd(t->poller, sv[0], SOCKETSERVER_POLLER_IN, conn) < 0) {
+		socketserver_closeOwnedFd(sv[0]);
+		socketserver_closeOwnedFd(sv[1]);
+		tls_finish(t, conn);
+		return;
+	}
+	conn->relay = sv[0];
+	conn->relayEvents = SOCKETSERVER_POLLER_IN;
+	conn->list = TLS_LIST_RELAY;
+	conn->next = t->relays;
+	if (t->relays != NULL) {
+		t->relays->prev = conn;
+	}
+	t->relays = conn;
+	/* The worker's end is a unix socket, so it needs to be told who the client is. */
+	if (arrival.peer.family != 0) {
+		arrival.flags |= SOCKETSERVER_MSGF_PEER;
+	}
+	SOCKETSERVER_STAT_ADD(tls->stats, tlsRelayed, 1);
+	tls_pass(tls, sv[1], &arrival);
+	tls_pump(t, conn);
+}
+
+static void tls_handshake(tls_thread *t, tls_conn *conn)
+{
+	int result;
+
+	conn->sslWants = 0;
+	ERR_clear_error();
+	result = SSL_accept(conn->ssl);
+	if (result == 1) {
+		tls_established(t, conn);
+	} else if (tls_wants(conn, result)) {
+		tls_watch(t, conn, conn->fd, &conn->fdEvents, conn->sslWants);
+	} else {
+		SOCKETSERVER_STAT_ADD(t->tls->stats, tlsErrors, 1);
+		tls_finish(t, conn);
+	}
+}
+
+static void tls_begin(tls_thread *t, tls_conn *conn)
+{
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	conn->ssl = SSL_new(t->tls->ctx);
+	if (conn->ssl == NULL || SSL_set_fd(conn->ssl, conn->fd) != 1
+			|| socketserver_pollerAdd(t->poller, conn->fd, SOCKETSERVER_POLLER_IN, conn) < 0) {
+		SOCKETSERVER_STAT_ADD(t->tls->stats, tlsErrors, 1);
+		/* Not in the poller, so it must not be removed from it. */
+		socketserver_closeOwnedFd(conn->fd);
+		conn->fd = -1;
+		tls_finish(t, conn);
+		return;
+	}
+	conn->fdEvents = SOCKETSERVER_POLLER_IN;
+	SSL_set_accept_state(conn->ssl);
+	conn->list = TLS_LIST_HANDSHAKE;
+	/* By deadline, those without one last.  A new handshake normally
+	 * has the latest deadline, unless -prereadtimeout changed. */
+	conn->prev = t->hsTail;
+	if (conn->deadline != 0) {
+		while (conn->prev != NULL && (conn->prev->deadline == 0 || conn->prev->deadline > conn->deadline)) {
+			conn->prev = conn->prev->prev;
+		}
+	}
+	conn->next = conn->prev != NULL ? conn->prev->next : t->hsHead;
+	if (conn->prev != NULL) {
+		conn->prev->next = conn;
+	} else {
+		t->hsHead = conn;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn;
+	} else {
+		t->hsTail = conn;
+	}
+	tls_handshake(t, conn);
+}
+
+/*
+ * Start the handshakes the acceptor has sent.
+ *
+ * Returns: 1 when the thread should exit.
+ */
+static int tls_jobs(tls_thread *t)
+{
+	tls_conn *jobs, *conn, *oldest = NULL;
+	int stopping;
+
+	tls_drainWake(t->wakeRead);
+	pthread_mutex_lock(&t->tls->mutex);
+	jobs = t->jobs;
+	t->jobs = NULL;
+	stopping = t->tls->stopping;
+	pthread_mutex_unlock(&t->tls->mutex);
+
+	while (jobs != NULL) {
+		conn = jobs;
+		jobs = conn->nextPtr;
+		conn->nextPtr = oldest;
+		oldest = conn;
+	}
+	while (oldest != NULL) {
+		conn = oldest;
+		oldest = conn->nextPtr;
+		if (stopping) {
+			socketserver_closeOwnedFd(conn->fd);
+			free(conn);
+		} else {
+			tls_begin(t, conn);
+		}
+	}
+	return stopping;
+}
+
+/*
+ * Close the handshakes that have run past their deadline.  The list is
+ * in deadline order with those that have none at the end, so the first
+ * handshake without one ends the search.
+ */
+static void tls_expire(tls_thread *t)
+{
+	unsigned long long now = socketserver_now();
+
+	while (t->hsHead != NULL && t->hsHead->deadline != 0 && t->hsHead->deadline <= now) {
+		SOCKETSERVER_STAT_ADD(t->tls->stats, tlsErrors, 1);
+		tls_finish(t, t->hsHead);
+	}
+}
+
+static void * tls_threadMain(void *arg)
+{
+	tls_thread *t = (tls_thread *)arg;
+	void *ptrs[SOCKETSERVER_POLLER_MAXEVENTS];
+	int events[SOCKETSERVER_POLLER_MAXEVENTS];
+	int stop = 0;
+
+	while (!stop) {
+		int i, n, timeout = -1;
+
+		if (t->hsHead != NULL && t->hsHead->deadline != 0) {
+			unsigned long long now = socketserver_now();
+			timeout = t->hsHead->deadline > now ? (int)(t->hsHead->deadline - now) : 0;
+		}
+		n = socketserver_pollerWait(t->poller, timeout, ptrs, events);
+		for (i = 0; i < n && !stop; i++) {
+			tls_conn *conn = (tls_conn *)ptrs[i];
+
+			if (ptrs[i] == &t->wakeRead) {
+				stop = tls_jobs(t);
+			} else if (conn->dead) {
+				continue;
+			} else if (conn->list == TLS_LIST_HANDSHAKE) {
+				tls_handshake(t, conn);
+			} else {
+				tls_pump(t, conn);
+			}
+		}
+		tls_expire(t);
+		while (t->graveyard != NULL) {
+			tls_conn *conn = t->graveyard;
+			t->graveyard = conn->nextPtr;
+			free(conn);
+		}
+	}
+
+	while (t->hsHead != NULL) {
+		tls_finish(t, t->hsHead);
+	}
+	while (t->relays != NULL) {
+		tls_finish(t, t->relays);
+	}
+	while (t->graveyard != NULL) {
+		tls_conn *conn = t->graveyard;
+		t->graveyard = conn->nextPtr;
+		free(conn);
+	}
+	return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * socketserver_tlsNew --
+ *
+ *      Load the certificate chain and key for "server -tlscert", so a
+ *      bad file is reported by the command rather than by the first
+ *      handshake.  Kernel TLS is asked for where OpenSSL has it.
+ *
+ * Results:
+ *      The TLS state for the port, or NULL with an error in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+socketserver_tls *socketserver_tlsNew(Tcl_Interp *interp, const char *certFile, const char *keyFile, int threads)
+{
+	socketserver_tls *tls;
+	SSL_CTX *ctx;
+	int i;
+
+	ERR_clear_error();
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj("could not create the TLS context", -1));
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	/* The relay retries writes from where its buffer has got to. */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+	if (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1
+			|| SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(ctx) != 1) {
+		char buf[256];
+
+		ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not load the TLS certificate and key: %s", buf));
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	tls = (socketserver_tls *)calloc(1, sizeof(socketserver_tls));
+	if (tls != NULL) {
+		tls->threads = (tls_thread *)calloc(threads, sizeof(tls_thread));
+	}
+	if (tls == NULL || tls->threads == NULL) {
+		free(tls);
+		SSL_CTX_free(ctx);
+		Tcl_SetObjResult(interp, Tcl_NewStringObj("could not allocate the TLS threads", -1));
+		return NULL;
+	}
+	tls->ctx = ctx;
+	tls->threadCount = threads;
+	pthread_mutex_init(&tls->mutex, NULL);
+	tls->readyTail = &tls->ready;
+	tls->readyRead = tls->readyFd = -1;
+	for (i = 0; i < threads; i++) {
+		tls->threads[i].tls = tls;
+		tls->threads[i].wakeRead = tls->threads[i].wakeFd = -1;
+	}
+	return tls;
+}
+
+/*
+ * Start the TLS threads, from the acceptor thread.
+ *
+ * Returns: the fd the acceptor watches for finished handshakes, or -1.
+ */
+int socketserver_tlsStart(socketserver_tls *tls, socketserver_stats *stats)
+{
+	int sv[2];
+	int i;
+
+	tls->stats = stats;
+	if (socketserver_ownedSocketpair(SOCK_STREAM, sv) != 0) {
+		return -1;
+	}
+	tls->readyRead = sv[0];
+	tls->readyFd = sv[1];
+	for (i = 0; i < tls->threadCount; i++) {
+		tls_thread *t = &tls->threads[i];
+
+		if (socketserver_ownedSocketpair(SOCK_STREAM, sv) != 0) {
+			return -1;
+		}
+		t->wakeRead = sv[0];
+		t->wakeFd = sv[1];
+		if ((t->poller = socketserver_pollerNew()) == NULL
+				|| socketserver_pollerAdd(t->poller, t->wakeRead, SOCKETSERVER_POLLER_IN, &t->wakeRead) < 0
+				|| pthread_create(&t->thread, NULL, tls_threadMain, t) != 0) {
+			return -1;
+		}
+		t->started = 1;
+	}
+	return tls->readyRead;
+}
+
+/*
+ * Give a new connection to a TLS thread, from the acceptor.  The
+ * handshake must be done within timeout ms, 0 for no limit.
+ *
+ * Returns: 0 for success, -1 if the connection was not taken.
+ */
+int socketserver_tlsAccept(socketserver_tls *tls, int fd, const socketserver_msg *arrival, int timeout)
+{
+	tls_conn *conn = (tls_conn *)calloc(1, sizeof(tls_conn));
+	tls_thread *t;
+
+	if (conn == NULL) {
+		return -1;
+	}
+	conn->fd = fd;
+	conn->relay = -1;
+	conn->arrival = *arrival;
+	conn->deadline = timeout > 0 ? socketserver_now() + timeout : 0;
+
+	t = &tls->threads[tls->nextThread];
+	tls->nextThread = (tls->nextThread + 1) % tls->threadCount;
+	pthread_mutex_lock(&tls->mutex);
+	conn->nextPtr = t->jobs;
+	t->jobs = conn;
+	tls->busy++;
+	pthread_mutex_unlock(&tls->mutex);
+	tls_wake(t->wakeFd);
+	return 0;
+}
+
+/*
+ * Take a connection whose handshake is done, from the acceptor.
+ *
+ * Returns: 1 with the plaintext fd and its description, or 0 when there
+ * are no more.
+ */
+int socketserver_tlsReady(socketserver_tls *tls, int *fdPtr, socketserver_msg *arrival)
+{
+	tls_ready *ready;
+	int pass;
+
+	/* Drain the wakeups before looking again, so none is lost. */
+	for (pass = 0; pass < 2; pass++) {
+		pthread_mutex_lock(&tls->mutex);
+		ready = tls->ready;
+		if (ready != NULL) {
+			tls->ready = ready->nextPtr;
+			if (tls->ready == NULL) {
+				tls->readyTail = &tls->ready;
+			}
+		}
+		pthread_mutex_unlock(&tls->mutex);
+		if (ready != NULL) {
+			*fdPtr = ready->fd;
+			*arrival = ready->arrival;
+			free(ready);
+			return 1;
+		}
+		if (pass == 0) {
+			tls_drainWake(tls->readyRead);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns: 1 while the TLS threads hold connections, in a handshake or
+ * relaying, or have some for the acceptor.
+ */
+int socketserver_tlsBusy(socketserver_tls *tls)
+{
+	int busy;
+
+	pthread_mutex_lock(&tls->mutex);
+	busy = tls->busy > 0 || tls->ready != NULL;
+	pthread_mutex_unlock(&tls->mutex);
+	return busy;
+}
+
+/*
+ * Stop the TLS threads and close every connection they hold, then
+ * release the TLS state.  Called by the acceptor when it exits, or by the
+ * command if the acceptor could not be started.
+ */
+void socketserver_tlsFree(socketserver_tls *tls)
+{
+	int i;
+
+	pthread_mutex_lock(&tls->mutex);
+	tls->stopping = 1;
+	pthread_mutex_unlock(&tls->mutex);
+	for (i = 0; i < tls->threadCount; i++) {
+		if (tls->threads[i].started) {
+			tls_wake(tls->threads[i].wakeFd);
+			pthread_join(tls->threads[i].thread, NULL);
+		}
+	}
+	for (i = 0; i < tls->threadCount; i++) {
+		tls_thread *t = &tls->threads[i];
+
+		while (t->jobs != NULL) {
+			tls_conn *conn = t->jobs;
+			t->jobs = conn->nextPtr;
+			socketserver_closeOwnedFd(conn->fd);
+			free(conn);
+		}
+		if (t->poller != NULL) {
+			socketserver_pollerFree(t->poller);
+		}
+		if (t->wakeRead != -1) {
+			socketserver_closeOwnedFd(t->wakeRead);
+			socketserver_closeOwnedFd(t->wakeFd);
+		}
+	}
+	while (tls->ready != NULL) {
+		tls_ready *ready = tls->ready;
+		tls->ready = ready->nextPtr;
+		socketserver_closeOwnedFd(ready->fd);
+		free(ready);
+	}
+	if (tls->readyRead != -1) {
+		socketserver_closeOwnedFd(tls->readyRead);
+		socketserver_closeOwnedFd(tls->readyFd);
+	}
+	pthread_mutex_destroy(&tls->mutex);
+	SSL_CTX_free(tls->ctx);
+	free(tls->threads);
+	free(tls);
+}
+
+/* vim: set ts=4 sw=4 sts=4 noet : */
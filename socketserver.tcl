@@ -1,9 +1,98 @@
 #
-# sockerserver support functions
+# socketserver support functions
 #
 
-namespace eval ::sockerserver  {
-} ;# namespace ::sockeetserver
+namespace eval ::socketserver  {
+} ;# namespace ::socketserver
 
-# vim: set ts=4 sw=4 sts=4 noet :
+#
+# Channel helpers for handlers started with
+# ::socketserver::socket client -coroutine.  The channel is non-blocking;
+# whenever an operation would block, the coroutine yields and is resumed
+# by a fileevent on the channel.
+#
+namespace eval ::socketserver::co {
+	namespace export gets read puts flush wait
+
+	#
+	# wait - yield the current coroutine until chan is readable or writable
+	#
+	proc wait {chan event} {
+		set coro [info coroutine]
+		if {$coro eq ""} {
+			error "::socketserver::co::wait must be called from a coroutine"
+		}
+		fileevent $chan $event [list $coro]
+		try {
+			yield
+		} finally {
+			if {$chan in [chan names]} {
+				fileevent $chan $event {}
+			}
+		}
+	}
+
+	#
+	# gets - like gets, but yields until a whole line or eof arrives
+	#
+	proc gets {chan {varName ""}} {
+		while {[set count [::gets $chan line]] < 0} {
+			if {[eof $chan]} {
+				break
+			}
+			wait $chan readable
+		}
+		if {$varName eq ""} {
+			return $line
+		}
+		upvar 1 $varName var
+		set var $line
+		return $count
+	}
 
+	#
+	# read - read numChars characters, or up to eof when numChars is omitted
+	#
+	proc read {chan {numChars ""}} {
+		set data ""
+		while {![eof $chan]} {
+			if {$numChars eq ""} {
+				append data [::read $chan]
+			} else {
+				append data [::read $chan [expr {$numChars - [string length $data]}]]
+				if {[string length $data] >= $numChars} {
+					break
+				}
+			}
+			if {[fblocked $chan]} {
+				wait $chan readable
+			}
+		}
+		return $data
+	}
+
+	#
+	# puts - queue output on the channel and flush it without blocking
+	#
+	proc puts {args} {
+		::puts {*}$args
+		# puts ?-nonewline? ?channel? string
+		if {[llength $args] == 1 || ([llength $args] == 2 && [lindex $args 0] eq "-nonewline")} {
+			flush stdout
+		} else {
+			flush [lindex $args end-1]
+		}
+	}
+
+	#
+	# flush - yield until all queued output has been written
+	#
+	proc flush {chan} {
+		::flush $chan
+		while {[chan pending output $chan] > 0} {
+			wait $chan writable
+		}
+	}
+} ;# namespace ::socketserver::co
+
+# vim: set ts=4 sw=4 sts=4 noet :
@@ -0,0 +1,84 @@
+package require socketserver
+
+# Check of -allow, -deny and -proxyfrom.  Without -proxy the lists filter
+# the socket's peer; with -proxy they filter the PROXY header's address,
+# and only -proxyfrom peers may send a header.  Uses 127.0.0.2 as a
+# second local address.  Exits 1 on failure.
+#
+#   tclsh allow_deny.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7708}]
+set proxyPort [expr {$port + 1}]
+set failed 0
+
+::socketserver::socket server -allow {127.0.0.2} $port
+::socketserver::socket server -proxy 1 -proxyfrom {127.0.0.2} -allow {192.0.2.0/24} \
+		-deny {192.0.2.128/25} $proxyPort
+
+proc handle_accept {port chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "[lindex [::socketserver::peer $chan] 0] $line"
+	close $chan
+	::socketserver::socket client -port $port [list handle_accept $port]
+}
+foreach p [list $port $proxyPort] {
+	::socketserver::socket client -port $p [list handle_accept $p]
+}
+
+proc collect {sock} {
+	if {[catch {read $sock} data] || [eof $sock]} {
+		close $sock
+		set ::reply($sock) [string trim $::partial($sock)]
+		return
+	}
+	append ::partial($sock) $data
+}
+
+# Send data to port from the local address from, and return what comes back.
+proc ask {from port data} {
+	set sock [socket -myaddr $from 127.0.0.1 $port]
+	set ::partial($sock) ""
+	fconfigure $sock -translation binary -blocking 0
+	puts -nonewline $sock $data
+	flush $sock
+	fileevent $sock readable [list collect $sock]
+	vwait ::reply($sock)
+	return $::reply($sock)
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor threads start listening on their own.
+after 300 {set ready 1}
+vwait ready
+
+check "peer denied" [ask 127.0.0.1 $port "hello\r\n"] ""
+check "peer allowed" [ask 127.0.0.2 $port "hello\r\n"] "127.0.0.2 hello"
+
+set header "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443\r\n"
+check "header from a stranger" [ask 127.0.0.1 $proxyPort "${header}hello\r\n"] ""
+check "header from the balancer" [ask 127.0.0.2 $proxyPort "${header}hello\r\n"] "192.0.2.1 hello"
+set header "PROXY TCP4 192.0.2.130 198.51.100.1 56324 443\r\n"
+check "denied client" [ask 127.0.0.2 $proxyPort "${header}hello\r\n"] ""
+set header "PROXY TCP4 198.51.100.7 198.51.100.1 56324 443\r\n"
+check "client not allowed" [ask 127.0.0.2 $proxyPort "${header}hello\r\n"] ""
+
+check "denied stat" [dict get [::socketserver::socket stats -port $port] denied] 1
+check "denied stat with -proxy" [dict get [::socketserver::socket stats -port $proxyPort] denied] 3
+
+# An empty list turns the filter off, once the accept thread has woken.
+::socketserver::socket server -allow {} $port
+after 100 {set woken 1}
+vwait woken
+check "filter off" [ask 127.0.0.1 $port "hello\r\n"] "127.0.0.1 hello"
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,123 @@
+package require socketserver
+
+# Check of -queuetarget/-queueinterval: connections wait in the master
+# for a worker that asks for one.  A connection nobody asked for within
+# -queueinterval is dropped with the -shed-response.  Once the queue has
+# stayed non-empty longer than -queueinterval, the newest connections are
+# served first.  Exits 1 on failure.
+#
+#   tclsh codel_queue.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7713}]
+set failed 0
+
+::socketserver::socket server -queuetarget 2000 -queueinterval 300 -shed-response "busy\r\n" $port
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	lappend ::order $line
+	puts $chan "served $line"
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		lappend ::replies($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		lappend ::replies($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	# Channel names are reused once closed.
+	set ::replies($sock) {}
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+# The next line from sock, or eof.
+proc await {sock} {
+	while {![info exists ::replies($sock)] || [llength $::replies($sock)] == 0} {
+		vwait ::replies($sock)
+	}
+	set ::replies($sock) [lassign $::replies($sock) line]
+	return $line
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc pause {ms} {
+	after $ms {set ::paused 1}
+	vwait ::paused
+}
+
+proc send {name} {
+	set sock [connect]
+	puts $sock $name
+	flush $sock
+	set ::sock($name) $sock
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+# No worker has asked yet.  c waits -queueinterval and is dropped; the
+# queue has then been non-empty for longer than that, so it is LIFO.
+send c
+pause 200
+send d
+pause 200
+send e
+pause 50
+send f
+check "pending" [stat pending 3] 3
+check "dropped" [await $sock(c)] busy
+check "queueDropped" [stat queueDropped 1] 1
+
+set order {}
+::socketserver::socket client -port $port handle_accept
+check "newest first" [await $sock(f)] "served f"
+check "then the next newest" [await $sock(e)] "served e"
+check "order" [lrange $order 0 1] {f e}
+
+# Once the queue is empty a new connection goes straight to the worker.
+await $sock(d)
+check "drained" [stat pending 0] 0
+set sock(g) [connect]
+check "served at once" [ask $sock(g) g] "served g"
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,133 @@
+package require socketserver
+
+# Check of -coroutine: one worker serves many clients at once.  Every
+# client sends its lines in two halves, interleaved with the other
+# clients, and the next line only after all clients got the previous
+# reply, so a worker serving one connection at a time never finishes.
+# All replies must come from the same pid.  With Tclx the worker is a
+# forked child, otherwise this process serves.  Exits 1 on failure.
+#
+#   tclsh coroutine_server.tcl ?port? ?clients?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 8888}]
+set nclients [expr {$argc > 1 ? [lindex $argv 1] : 20}]
+set nlines 3
+set failed 0
+
+::socketserver::socket server $port
+
+proc handle_accept {fd} {
+	fconfigure $fd -encoding utf-8 -translation lf
+	while {[::socketserver::co::gets $fd line] >= 0} {
+		if {$line eq "quit"} {
+			break
+		}
+		::socketserver::co::puts $fd "[pid] $line"
+	}
+	close $fd
+}
+
+proc do_client {} {
+	::socketserver::socket client -port $::port -coroutine -maxconcurrent 100 handle_accept
+}
+
+set worker [pid]
+if {[catch {package require Tclx}]} {
+	do_client
+} else {
+	set worker [fork]
+	if {$worker == 0} {
+		do_client
+		vwait forever
+	}
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc finish {code} {
+	if {$::worker != [pid]} {
+		kill $::worker
+	}
+	exit $code
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		lappend ::replies($sock) $line
+		incr ::pending -1
+	} elseif {[eof $sock]} {
+		close $sock
+		incr ::pending -1
+	}
+}
+
+after 20000 {puts "FAIL timed out"; finish 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+set socks {}
+for {set i 0} {$i < $nclients} {incr i} {
+	set sock [socket 127.0.0.1 $port]
+	fconfigure $sock -translation lf -buffering none
+	set replies($sock) {}
+	lappend socks $sock
+}
+for {set line 0} {$line < $nlines} {incr line} {
+	set i 0
+	foreach sock $socks {
+		puts -nonewline $sock "client $i "
+		incr i
+	}
+	update
+	set i 0
+	foreach sock $socks {
+		puts $sock "line $line"
+		incr i
+	}
+	set pending $nclients
+	foreach sock $socks {
+		fileevent $sock readable [list collect $sock]
+	}
+	while {$pending > 0} {
+		vwait pending
+	}
+}
+set pending $nclients
+foreach sock $socks {
+	puts $sock quit
+}
+while {$pending > 0} {
+	vwait pending
+}
+
+set pids {}
+set bad 0
+set i 0
+foreach sock $socks {
+	set want {}
+	for {set line 0} {$line < $nlines} {incr line} {
+		lappend want "client $i line $line"
+	}
+	set got {}
+	foreach reply $replies($sock) {
+		lappend pids [lindex $reply 0]
+		lappend got [lrange $reply 1 end]
+	}
+	if {$got ne $want} {
+		puts "FAIL client $i: got \"$got\""
+		incr bad
+	}
+	incr i
+}
+check "all replies" $bad 0
+check "one pid" [lsort -unique $pids] $worker
+
+finish [expr {$failed > 0}]
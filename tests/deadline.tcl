@@ -0,0 +1,94 @@
+package require socketserver
+
+# Check of -deadline: a handler blocked on a client that never sends is
+# released by the master after -deadline ms, and a connection the worker
+# closes in time is not counted.  Exits 1 on failure.
+#
+#   tclsh deadline.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7711}]
+set failed 0
+
+::socketserver::socket server -deadline 500 $port
+
+proc handle_accept {chan} {
+	set start [clock milliseconds]
+	if {[gets $chan line] >= 0} {
+		puts $chan "served $line"
+	} else {
+		set ::blocked [expr {[clock milliseconds] - $start}]
+	}
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+::socketserver::socket client -port $port handle_accept
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		set ::reply($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		set ::reply($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+proc await {sock} {
+	unset -nocomplain ::reply($sock)
+	vwait ::reply($sock)
+	return $::reply($sock)
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+# The handler blocks this process until the master shuts the socket down.
+set sock [connect]
+check "released" [await $sock] eof
+check "blocked for -deadline" [expr {$blocked >= 400 && $blocked < 2000}] 1
+check "deadlineExpired" [stat deadlineExpired 1] 1
+
+set sock [connect]
+check "served in time" [ask $sock one] "served one"
+after 700 {set waited 1}
+vwait waited
+check "not expired" [stat deadlineExpired 1] 1
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,112 @@
+package require socketserver
+
+# Check of accepting with no fds left.  The script runs itself again with
+# ulimit -n 64 as a server with -preread, and opens more clients than that
+# from here that send nothing, so the accept thread holds them all.  The
+# ones over the limit must be closed and counted, and the server must
+# serve again once the clients have gone.  Exits 1 on failure.
+#
+#   tclsh fd_exhaustion.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7720}]
+set failed 0
+
+if {[lindex $argv 1] eq "limited"} {
+	::socketserver::socket server -preread 16 -prereadtimeout 0 $port
+	proc handle_accept {chan} {
+		gets $chan line
+		puts $chan "served $line"
+		close $chan
+		::socketserver::socket client -port $::port handle_accept
+	}
+	::socketserver::socket client -port $port handle_accept
+	proc command {} {
+		if {[gets stdin] eq "stats"} {
+			puts [::socketserver::socket stats -port $::port]
+			flush stdout
+		} else {
+			exit 0
+		}
+	}
+	fileevent stdin readable command
+	after 300 {puts ready; flush stdout}
+	vwait forever
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		set ::result($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		if {![info exists ::result($sock)]} {
+			set ::result($sock) eof
+		}
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -blocking 0
+	fileevent $sock readable [list collect $sock]
+	# Channel names are reused once closed.
+	unset -nocomplain ::result($sock)
+	return $sock
+}
+
+# Send a command to the server and return its answer.
+proc tell {command} {
+	puts $::server $command
+	flush $::server
+	return [gets $::server]
+}
+
+proc sleep {ms} {
+	after $ms {set ::slept 1}
+	vwait ::slept
+}
+
+after 20000 {puts "FAIL timed out"; exit 1}
+
+set server [open [list | sh -c {ulimit -n 64 && exec "$@"} sh [info nameofexecutable] [info script] $port limited] r+]
+check "started" [gets $server] ready
+
+set socks {}
+for {set i 0} {$i < 80} {incr i} {
+	lappend socks [connect]
+}
+sleep 1000
+set closed 0
+foreach sock $socks {
+	if {[info exists result($sock)] && $result($sock) eq "eof"} {
+		incr closed
+	}
+}
+check "closed over the limit" [expr {$closed > 0}] 1
+set stats [tell stats]
+check "fdExhausted" [expr {[dict get $stats fdExhausted] > 0}] 1
+check "acceptBackoffs" [expr {[dict get $stats acceptBackoffs] > 0}] 1
+
+# The accept thread closes the clients that go away.
+foreach sock $socks {
+	catch {close $sock}
+}
+# It may still be backing off.
+sleep 1100
+set sock [connect]
+puts $sock hello
+flush $sock
+vwait result($sock)
+check "served again" $result($sock) "served hello"
+
+tell exit
+catch {close $server}
+exit [expr {$failed > 0}]
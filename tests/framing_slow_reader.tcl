@@ -0,0 +1,77 @@
+package require socketserver
+
+# Regression check for ::socketserver::reply: a framed connection whose
+# client stops reading must not hold up the other framed connections of
+# the worker.  Exits 1 on failure.
+#
+#   tclsh framing_slow_reader.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7705}]
+set failed 0
+# More than the socket buffers of both ends hold
+set bigSize 50000000
+
+::socketserver::socket server $port
+
+proc handle_message {fd message} {
+	if {[::socketserver::eof $fd]} {
+		::socketserver::close $fd
+		return
+	}
+	if {$message eq "big"} {
+		::socketserver::reply $fd [string repeat x $::bigSize]
+	} else {
+		::socketserver::reply $fd "small"
+	}
+	::socketserver::close $fd
+}
+::socketserver::socket client -port $port -framing line -maxconcurrent 10 handle_message
+
+proc collect {sock} {
+	if {[catch {read $sock} data] || [eof $sock]} {
+		close $sock
+		set ::reply($sock) $::partial($sock)
+		return
+	}
+	append ::partial($sock) $data
+}
+
+# Send a message, and collect the reply once asked to.
+proc ask {message} {
+	set sock [socket 127.0.0.1 $::port]
+	set ::partial($sock) ""
+	fconfigure $sock -translation binary -blocking 0
+	puts -nonewline $sock "$message\n"
+	flush $sock
+	return $sock
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 30000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+set slow [ask big]
+after 300 {set ready 1}
+vwait ready
+set quick [ask small]
+fileevent $quick readable [list collect $quick]
+set start [clock milliseconds]
+vwait ::reply($quick)
+check quick $::reply($quick) "small\n"
+check "quick in time" [expr {[clock milliseconds] - $start < 1000}] 1
+
+fileevent $slow readable [list collect $slow]
+vwait ::reply($slow)
+check slow [string length $::reply($slow)] [expr {$bigSize + 1}]
+
+exit [expr {$failed > 0}]
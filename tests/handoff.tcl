@@ -0,0 +1,76 @@
+package require socketserver
+
+# Check of the handoff messages: connections sent with their first bytes
+# pile up in the socketpair before a worker reads any, and each must come
+# out with its own bytes and fd.  Exits 1 on failure.
+#
+#   tclsh handoff.tcl ?port? ?clients?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7722}]
+set nclients [expr {$argc > 1 ? [lindex $argv 1] : 50}]
+set failed 0
+
+::socketserver::socket server -preread 512 $port
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation lf
+	gets $chan line
+	puts $chan "[lindex [::socketserver::peer $chan] 1] $line"
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		set ::reply($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		incr ::pending -1
+	}
+}
+
+after 20000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+# Lines of different lengths, so a message read short or long shows.
+set pending 0
+for {set i 0} {$i < $nclients} {incr i} {
+	set sock [socket 127.0.0.1 $port]
+	fconfigure $sock -translation lf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	set line($sock) "$i [string repeat x [expr {$i * 7 % 400}]]"
+	set clientPort($sock) [lindex [fconfigure $sock -sockname] 2]
+	puts $sock $line($sock)
+	flush $sock
+	incr pending
+}
+for {set i 0} {$i < 100 && [dict get [::socketserver::socket stats -port $port] queued] < $nclients} {incr i} {
+	after 20 {set tick 1}
+	vwait tick
+}
+check "all queued" [dict get [::socketserver::socket stats -port $port] queued] $nclients
+
+::socketserver::socket client -port $port handle_accept
+while {$pending > 0} {
+	vwait pending
+}
+set bad 0
+foreach sock [array names line] {
+	if {![info exists reply($sock)] || $reply($sock) ne "$clientPort($sock) $line($sock)"} {
+		incr bad
+	}
+}
+check "each got its own bytes" $bad 0
+
+exit [expr {$failed > 0}]
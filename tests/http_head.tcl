@@ -0,0 +1,80 @@
+package require socketserver
+
+# Check of "client -http": the request head is parsed in C, repeated
+# headers are joined, blank lines before the request line are skipped,
+# body bytes that came with the head are read from the channel, and bad,
+# oversized and slow heads get 400, 431 and 408.  Exits 1 on failure.
+#
+#   tclsh http_head.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7707}]
+set failed 0
+
+::socketserver::socket server $port
+
+proc handle_http {chan method target version headers} {
+	fconfigure $chan -translation binary
+	set body ""
+	if {[dict exists $headers content-length]} {
+		set body [read $chan [dict get $headers content-length]]
+	}
+	puts -nonewline $chan [list $method $target $version $headers $body]
+	close $chan
+	::socketserver::socket client -port $::port -http -maxhead 256 -headtimeout 500 handle_http
+}
+::socketserver::socket client -port $port -http -maxhead 256 -headtimeout 500 handle_http
+
+proc collect {sock} {
+	if {[catch {read $sock} data] || [eof $sock]} {
+		close $sock
+		set ::reply($sock) $::partial($sock)
+		return
+	}
+	append ::partial($sock) $data
+}
+
+# Send request, and return what comes back.
+proc ask {request} {
+	set sock [socket 127.0.0.1 $::port]
+	set ::partial($sock) ""
+	fconfigure $sock -translation binary -blocking 0
+	puts -nonewline $sock $request
+	flush $sock
+	fileevent $sock readable [list collect $sock]
+	vwait ::reply($sock)
+	return $::reply($sock)
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc status {reply} {
+	return [lindex [split $reply \r] 0]
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+check simple [ask "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n"] \
+		[list GET /a HTTP/1.1 {host example.com} {}]
+check repeated [ask "GET /b HTTP/1.0\r\nX-A: 1\r\nx-a:  2 \r\n\r\n"] \
+		[list GET /b HTTP/1.0 {x-a {1, 2}} {}]
+check "leading blank lines" [ask "\r\n\r\nGET /z HTTP/1.1\r\nX-A: 1\r\n\r\n"] \
+		[list GET /z HTTP/1.1 {x-a 1} {}]
+check body [ask "POST /p HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"] \
+		[list POST /p HTTP/1.1 {content-length 5} hello]
+check malformed [status [ask "garbage\r\n\r\n"]] "HTTP/1.1 400 Bad Request"
+check "bad header" [status [ask "GET / HTTP/1.1\r\nno colon\r\n\r\n"]] "HTTP/1.1 400 Bad Request"
+check oversized [status [ask "GET / HTTP/1.1\r\nX-Big: [string repeat x 300]\r\n\r\n"]] \
+		"HTTP/1.1 431 Request Header Fields Too Large"
+check slow [status [ask "GET / HTTP/1.1\r\n"]] "HTTP/1.1 408 Request Timeout"
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,64 @@
+package require socketserver
+
+# Check of -fd and systemd socket activation.  The script runs itself
+# again under a python3 stand-in for systemd that passes a listening
+# socket as fd 3, named "web" in LISTEN_FDNAMES.  Skipped without
+# python3.  Exits 1 on failure.
+#
+#   tclsh inherited_fd.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7719}]
+set failed 0
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+if {[lindex $argv 1] ne "inherited"} {
+	if {[auto_execok python3] eq ""} {
+		puts "skipped: no python3"
+		exit 0
+	}
+	set activate {
+import os, socket, sys
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", int(sys.argv[1])))
+listener.listen(16)
+os.dup2(listener.fileno(), 3)
+os.set_inheritable(3, True)
+env = dict(os.environ, LISTEN_PID=str(os.getpid()), LISTEN_FDS="1", LISTEN_FDNAMES="web")
+os.execve(sys.argv[2], sys.argv[2:], env)
+	}
+	set child [open [list | python3 -c $activate $port [info nameofexecutable] [info script] $port inherited 2>@1] r]
+	puts -nonewline [read $child]
+	exit [catch {close $child}]
+}
+
+proc handle_accept {chan} {
+	puts $chan "served"
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+
+check "unknown name" [catch {::socketserver::socket server -fd nope $port}] 1
+check "not a socket" [catch {::socketserver::socket server -fd 0 $port}] 1
+check "by name" [catch {::socketserver::socket server -fd web $port}] 0
+::socketserver::socket client -port $port handle_accept
+
+# The accept thread starts on its own; the socket already listens.
+after 5000 {puts "FAIL timed out"; exit 1}
+set sock [socket 127.0.0.1 $port]
+fconfigure $sock -blocking 0
+fileevent $sock readable {set reply [gets $sock]}
+vwait reply
+check "served" $reply served
+close $sock
+check "accepted" [dict get [::socketserver::socket stats -port $port] accepted] 1
+
+exit [expr {$failed > 0}]
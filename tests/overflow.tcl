@@ -0,0 +1,78 @@
+package require socketserver
+
+# Check of -overflow: with no worker reading, connections fill the
+# socketpair and then wait in the master, and beyond -overflow of those
+# they are refused with the -shed-response.  Nothing else is lost: every
+# other client is served once a worker starts.  Exits 1 on failure.
+#
+#   tclsh overflow.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7721}]
+set failed 0
+
+::socketserver::socket server -overflow 5 -shed-response "busy\n" $port
+
+proc handle_accept {chan} {
+	puts $chan served
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		incr ::count($line)
+	} elseif {[eof $sock]} {
+		close $sock
+		incr ::pending -1
+	}
+}
+
+proc stat {name} {
+	return [dict get [::socketserver::socket stats -port $::port] $name]
+}
+
+proc sleep {ms} {
+	after $ms {set ::slept 1}
+	vwait ::slept
+}
+
+after 30000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+sleep 300
+
+set count(served) 0
+set count(busy) 0
+set pending 0
+set clients 0
+while {[stat overflowDropped] == 0 && $clients < 5000} {
+	for {set i 0} {$i < 50} {incr i} {
+		set sock [socket 127.0.0.1 $port]
+		fconfigure $sock -blocking 0
+		fileevent $sock readable [list collect $sock]
+		incr pending
+		incr clients
+	}
+	sleep 50
+}
+check "overflowed" [expr {[stat overflowed] > 0}] 1
+check "socketpair full" [expr {[stat queued] > 0}] 1
+check "refused over -overflow" [expr {[stat overflowDropped] > 0}] 1
+check "no send errors" [stat sendErrors] 0
+
+::socketserver::socket client -port $port handle_accept
+while {$pending > 0} {
+	vwait pending
+}
+check "refused were told" $count(busy) [stat overflowDropped]
+check "the rest served" [expr {$count(served) + $count(busy)}] $clients
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,101 @@
+package require socketserver
+
+# Check of parking: a parked connection goes back to a worker with its
+# next request, one the client closes is dropped without a worker, and
+# one idle longer than -parktimeout is closed.  Exits 1 on failure.
+#
+#   tclsh park_idle.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7710}]
+set failed 0
+
+::socketserver::socket server -parktimeout 500 $port
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "served $line"
+	flush $chan
+	::socketserver::socket park $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+::socketserver::socket client -port $port handle_accept
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		set ::reply($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		set ::reply($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+proc await {sock} {
+	unset -nocomplain ::reply($sock)
+	vwait ::reply($sock)
+	return $::reply($sock)
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+set sock [connect]
+check "first request" [ask $sock one] "served one"
+check "parked" [stat parked 1] 1
+check "idle" [stat idle 1] 1
+check "next request" [ask $sock two] "served two"
+check "parked again" [stat parked 2] 2
+check "dispatched" [stat dispatched 2] 2
+set start [clock milliseconds]
+check "idle timeout" [await $sock] eof
+set waited [expr {[clock milliseconds] - $start}]
+check "closed after -parktimeout" [expr {$waited >= 400 && $waited < 2000}] 1
+check "parkTimeouts" [stat parkTimeouts 1] 1
+check "idle after timeout" [stat idle 0] 0
+
+set sock [connect]
+check "request" [ask $sock three] "served three"
+check "idle before close" [stat idle 1] 1
+close $sock
+check "client closed" [stat idle 0] 0
+check "no worker woken" [stat dispatched 3] 3
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,119 @@
+package require socketserver
+
+# Check of pause, resume and -highwater/-lowwater.  A paused port leaves
+# new clients in the listen backlog until it is resumed.  With watermarks
+# the master stops accepting while -highwater connections wait for a
+# worker, and starts again at -lowwater.  Exits 1 on failure.
+#
+#   tclsh pause_resume.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7715}]
+set failed 0
+
+::socketserver::socket server -highwater 2 -lowwater 0 $port
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "served $line"
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		lappend ::replies($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		lappend ::replies($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	# Channel names are reused once closed.
+	set ::replies($sock) {}
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+# The next line from sock, or eof.
+proc await {sock} {
+	while {![info exists ::replies($sock)] || [llength $::replies($sock)] == 0} {
+		vwait ::replies($sock)
+	}
+	set ::replies($sock) [lassign $::replies($sock) line]
+	return $line
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc send {name} {
+	set sock [connect]
+	puts $sock $name
+	flush $sock
+	set ::sock($name) $sock
+}
+
+proc sleep {ms} {
+	after $ms {set ::slept 1}
+	vwait ::slept
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+::socketserver::socket pause $port
+check "paused" [stat paused 1] 1
+send a
+sleep 200
+check "left in the backlog" [stat accepted 0] 0
+::socketserver::socket resume $port
+check "resumed" [stat paused 0] 0
+check "accepted after resume" [stat accepted 1] 1
+
+# No worker yet: a and b reach -highwater, so c stays in the backlog.
+send b
+check "at highwater" [stat paused 1] 1
+send c
+sleep 200
+check "not accepted over highwater" [stat accepted 2] 2
+
+::socketserver::socket client -port $port handle_accept
+foreach name {a b c} {
+	check "served $name" [await $sock($name)] "served $name"
+}
+check "accepting again" [stat paused 0] 0
+check "all accepted" [stat accepted 3] 3
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,103 @@
+package require socketserver
+
+# Check of the port limits.  The handler holds each connection for
+# 300 ms.  Over -maxinflight or -acceptrate new clients wait in the listen
+# backlog, or with -overlimit shed are refused with the -shed-response.
+# The limits can be changed on a running server.  Exits 1 on failure.
+#
+#   tclsh port_limits.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7733}]
+set backlogPort $port
+set shedPort [expr {$port + 1}]
+set ratePort [expr {$port + 2}]
+set rateShedPort [expr {$port + 3}]
+set failed 0
+
+::socketserver::socket server -maxinflight 2 $backlogPort
+::socketserver::socket server -maxinflight 2 -overlimit shed -shed-response "full\n" $shedPort
+::socketserver::socket server -acceptrate 5 -acceptburst 2 $ratePort
+::socketserver::socket server -acceptrate 5 -acceptburst 2 -overlimit shed -shed-response "rate\n" $rateShedPort
+
+proc handle_accept {chan} {
+	::socketserver::co::gets $chan line
+	after 300 [info coroutine]
+	yield
+	::socketserver::co::puts $chan "ok [lindex [::socketserver::peer $chan] 0]"
+	close $chan
+}
+foreach p [list $backlogPort $shedPort $ratePort $rateShedPort] {
+	::socketserver::socket client -port $p -coroutine -maxconcurrent 100 handle_accept
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	append ::got($sock) [read $sock]
+	if {[eof $sock]} {
+		close $sock
+		incr ::pending -1
+	}
+}
+
+# Open one client per element of headers to p, 20 ms apart, each sending
+# its header and a line, and return what each got back.
+proc clients {p headers} {
+	set socks {}
+	set ::pending 0
+	foreach header $headers {
+		set sock [socket 127.0.0.1 $p]
+		fconfigure $sock -translation binary -blocking 0
+		set ::got($sock) ""
+		fileevent $sock readable [list collect $sock]
+		puts -nonewline $sock "${header}hello\n"
+		flush $sock
+		lappend socks $sock
+		incr ::pending
+		after 20 {set ::slept 1}
+		vwait ::slept
+	}
+	set start [clock milliseconds]
+	while {$::pending > 0} {
+		vwait ::pending
+	}
+	set ::took [expr {[clock milliseconds] - $start}]
+	set result {}
+	foreach sock $socks {
+		lappend result [string trim $::got($sock)]
+	}
+	return $result
+}
+
+proc stat {p name} {
+	return [dict get [::socketserver::socket stats -port $p] $name]
+}
+
+after 15000 {puts "FAIL timed out"; exit 1}
+# The acceptor threads start listening on their own.
+after 300 {set ready 1}
+vwait ready
+
+set ok {ok 127.0.0.1}
+check "-maxinflight" [clients $backlogPort {{} {} {}}] [list $ok $ok $ok]
+check "third waited" [expr {$took >= 500}] 1
+check "limitPauses" [expr {[stat $backlogPort limitPauses] > 0}] 1
+
+check "-maxinflight shed" [clients $shedPort {{} {} {}}] [list $ok $ok full]
+check "limitShed" [stat $shedPort limitShed] 1
+::socketserver::socket server -maxinflight 0 $shedPort
+check "limit turned off" [clients $shedPort {{} {} {}}] [list $ok $ok $ok]
+
+check "-acceptrate" [clients $ratePort {{} {} {}}] [list $ok $ok $ok]
+check "-acceptrate paused" [expr {[stat $ratePort limitPauses] > 0}] 1
+check "-acceptrate shed" [clients $rateShedPort {{} {} {}}] [list $ok $ok rate]
+check "limitShed for rate" [stat $rateShedPort limitShed] 1
+
+exit [expr {$failed > 0}]
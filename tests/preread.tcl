@@ -0,0 +1,98 @@
+package require socketserver
+
+# Check of -preread: the bytes the accept thread reads ahead reach channel,
+# -raw and -framing handlers as if read from the connection, a client
+# that starts slowly is still served, and one that sends nothing is
+# closed after -prereadtimeout.  Exits 1 on failure.
+#
+#   tclsh preread.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7723}]
+set rawPort [expr {$port + 1}]
+set framingPort [expr {$port + 2}]
+set failed 0
+
+foreach p [list $port $rawPort $framingPort] {
+	::socketserver::socket server -preread 1024 -prereadtimeout 500 $p
+}
+
+proc handle_chan {chan} {
+	gets $chan line
+	puts -nonewline $chan "chan:$line"
+	close $chan
+	::socketserver::socket client -port $::port handle_chan
+}
+
+proc handle_raw {fd} {
+	set data [::socketserver::read $fd 3]
+	append data [::socketserver::read $fd 100]
+	::socketserver::write $fd "raw:$data"
+	::socketserver::close $fd
+	::socketserver::socket client -port $::rawPort -raw handle_raw
+}
+
+proc handle_line {fd msg} {
+	if {[::socketserver::eof $fd]} {
+		::socketserver::close $fd
+		return
+	}
+	::socketserver::reply $fd "line:$msg"
+}
+
+::socketserver::socket client -port $port handle_chan
+::socketserver::socket client -port $rawPort -raw handle_raw
+::socketserver::socket client -port $framingPort -framing line -maxconcurrent 4 handle_line
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	append ::got($sock) [read $sock]
+	if {[eof $sock]} {
+		close $sock
+		set ::done($sock) 1
+	}
+}
+
+# Send data to port, after delay ms, and return everything that comes
+# back until the server closes.
+proc ask {p data {delay 0}} {
+	set sock [socket 127.0.0.1 $p]
+	fconfigure $sock -translation binary -blocking 0
+	set ::got($sock) ""
+	unset -nocomplain ::done($sock)
+	fileevent $sock readable [list collect $sock]
+	if {$delay > 0} {
+		after $delay {set ::slept 1}
+		vwait ::slept
+	}
+	if {$data ne ""} {
+		puts -nonewline $sock $data
+		close $sock write
+	}
+	vwait ::done($sock)
+	return $::got($sock)
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor threads start listening on their own.
+after 300 {set ready 1}
+vwait ready
+
+check "channel" [ask $port "hello\n"] "chan:hello"
+check "raw" [ask $rawPort "abcdefg"] "raw:abcdefg"
+check "framing" [ask $framingPort "one\ntwo\n"] "line:one\nline:two\n"
+check "slow start" [ask $port "slow\n" 300] "chan:slow"
+set start [clock milliseconds]
+check "silent client" [ask $port ""] ""
+set waited [expr {[clock milliseconds] - $start}]
+check "closed after -prereadtimeout" [expr {$waited >= 400 && $waited < 2000}] 1
+check "prereadTimeouts" [dict get [::socketserver::socket stats -port $port] prereadTimeouts] 1
+
+exit [expr {$failed > 0}]
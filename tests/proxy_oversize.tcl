@@ -0,0 +1,65 @@
+package require socketserver
+
+# Regression check for -proxy: a PROXY v1 line longer than the 107 bytes
+# the protocol allows must be refused, even when its CRLF is within what
+# the acceptor reads ahead.  Headers up to 107 bytes must still get
+# through.  Exits 1 on failure.
+#
+#   tclsh proxy_oversize.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7703}]
+set failed 0
+
+::socketserver::socket server -proxy 1 -prereadtimeout 1000 $port
+
+proc handle_accept {fd} {
+	fconfigure $fd -translation crlf
+	gets $fd line
+	puts $fd "[lindex [::socketserver::peer $fd] 0] $line"
+	close $fd
+	::socketserver::socket client -port $::port handle_accept
+}
+::socketserver::socket client -port $port handle_accept
+
+proc collect {sock} {
+	if {[catch {read $sock} data] || [eof $sock]} {
+		close $sock
+		set ::reply($sock) [string trim $::partial($sock)]
+		return
+	}
+	append ::partial($sock) $data
+}
+
+# Send header and a request line, and return what comes back.
+proc ask {header} {
+	set sock [socket 127.0.0.1 $::port]
+	set ::partial($sock) ""
+	fconfigure $sock -translation binary -blocking 0
+	puts -nonewline $sock "$header\r\nhello\r\n"
+	flush $sock
+	fileevent $sock readable [list collect $sock]
+	vwait ::reply($sock)
+	return $::reply($sock)
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+check valid [ask "PROXY TCP4 192.0.2.1 198.51.100.1 56324 443"] "192.0.2.1 hello"
+# 105 bytes and CRLF, the longest line allowed
+check longest [ask "PROXY UNKNOWN [string repeat x 91]"] "127.0.0.1 hello"
+check toolong [ask "PROXY UNKNOWN [string repeat x 92]"] ""
+check oversized [ask "PROXY TCP4 [string repeat 1 400]"] ""
+
+exit [expr {$failed > 0}]
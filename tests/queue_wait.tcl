@@ -0,0 +1,98 @@
+package require socketserver
+
+# Check of -maxqueuewait: a connection that waited for a worker longer
+# than that is sent the -queueresponse and closed, and the worker goes on
+# to the next one.  Exits 1 on failure.
+#
+#   tclsh queue_wait.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7712}]
+set failed 0
+
+::socketserver::socket server $port
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "served $line"
+	close $chan
+	serve
+}
+
+proc serve {} {
+	::socketserver::socket client -port $::port -maxqueuewait 200 -queueresponse "busy\r\n" handle_accept
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		set ::reply($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		set ::reply($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+proc await {sock} {
+	unset -nocomplain ::reply($sock)
+	vwait ::reply($sock)
+	return $::reply($sock)
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+# No worker yet, so the first client waits in the socketpair.
+set late [connect]
+puts $late one
+flush $late
+check "queued" [stat queued 1] 1
+after 500 {set waited 1}
+vwait waited
+serve
+check "expired" [await $late] busy
+check "closed" [await $late] eof
+check "queueExpired" [stat queueExpired 1] 1
+
+set sock [connect]
+check "served in time" [ask $sock two] "served two"
+check "still one expired" [stat queueExpired 1] 1
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,76 @@
+package require socketserver
+
+# Regression check for -raw writes: a client that stops reading must not
+# hold up the worker.  Output the socket cannot take is queued, written
+# as the client reads, and still written after ::socketserver::close.
+# Exits 1 on failure.
+#
+#   tclsh raw_slow_reader.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7704}]
+set failed 0
+# More than the socket buffers of both ends hold
+set bigSize 50000000
+
+::socketserver::socket server $port
+
+proc handle_raw {fd} {
+	set request [string trim [::socketserver::read $fd 100]]
+	if {$request eq "big"} {
+		::socketserver::write $fd [string repeat x $::bigSize]
+	} else {
+		::socketserver::writev $fd "small" "\n"
+	}
+	::socketserver::close $fd
+	::socketserver::socket client -port $::port -raw handle_raw
+}
+::socketserver::socket client -port $port -raw handle_raw
+
+proc collect {sock} {
+	if {[catch {read $sock} data] || [eof $sock]} {
+		close $sock
+		set ::reply($sock) $::partial($sock)
+		return
+	}
+	append ::partial($sock) $data
+}
+
+# Send request, and collect the reply in the background.
+proc ask {request} {
+	set sock [socket 127.0.0.1 $::port]
+	set ::partial($sock) ""
+	fconfigure $sock -translation binary -blocking 0
+	puts -nonewline $sock "$request\n"
+	flush $sock
+	return $sock
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 30000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+set slow [ask big]
+after 300 {set ready 1}
+vwait ready
+set quick [ask small]
+fileevent $quick readable [list collect $quick]
+set start [clock milliseconds]
+vwait ::reply($quick)
+check quick $::reply($quick) "small\n"
+check "quick in time" [expr {[clock milliseconds] - $start < 1000}] 1
+
+fileevent $slow readable [list collect $slow]
+vwait ::reply($slow)
+check slow [string length $::reply($slow)] $bigSize
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,105 @@
+package require socketserver
+
+# Check of -route: one port, three worker pools chosen by the client's
+# first bytes, with unmatched clients going to the default workers.  The
+# second port reads ahead too, and routes anything else to a -framing
+# pool.  Exits 1 on failure.
+#
+#   tclsh route.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7726}]
+set prereadPort [expr {$port + 1}]
+set failed 0
+
+::socketserver::socket server -route [list http "GET " http "POST " tls "\x16\x03"] $port
+::socketserver::socket server -preread 512 -route [list http "GET " tls "\x16\x03" line ""] $prereadPort
+
+proc handle_default {p chan} {
+	gets $chan line
+	puts -nonewline $chan "default:$line"
+	close $chan
+	::socketserver::socket client -port $p [list handle_default $p]
+}
+
+proc handle_http {p chan method target version headers} {
+	puts -nonewline $chan "http:$method $target"
+	close $chan
+	::socketserver::socket client -port $p -pool http -http [list handle_http $p]
+}
+
+proc handle_tls {p fd} {
+	binary scan [::socketserver::read $fd 100] H* hex
+	::socketserver::write $fd "tls:$hex"
+	::socketserver::close $fd
+	::socketserver::socket client -port $p -pool tls -raw [list handle_tls $p]
+}
+
+proc handle_line {fd msg} {
+	if {[::socketserver::eof $fd]} {
+		::socketserver::close $fd
+		return
+	}
+	::socketserver::reply $fd "line:$msg"
+}
+
+foreach p [list $port $prereadPort] {
+	::socketserver::socket client -port $p -pool tls -raw [list handle_tls $p]
+	::socketserver::socket client -port $p -pool http -http [list handle_http $p]
+}
+::socketserver::socket client -port $port [list handle_default $port]
+::socketserver::socket client -port $prereadPort -pool line -framing line handle_line
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	append ::got($sock) [read $sock]
+	if {[eof $sock]} {
+		close $sock
+		set ::done($sock) 1
+	}
+}
+
+# Send data to p and return everything that comes back until the server
+# closes.
+proc ask {p data} {
+	set sock [socket 127.0.0.1 $p]
+	fconfigure $sock -translation binary -blocking 0
+	set ::got($sock) ""
+	unset -nocomplain ::done($sock)
+	fileevent $sock readable [list collect $sock]
+	puts -nonewline $sock $data
+	close $sock write
+	vwait ::done($sock)
+	return $::got($sock)
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor threads start listening on their own.
+after 300 {set ready 1}
+vwait ready
+
+check "unknown pool" [catch {::socketserver::socket client -port $port -pool nope handle_default}] 1
+check "bad rules" [catch {::socketserver::socket server -route {a} [expr {$port + 2}]}] 1
+
+set get "GET /x HTTP/1.0\r\n\r\n"
+set post "POST /y HTTP/1.0\r\nContent-Length: 0\r\n\r\n"
+set hello "\x16\x03\x01\x00\x05hello"
+check "GET" [ask $port $get] "http:GET /x"
+check "POST" [ask $port $post] "http:POST /y"
+check "TLS" [ask $port $hello] "tls:1603010005[binary encode hex hello]"
+check "default" [ask $port "other\n"] "default:other"
+check "routed" [dict get [::socketserver::socket stats -port $port] routed] 3
+
+check "GET with -preread" [ask $prereadPort $get] "http:GET /x"
+check "TLS with -preread" [ask $prereadPort $hello] "tls:1603010005[binary encode hex hello]"
+check "catch-all rule" [ask $prereadPort "one\ntwo\n"] "line:one\nline:two\n"
+check "routed with -preread" [dict get [::socketserver::socket stats -port $prereadPort] routed] 3
+
+exit [expr {$failed > 0}]
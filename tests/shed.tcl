@@ -0,0 +1,105 @@
+package require socketserver
+
+# Check of -shed-threshold: while that many connections wait for a worker
+# new ones are sent the -shed-response and closed by the master.  Those
+# already waiting are served once a worker is free.  Exits 1 on failure.
+#
+#   tclsh shed.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7714}]
+set failed 0
+
+::socketserver::socket server -shed-threshold 2 -shed-response "busy\r\n" $port
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "served $line"
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		lappend ::replies($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		lappend ::replies($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	# Channel names are reused once closed.
+	set ::replies($sock) {}
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+# The next line from sock, or eof.
+proc await {sock} {
+	while {![info exists ::replies($sock)] || [llength $::replies($sock)] == 0} {
+		vwait ::replies($sock)
+	}
+	set ::replies($sock) [lassign $::replies($sock) line]
+	return $line
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc send {name} {
+	set sock [connect]
+	puts $sock $name
+	flush $sock
+	set ::sock($name) $sock
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+# No worker yet, so a and b wait in the socketpair.
+send a
+send b
+check "queued" [stat queued 2] 2
+send c
+check "shed" [await $sock(c)] busy
+check "closed" [await $sock(c)] eof
+check "shed stat" [stat shed 1] 1
+
+::socketserver::socket client -port $port handle_accept
+check "waiting served" [await $sock(a)] "served a"
+check "second waiting served" [await $sock(b)] "served b"
+check "below the threshold" [ask [connect] d] "served d"
+check "shed once" [stat shed 1] 1
+
+exit [expr {$failed > 0}]
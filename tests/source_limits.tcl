@@ -0,0 +1,107 @@
+package require socketserver
+
+# Check of the per-client limits.  The handler holds each connection for
+# 300 ms.  -sourcemax refuses a client's second connection, or holds it
+# with -sourcewait until the first closes; -sourcerate refuses a burst
+# beyond -sourceburst; behind -proxy the header's address is counted.
+# Exits 1 on failure.
+#
+#   tclsh source_limits.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7729}]
+set maxPort $port
+set waitPort [expr {$port + 1}]
+set ratePort [expr {$port + 2}]
+set proxyPort [expr {$port + 3}]
+set failed 0
+
+::socketserver::socket server -sourcemax 1 -shed-response "busy\n" $maxPort
+::socketserver::socket server -sourcemax 1 -sourcewait 2000 $waitPort
+::socketserver::socket server -sourcerate 2 -sourceburst 2 -shed-response "rate\n" $ratePort
+::socketserver::socket server -proxy 1 -sourcemax 1 -shed-response "busy\n" $proxyPort
+
+proc handle_accept {chan} {
+	::socketserver::co::gets $chan line
+	after 300 [info coroutine]
+	yield
+	::socketserver::co::puts $chan "ok [lindex [::socketserver::peer $chan] 0]"
+	close $chan
+}
+foreach p [list $maxPort $waitPort $ratePort $proxyPort] {
+	::socketserver::socket client -port $p -coroutine -maxconcurrent 100 handle_accept
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc collect {sock} {
+	append ::got($sock) [read $sock]
+	if {[eof $sock]} {
+		close $sock
+		incr ::pending -1
+	}
+}
+
+# Open one client per element of headers to p, 20 ms apart, each sending
+# its header and a line, and return what each got back.
+proc clients {p headers} {
+	set socks {}
+	set ::pending 0
+	foreach header $headers {
+		set sock [socket 127.0.0.1 $p]
+		fconfigure $sock -translation binary -blocking 0
+		set ::got($sock) ""
+		fileevent $sock readable [list collect $sock]
+		puts -nonewline $sock "${header}hello\n"
+		flush $sock
+		lappend socks $sock
+		incr ::pending
+		after 20 {set ::slept 1}
+		vwait ::slept
+	}
+	set start [clock milliseconds]
+	while {$::pending > 0} {
+		vwait ::pending
+	}
+	set ::took [expr {[clock milliseconds] - $start}]
+	set result {}
+	foreach sock $socks {
+		lappend result [string trim $::got($sock)]
+	}
+	return $result
+}
+
+proc stat {p name} {
+	return [dict get [::socketserver::socket stats -port $p] $name]
+}
+
+after 15000 {puts "FAIL timed out"; exit 1}
+# The acceptor threads start listening on their own.
+after 300 {set ready 1}
+vwait ready
+
+check "-sourcemax" [clients $maxPort {{} {}}] {{ok 127.0.0.1} busy}
+check "sourceRefused" [stat $maxPort sourceRefused] 1
+
+check "-sourcewait" [clients $waitPort {{} {}}] {{ok 127.0.0.1} {ok 127.0.0.1}}
+check "one after the other" [expr {$took >= 500}] 1
+check "sourceHeld" [stat $waitPort sourceHeld] 1
+
+check "-sourcerate" [clients $ratePort {{} {} {}}] {{ok 127.0.0.1} {ok 127.0.0.1} rate}
+after 1000 {set slept 1}
+vwait slept
+check "rate refilled" [clients $ratePort {{}}] {{ok 127.0.0.1}}
+
+set headers {}
+foreach client {192.0.2.1 192.0.2.2 192.0.2.1} {
+	lappend headers "PROXY TCP4 $client 198.51.100.1 5000 80\r\n"
+}
+check "counted by PROXY address" [clients $proxyPort $headers] {{ok 192.0.2.1} {ok 192.0.2.2} busy}
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,133 @@
+package require socketserver
+
+# Check of stop: the listening socket closes at once, connections already
+# accepted are still served, and then -command runs in the master and
+# -stopcommand in the worker.  A port whose connections nobody takes
+# stops after -timeout.  Exits 1 on failure.
+#
+#   tclsh stop_drain.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7716}]
+set idlePort [expr {$port + 1}]
+set failed 0
+
+::socketserver::socket server $port
+::socketserver::socket server $idlePort
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "served $line"
+	close $chan
+	serve
+}
+
+proc serve {} {
+	if {[catch {::socketserver::socket client -port $::port -stopcommand {set ::workerStopped 1} handle_accept}]} {
+		# The socketpair is closed once the port has stopped.
+	}
+}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		lappend ::replies($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		lappend ::replies($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	# Channel names are reused once closed.
+	set ::replies($sock) {}
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+# The next line from sock, or eof.
+proc await {sock} {
+	while {![info exists ::replies($sock)] || [llength $::replies($sock)] == 0} {
+		vwait ::replies($sock)
+	}
+	set ::replies($sock) [lassign $::replies($sock) line]
+	return $line
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc send {name {p ""}} {
+	set sock [socket 127.0.0.1 [expr {$p eq "" ? $::port : $p}]]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	set ::replies($sock) {}
+	puts $sock $name
+	flush $sock
+	set ::sock($name) $sock
+}
+
+after 10000 {puts "FAIL timed out"; exit 1}
+# The acceptor threads start listening on their own.
+after 300 {set ready 1}
+vwait ready
+
+# No worker yet, so a and b wait in the socketpair.
+send a
+send b
+check "queued" [stat queued 2] 2
+::socketserver::socket stop -timeout 3000 -command {set ::stopped [clock milliseconds]} $port
+after 200 {set settled 1}
+vwait settled
+check "listener closed" [catch {socket 127.0.0.1 $port}] 1
+check "not stopped while queued" [info exists stopped] 0
+
+serve
+set served [clock milliseconds]
+check "drained a" [await $sock(a)] "served a"
+check "drained b" [await $sock(b)] "served b"
+if {![info exists stopped]} {
+	vwait stopped
+}
+check "stopped once drained" [expr {$stopped - $served < 1000}] 1
+if {![info exists workerStopped]} {
+	vwait workerStopped
+}
+check "worker told" $workerStopped 1
+
+# Nothing serves idlePort, so its stop waits out -timeout.
+send c $idlePort
+set start [clock milliseconds]
+::socketserver::socket stop -timeout 300 -command {set ::idleStopped [clock milliseconds]} $idlePort
+vwait idleStopped
+set waited [expr {$idleStopped - $start}]
+check "stopped after -timeout" [expr {$waited >= 250 && $waited < 2000}] 1
+
+exit [expr {$failed > 0}]
@@ -0,0 +1,146 @@
+package require socketserver
+
+# Check of -control/-takeover: a second master takes the port over from
+# a running one, which drains and stops.  No client is refused on the
+# way.  The old master is this script run again as a child.  Exits 1 on
+# failure.
+#
+#   tclsh takeover.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7718}]
+set failed 0
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation crlf
+	gets $chan line
+	puts $chan "$::name $line"
+	close $chan
+	serve
+}
+
+proc serve {} {
+	if {[catch {::socketserver::socket client -port $::port -stopcommand stopped handle_accept}]} {
+		# The socketpair is closed once the port has stopped.
+	}
+}
+
+if {[lindex $argv 1] eq "old"} {
+	set name old
+	::socketserver::socket server -deadline 2000 -control [lindex $argv 2] $port
+	proc stopped {} {
+		puts stopped
+		exit 0
+	}
+	serve
+	after 10000 {exit 1}
+	vwait forever
+}
+
+set name new
+set ctl [file join [expr {[info exists env(TMPDIR)] ? $env(TMPDIR) : "/tmp"}] takeover.[pid].ctl]
+proc stopped {} {}
+
+proc collect {sock} {
+	if {[gets $sock line] >= 0} {
+		lappend ::replies($sock) $line
+	} elseif {[eof $sock]} {
+		close $sock
+		lappend ::replies($sock) eof
+	}
+}
+
+proc connect {} {
+	set sock [socket 127.0.0.1 $::port]
+	fconfigure $sock -translation crlf -blocking 0
+	fileevent $sock readable [list collect $sock]
+	# Channel names are reused once closed.
+	set ::replies($sock) {}
+	return $sock
+}
+
+# Send a line and wait for what comes back.
+proc ask {sock line} {
+	puts $sock $line
+	flush $sock
+	return [await $sock]
+}
+
+# The next line from sock, or eof.
+proc await {sock} {
+	while {![info exists ::replies($sock)] || [llength $::replies($sock)] == 0} {
+		vwait ::replies($sock)
+	}
+	set ::replies($sock) [lassign $::replies($sock) line]
+	return $line
+}
+
+# The accept thread updates the counters on its own time.
+proc stat {name want} {
+	for {set i 0} {$i < 100} {incr i} {
+		set got [dict get [::socketserver::socket stats -port $::port] $name]
+		if {$got == $want} {
+			break
+		}
+		after 20 {set ::tick 1}
+		vwait ::tick
+	}
+	return $got
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+proc finish {code} {
+	file delete $::ctl
+	exit $code
+}
+
+# Ask until the old master answers.
+proc first {} {
+	for {set i 0} {$i < 50} {incr i} {
+		if {![catch {socket 127.0.0.1 $::port} sock]} {
+			close $sock
+			return
+		}
+		after 100
+	}
+}
+
+after 15000 {puts "FAIL timed out"; finish 1}
+
+set old [open [list | [info nameofexecutable] [info script] $port old $ctl] r]
+fconfigure $old -blocking 0
+set oldSaid {}
+fileevent $old readable {
+	if {[gets $old line] >= 0} {
+		lappend oldSaid $line
+	} elseif {[eof $old]} {
+		set oldExit [catch {close $old}]
+	}
+}
+first
+check "old master" [ask [connect] a] "old a"
+
+::socketserver::socket server -takeover $ctl -control $ctl $port
+serve
+set answers {}
+for {set i 0} {$i < 20} {incr i} {
+	lappend answers [lindex [ask [connect] $i] 0]
+}
+check "no client refused" [lsearch -all -inline -not -regexp $answers {^(old|new)$}] {}
+check "new master serves" [lindex $answers end] new
+if {![info exists oldExit]} {
+	vwait oldExit
+}
+check "old master stopped" $oldSaid stopped
+check "old master exit status" $oldExit 0
+check "control socket replaced" [file exists $ctl] 1
+check "still served" [ask [connect] b] "new b"
+
+finish [expr {$failed > 0}]
@@ -0,0 +1,93 @@
+package require socketserver
+
+# Loopback check for -tlscert: connections are handshaken in the master
+# and reach the worker as plaintext, handed over with kernel TLS or
+# relayed, in both directions and for replies larger than a TLS record.
+# A self-signed certificate is made with the openssl command, which is
+# also the client.  Exits 1 on failure, 0 with a note when openssl or
+# TLS support is missing.
+#
+#   tclsh tls_loopback.tcl ?port?
+
+set port [expr {$argc > 0 ? [lindex $argv 0] : 7706}]
+set failed 0
+set dir [file join [pwd] tls_loopback.[pid]]
+
+if {[auto_execok openssl] eq ""} {
+	puts "skipped: no openssl command"
+	exit 0
+}
+file mkdir $dir
+set cert [file join $dir cert.pem]
+set key [file join $dir key.pem]
+exec openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+		-keyout $key -out $cert 2>@1
+if {[catch {::socketserver::socket server -tlscert $cert -tlskey $key $port} err]} {
+	file delete -force $dir
+	puts "skipped: $err"
+	exit 0
+}
+
+proc handle_accept {chan} {
+	fconfigure $chan -translation lf
+	gets $chan line
+	puts $chan "[lindex [::socketserver::peer $chan] 0] $line"
+	close $chan
+	::socketserver::socket client -port $::port handle_accept
+}
+::socketserver::socket client -port $port handle_accept
+
+proc collect {client} {
+	if {[catch {read $client} data] || [eof $client]} {
+		catch {close $client}
+		set ::reply($client) [string trimright $::partial($client) \n]
+		return
+	}
+	append ::partial($client) $data
+}
+
+# Send line over TLS, and return what comes back.
+proc ask {line} {
+	set client [open [list | openssl s_client -quiet -connect 127.0.0.1:$::port 2>@1] r+]
+	set ::partial($client) ""
+	# The line must be on its way before the worker, in this process,
+	# reads it.
+	fconfigure $client -translation lf
+	puts $client $line
+	flush $client
+	fconfigure $client -blocking 0
+	fileevent $client readable [list collect $client]
+	vwait ::reply($client)
+	return $::reply($client)
+}
+
+proc check {name got want} {
+	if {$got ne $want} {
+		if {[string length $got] > 100} {
+			set got "[string range $got 0 99]..."
+		}
+		puts "FAIL $name: got \"$got\", want \"$want\""
+		incr ::failed
+	} else {
+		puts "ok $name"
+	}
+}
+
+after 30000 {puts "FAIL timed out"; exit 1}
+# The acceptor thread starts listening on its own.
+after 300 {set ready 1}
+vwait ready
+
+check hello [lindex [split [ask hello] \n] end] "127.0.0.1 hello"
+# Several TLS records each way
+set big [string repeat 0123456789 6000]
+check big [expr {[lindex [split [ask $big] \n] end] eq "127.0.0.1 $big"}] 1
+
+set stats [::socketserver::socket stats -port $port]
+check tlsHandshakes [dict get $stats tlsHandshakes] 2
+check "tlsKtls + tlsRelayed" [expr {[dict get $stats tlsKtls] + [dict get $stats tlsRelayed]}] 2
+check tlsErrors [dict get $stats tlsErrors] 0
+puts "kernel TLS [dict get $stats tlsKtls], relayed [dict get $stats tlsRelayed]"
+
+file delete -force $dir
+exit [expr {$failed > 0}]